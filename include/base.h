@@ -40,6 +40,10 @@ class CoreExport classbase
 	virtual CullResult cull();
 	virtual ~classbase();
  private:
+	/** Set once CullList has culled this object, so it is not culled twice */
+	bool culled;
+	friend class CullList;
+
 	// uncopyable
 	classbase(const classbase&);
 	void operator=(const classbase&);
@@ -43,6 +43,89 @@ class BanItem : public HostItem
 {
 };
 
+/** Collects the lines that joins to one channel would send to its local
+ * members, so that each member is sent them in one write once the joins
+ * are done. Used when a netmerge joins many users to a channel at once,
+ * where writing every JOIN to every member as it happens is quadratic.
+ * Joins of local users are not held back, as they are sent the names list.
+ */
+class CoreExport JoinBatch
+{
+	struct Line
+	{
+		std::string text;
+		CUList except;
+	};
+	std::vector<Line> lines;
+
+ protected:
+	/** Send lines to one local member. By default they are written as they are.
+	 * @param user The member to send to
+	 * @param block The lines, each ending in CR LF
+	 * @param count The number of lines in block
+	 */
+	virtual void Send(LocalUser* user, const std::string& block, unsigned int count);
+
+ public:
+	/** The channel being joined */
+	Channel* const chan;
+
+	JoinBatch(Channel* Chan) : chan(Chan) {}
+	virtual ~JoinBatch() {}
+
+	/** Queue a line for every local member of the channel not in except_list */
+	void Add(const std::string& text, const CUList& except_list);
+
+	/** Send the queued lines to the local members of the channel */
+	void Flush();
+};
+
+/** The NAMES replies for a channel, rendered ahead of time in each of the
+ * styles a member may ask for and split into numeric sized pieces. A style
+ * is built the first time it is asked for, and is then patched as members
+ * join, leave and change, so it need not be built again for every JOIN.
+ * Only used for members, whose NAMES reply shows every member of the channel.
+ */
+class CoreExport NamesCache
+{
+	/** Entries for each style, space separated, or NULL if not built */
+	std::vector<std::string>* styles[4];
+	/** Length a piece may grow to, leaving room for the numeric's header */
+	size_t limit;
+
+	void Insert(std::vector<std::string>& list, const std::string& entry);
+	bool Erase(std::vector<std::string>& list, const std::string& entry);
+
+ public:
+	/** Show every prefix a member has, rather than only the highest (NAMESX) */
+	static const unsigned int ALLPREFIXES = 1;
+	/** Show members as nick!ident@host rather than by nick alone (UHNAMES) */
+	static const unsigned int FULLHOST = 2;
+
+	NamesCache();
+	~NamesCache();
+
+	/** Get the entry for a member in a style */
+	static std::string Entry(Membership* memb, unsigned int style);
+
+	/** Get the pieces of the NAMES reply for a channel, building them if needed
+	 * @param chan The channel which owns this cache
+	 * @param style The ALLPREFIXES and FULLHOST flags wanted
+	 */
+	const std::vector<std::string>& Get(Channel* chan, unsigned int style);
+
+	/** Add a member to every style built so far */
+	void Add(Membership* memb);
+
+	/** Remove a member from every style built so far. This must be called
+	 * before a change to their nick, host or prefixes, and Add after it.
+	 */
+	void Remove(Membership* memb);
+
+	/** Throw away every style, to be built again when next needed */
+	void Clear();
+};
+
 /** Holds all relevent information for a channel.
  * This class represents a channel, and contains its name, modes, topic, topic set time,
  * etc, and an instance of the BanList type.
@@ -51,7 +134,7 @@ class CoreExport Channel : public Extensible
 {
 	/** Connect a Channel to a User
 	 */
-	static Channel* ForceChan(Channel* Ptr, User* user, const std::string &privs, bool bursting, bool created);
+	static Channel* ForceChan(Channel* Ptr, User* user, const std::string &privs, bool bursting, bool created, JoinBatch* batch);
 
 	/** Set default modes for the channel on creation
 	 */
@@ -80,6 +163,11 @@ class CoreExport Channel : public Extensible
 	 */
 	Channel(const std::string &name, time_t ts);
 
+	/** Channels are allocated from a SlabPool
+	 */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	/** The channel's name.
 	 */
 	std::string name;
@@ -92,6 +180,10 @@ class CoreExport Channel : public Extensible
 	 */
 	UserMembList userlist;
 
+	/** NAMES replies for members of this channel
+	 */
+	NamesCache names;
+
 	/** Channel topic.
 	 * If this is an empty string, no channel topic is set.
 	 */
@@ -216,11 +308,13 @@ class CoreExport Channel : public Extensible
 	 * @param cn The channel name to join to. Does not have to exist.
 	 * @param key The key of the channel, if given
 	 * @param override If true, override all join restrictions such as +bkil
+	 * @param batch If not NULL, the channel's local members are sent the join
+	 * when the batch is flushed, rather than now
 	 * @return A pointer to the Channel the user was joined to. A new Channel may have
 	 * been created if the channel did not exist before the user was joined to it.
 	 * If the user could not be joined to a channel, the return value may be NULL.
 	 */
-	static Channel* JoinUser(User *user, const char* cn, bool override, const char* key, bool bursting, time_t TS = 0);
+	static Channel* JoinUser(User *user, const char* cn, bool override, const char* key, bool bursting, time_t TS = 0, JoinBatch* batch = NULL);
 
 	/** Write to a channel, from a user, using va_args for text
 	 * @param user User whos details to prefix the line with
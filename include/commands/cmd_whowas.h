@@ -37,24 +37,62 @@ struct WhowasRequest : public Request
 /* Forward ref for timer */
 class WhoWasMaintainTimer;
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
-
 /** Timer that is used to maintain the whowas list, called once an hour
  */
 extern WhoWasMaintainTimer* timer;
 
-/** A group of users related by nickname
+struct WhoWasGroup;
+
+/** One WHOWAS entry. The entry and all of its strings except the server
+ * name live in a single allocation; server names are interned because a
+ * netsplit adds thousands of entries that all share the same one.
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+struct WhoWasEntry
+{
+	/** Neighbours in the store's time ordered list, oldest first */
+	WhoWasEntry* older;
+	WhoWasEntry* newer;
+	/** Next newer entry for the same nick */
+	WhoWasEntry* next;
+	/** The nick this entry is filed under */
+	WhoWasGroup* group;
+	/** Interned server name */
+	const std::string* server;
+	/** Signon time */
+	time_t signon;
+	/** Time the entry was added */
+	time_t added;
+	/** Bytes allocated for this entry */
+	size_t size;
+	/** Offsets of the strings within data */
+	unsigned short dhost, ident, gecos;
+	/** host, dhost, ident and gecos, each NUL terminated */
+	char data[1];
+
+	inline const char* GetHost() const { return data; }
+	inline const char* GetDisplayedHost() const { return data + dhost; }
+	inline const char* GetIdent() const { return data + ident; }
+	inline const char* GetGecos() const { return data + gecos; }
+};
+
+/** The entries kept for one nick, oldest first
+ */
+struct WhoWasGroup
+{
+	/** The nick, which is the key this group is stored under */
+	const irc::string* nick;
+	WhoWasEntry* first;
+	WhoWasEntry* last;
+	size_t count;
+};
 
 /** Sets of users in the whowas system
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+typedef std::map<irc::string, WhoWasGroup> whowas_users;
 
-/** Sets of time and users in whowas list
+/** Interned server names and how many entries use each
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+typedef std::map<std::string, size_t> whowas_servers;
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -64,13 +102,31 @@ typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
 class CommandWhowas : public Command
 {
   private:
-	/** Whowas container, contains a map of vectors of users tracked by WHOWAS
+	/** Whowas container, contains a map of nicks to the entries tracked by WHOWAS
 	 */
 	whowas_users whowas;
 
-	/** Whowas container, contains a map of time_t to users tracked by WHOWAS
+	/** Server names referenced by entries
+	 */
+	whowas_servers servers;
+
+	/** All entries in the order they were added, used for expiry and eviction
+	 */
+	WhoWasEntry* oldest;
+	WhoWasEntry* newest;
+
+	/** Number of entries, and the bytes used by entries, nick groups and server names
+	 */
+	size_t entries;
+	size_t bytes;
+
+	/** Unlink and free an entry, and its group if that becomes empty */
+	void DeleteEntry(WhoWasEntry* entry);
+
+	/** Evict the oldest entries until the age and memory limits are met,
+	 * then whole nicks, oldest first, until there are few enough of them
 	 */
-	whowas_users_fifo whowas_fifo;
+	void Evict(time_t t);
 
   public:
 	CommandWhowas(Module* parent);
@@ -88,38 +144,6 @@ class CommandWhowas : public Command
 	~CommandWhowas();
 };
 
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
-	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoWasFroup with a user
-	 */
-	WhoWasGroup(User* user);
-	/** Destructor
-	 */
-	~WhoWasGroup();
-};
-
 class WhoWasMaintainTimer : public Timer
 {
   public:
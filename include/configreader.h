@@ -259,6 +259,11 @@ class CoreExport ServerConfig
 	 */
 	int WhoWasMaxKeep;
 
+	/** Max bytes of memory used by WhoWas, or 0 for no limit.
+	 *  When exceeded, the oldest entries are pushed out.
+	 */
+	long WhoWasMaxMemory;
+
 	/** Holds the server name of the local server
 	 * as defined by the administrator.
 	 */
@@ -391,6 +396,11 @@ class CoreExport ServerConfig
 	 */
 	int dns_timeout;
 
+	/** The maximum number of results held in the DNS
+	 * cache before the least recently used are evicted.
+	 */
+	unsigned int dns_cachesize;
+
 	/** The size of the read() buffer in the user
 	 * handling code, used to read data into a user's
 	 * recvQ.
@@ -486,6 +496,10 @@ class CoreExport ServerConfig
 	 */
 	bool NoUserDns;
 
+	/** If set to true, time command handlers and module hooks for STATS F
+	 */
+	bool Profile;
+
 	/** If set to true, provide syntax hints for unknown commands
 	 */
 	bool SyntaxHints;
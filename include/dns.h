@@ -35,6 +35,28 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "socket.h"
 #include "hashcomp.h"
 
+/**
+ * Query and resource record types
+ */
+enum QueryType
+{
+	/** Uninitialized Query */
+	DNS_QUERY_NONE	= 0,
+	/** 'A' record: an ipv4 address */
+	DNS_QUERY_A	= 1,
+	/** 'CNAME' record: An alias */
+	DNS_QUERY_CNAME	= 5,
+	/** 'PTR' record: a hostname */
+	DNS_QUERY_PTR	= 12,
+	/** 'AAAA' record: an ipv6 address */
+	DNS_QUERY_AAAA	= 28,
+
+	/** Force 'PTR' to use IPV4 scemantics */
+	DNS_QUERY_PTR4	= 0xFFFD,
+	/** Force 'PTR' to use IPV6 scemantics */
+	DNS_QUERY_PTR6	= 0xFFFE
+};
+
 /**
  * Result status, used internally
  */
@@ -53,14 +75,18 @@ class CoreExport DNSResult
 	/** The original request, a hostname or IP address
 	 */
 	std::string original;
+	/** The type of the original request
+	 */
+	QueryType type;
 
 	/** Build a DNS result.
 	 * @param i The request ID
 	 * @param res The request result, a hostname or IP
 	 * @param timetolive The request time-to-live
 	 * @param orig The original request, a hostname or IP
+	 * @param qt The type of the original request
 	 */
-	DNSResult(int i, const std::string &res, unsigned long timetolive, const std::string &orig) : id(i), result(res), ttl(timetolive), original(orig) { }
+	DNSResult(int i, const std::string &res, unsigned long timetolive, const std::string &orig, QueryType qt = DNS_QUERY_NONE) : id(i), result(res), ttl(timetolive), original(orig), type(qt) { }
 };
 
 /**
@@ -79,6 +105,25 @@ class CoreExport CachedQuery
 	/** The time when the item is due to expire
 	 */
 	time_t expires;
+	/** The time-to-live the item was cached with
+	 */
+	unsigned int ttl;
+	/** Number of lookups answered from this item since it was
+	 * last fetched from the DNS server
+	 */
+	unsigned int hits;
+	/** True if a refresh of this item is in flight
+	 */
+	bool refreshing;
+	/** The name or IP which was looked up
+	 */
+	std::string source;
+	/** The type of the lookup (PTR lookups are stored as DNS_QUERY_PTR)
+	 */
+	QueryType type;
+	/** Position of this item in the cache's least recently used list
+	 */
+	std::list<irc::string>::iterator lru;
 
 	/** Build a cached query
 	 * @param res The result data, an IP or hostname
@@ -100,6 +145,14 @@ typedef nspace::hash_map<irc::string, CachedQuery, nspace::hash_compare<irc::str
 typedef nspace::hash_map<irc::string, CachedQuery, irc::hash> dnscache;
 #endif
 
+/** Request ids of the queries in flight, keyed on the same name and type key as the cache
+ */
+#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
+typedef nspace::hash_map<irc::string, int, nspace::hash_compare<irc::string> > dnsinflight;
+#else
+typedef nspace::hash_map<irc::string, int, irc::hash> dnsinflight;
+#endif
+
 /**
  * Error types that class Resolver can emit to its error method.
  */
@@ -113,27 +166,6 @@ enum ResolverError
 	RESOLVER_FORCEUNLOAD	=	5
 };
 
-/**
- * Query and resource record types
- */
-enum QueryType
-{
-	/** Uninitialized Query */
-	DNS_QUERY_NONE	= 0,
-	/** 'A' record: an ipv4 address */
-	DNS_QUERY_A	= 1,
-	/** 'CNAME' record: An alias */
-	DNS_QUERY_CNAME	= 5,
-	/** 'PTR' record: a hostname */
-	DNS_QUERY_PTR	= 12,
-	/** 'AAAA' record: an ipv6 address */
-	DNS_QUERY_AAAA	= 28,
-
-	/** Force 'PTR' to use IPV4 scemantics */
-	DNS_QUERY_PTR4	= 0xFFFD,
-	/** Force 'PTR' to use IPV6 scemantics */
-	DNS_QUERY_PTR6	= 0xFFFE
-};
 
 /**
  * Used internally to force PTR lookups to use a certain protocol scemantics,
@@ -291,20 +323,97 @@ class CoreExport DNS : public EventHandler
 	static const int MAX_REQUEST_ID = 0xFFFF;
 
 	/**
-	 * A counter used to form part of the pseudo-random id
+	 * Every request id, shuffled as they are used. The first
+	 * freeids entries are the ids which are free to be used,
+	 * the rest are held by requests or Resolver classes.
 	 */
-	int currid;
+	unsigned short idpool[MAX_REQUEST_ID];
+
+	/**
+	 * Position of each request id within idpool
+	 */
+	unsigned short idpos[MAX_REQUEST_ID];
+
+	/**
+	 * Number of ids at the start of idpool which are free
+	 */
+	int freeids;
 
 	/**
 	 * Currently cached items
 	 */
 	dnscache* cache;
 
+	/**
+	 * Keys of the cached items, most recently used first
+	 */
+	std::list<irc::string> cachelru;
+
+	/**
+	 * Queries in flight, so that identical lookups can share them
+	 */
+	dnsinflight inflight;
+
+	/**
+	 * Resolver classes waiting on a request id in addition to
+	 * the one in Classes, because they made the same lookup
+	 * while it was in flight.
+	 */
+	std::multimap<int, Resolver*> waiters;
+
+	/**
+	 * Deadlines of the requests in flight, in the order the
+	 * requests were sent, paired with the request id.
+	 */
+	std::deque<std::pair<time_t, int> > timeouts;
+
 	/** A timer which ticks every hour to remove expired
 	 * items from the DNS cache.
 	 */
 	class CacheTimer* PruneTimer;
 
+	/** A timer which ticks every second to time out requests
+	 */
+	class RequestTimeout* TimeoutTimer;
+
+	/**
+	 * Take a random id from the free part of idpool
+	 */
+	int AllocateId();
+
+	/**
+	 * Return an id to the pool, if neither a request nor
+	 * a Resolver class is still using it
+	 */
+	void ReleaseId(int id);
+
+	/**
+	 * Remove and return every Resolver class waiting on an id
+	 */
+	void TakeResolvers(int id, std::vector<Resolver*> &out);
+
+	/**
+	 * Forget a request in flight, so later lookups start a new one
+	 */
+	void EndInFlight(int id, const std::string &source, QueryType qt);
+
+	/**
+	 * Build the key an item is cached under
+	 */
+	static irc::string CacheKey(const std::string &source, QueryType qt);
+
+	/**
+	 * Store (or replace) a result in the cache, evicting the
+	 * least recently used item if the cache is full
+	 */
+	void AddCache(const std::string &source, QueryType qt, const std::string &result, unsigned int ttl);
+
+	/**
+	 * Send a new query for a cached item which is in frequent
+	 * use, so that it is replaced before it expires
+	 */
+	void RefreshCache(CachedQuery* cq);
+
 	/**
 	 * Build a dns packet payload
 	 */
@@ -315,7 +424,8 @@ class CoreExport DNS : public EventHandler
 	irc::sockets::sockaddrs myserver;
 
 	/**
-	 * Currently active Resolver classes
+	 * Currently active Resolver classes (the first to be
+	 * added for each request; any more are kept in waiters)
 	 */
 	Resolver* Classes[MAX_REQUEST_ID];
 
@@ -389,6 +499,24 @@ class CoreExport DNS : public EventHandler
 	 */
 	DNSRequest* AddQuery(DNSHeader *header, int &id, const char* original);
 
+	/**
+	 * Start a lookup of the given type, returning the request id
+	 * or -1 on failure. DNS_QUERY_PTR4 and DNS_QUERY_PTR6 select
+	 * the reverse lookup scemantics.
+	 */
+	int StartQuery(const std::string &source, QueryType qt);
+
+	/**
+	 * Find a lookup of the given name and type which is already
+	 * in flight, returning its request id or -1 if there is none
+	 */
+	int FindInFlight(const std::string &source, QueryType qt);
+
+	/**
+	 * Time out all requests whose deadline has passed
+	 */
+	void TimeoutRequests(time_t now);
+
 	/**
 	 * The constructor initialises the dns socket,
 	 * and clears the request lists.
@@ -417,25 +545,29 @@ class CoreExport DNS : public EventHandler
 	 */
 	void CleanResolvers(Module* module);
 
-	/** Return the cached value of an IP or hostname
+	/** Return the cached value of an IP or hostname.
+	 * This counts as a use of the item, and may start
+	 * a refresh of it if it is close to expiry.
 	 * @param source An IP or hostname to find in the cache.
+	 * @param qt The type of lookup
 	 * @return A pointer to a CachedQuery if the item exists,
 	 * otherwise NULL.
 	 */
-	CachedQuery* GetCache(const std::string &source);
+	CachedQuery* GetCache(const std::string &source, QueryType qt);
 
 	/** Delete a cached item from the DNS cache.
 	 * @param source An IP or hostname to remove
+	 * @param qt The type of lookup
 	 */
-	void DelCache(const std::string &source);
+	void DelCache(const std::string &source, QueryType qt);
 
 	/** Clear all items from the DNS cache immediately.
 	 */
 	int ClearCache();
 
 	/** Prune the DNS cache, e.g. remove all expired
-	 * items and rehash the cache buckets, but leave
-	 * items in the hash which are still valid.
+	 * items, but leave items in the hash which are
+	 * still valid.
 	 */
 	int PruneCache();
 };
@@ -0,0 +1,284 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_FLAT_HASH_MAP_H
+#define INSPIRCD_FLAT_HASH_MAP_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <iterator>
+#include <utility>
+
+namespace irc
+{
+	/** A hash table which keeps its items in one flat array, probing
+	 * linearly from the hashed slot. Lookups touch a handful of adjacent
+	 * slots rather than following a chain of separately allocated nodes.
+	 *
+	 * This implements the parts of the hash_map interface used by the
+	 * user and channel lists. Erasing an item does not move any others,
+	 * so iterators stay valid across erase(), but like hash_map they are
+	 * all invalidated when an insert makes the table grow.
+	 */
+	template<typename K, typename V, typename Hash, typename Equal>
+	class flat_hash_map
+	{
+	 public:
+		typedef K key_type;
+		typedef V mapped_type;
+		typedef std::pair<const K, V> value_type;
+		typedef size_t size_type;
+
+	 private:
+		enum SlotState { SLOT_EMPTY = 0, SLOT_FULL = 1, SLOT_DELETED = 2 };
+
+		/** The items; only those whose state is SLOT_FULL are constructed */
+		value_type* slots;
+		unsigned char* states;
+		/** Number of slots, always zero or a power of two */
+		size_t cap;
+		size_t used;
+		size_t deleted;
+		Hash hasher;
+		Equal equal;
+
+		friend class iterator;
+		friend class const_iterator;
+
+		/** Find the slot holding a key, or cap if there is none */
+		size_t locate(const K& key) const
+		{
+			if (!used)
+				return cap;
+			size_t mask = cap - 1;
+			for (size_t i = hasher(key) & mask; ; i = (i + 1) & mask)
+			{
+				if (states[i] == SLOT_EMPTY)
+					return cap;
+				if (states[i] == SLOT_FULL && equal(slots[i].first, key))
+					return i;
+			}
+		}
+
+		/** Move every item into a new array of the given size */
+		void rebuild(size_t newcap)
+		{
+			value_type* oldslots = slots;
+			unsigned char* oldstates = states;
+			size_t oldcap = cap;
+
+			slots = static_cast<value_type*>(::operator new(newcap * sizeof(value_type)));
+			states = new unsigned char[newcap];
+			memset(states, SLOT_EMPTY, newcap);
+			cap = newcap;
+			deleted = 0;
+
+			size_t mask = cap - 1;
+			for (size_t i = 0; i < oldcap; i++)
+			{
+				if (oldstates[i] != SLOT_FULL)
+					continue;
+				size_t j = hasher(oldslots[i].first) & mask;
+				while (states[j] != SLOT_EMPTY)
+					j = (j + 1) & mask;
+				new (&slots[j]) value_type(oldslots[i]);
+				states[j] = SLOT_FULL;
+				oldslots[i].~value_type();
+			}
+			::operator delete(oldslots);
+			delete[] oldstates;
+		}
+
+		void destroy()
+		{
+			for (size_t i = 0; i < cap; i++)
+				if (states[i] == SLOT_FULL)
+					slots[i].~value_type();
+			::operator delete(slots);
+			delete[] states;
+			slots = NULL;
+			states = NULL;
+			cap = used = deleted = 0;
+		}
+
+	 public:
+		class const_iterator;
+
+		class iterator
+		{
+			friend class flat_hash_map;
+			friend class const_iterator;
+			const flat_hash_map* map;
+			size_t pos;
+
+			void skip()
+			{
+				while (pos < map->cap && map->states[pos] != SLOT_FULL)
+					pos++;
+			}
+		 public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef typename flat_hash_map::value_type value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef value_type* pointer;
+			typedef value_type& reference;
+
+			iterator() : map(NULL), pos(0) { }
+			iterator(const flat_hash_map* m, size_t p) : map(m), pos(p) { skip(); }
+
+			value_type& operator*() const { return map->slots[pos]; }
+			value_type* operator->() const { return &map->slots[pos]; }
+			iterator& operator++() { pos++; skip(); return *this; }
+			iterator operator++(int) { iterator tmp = *this; ++*this; return tmp; }
+			bool operator==(const iterator& other) const { return pos == other.pos; }
+			bool operator!=(const iterator& other) const { return pos != other.pos; }
+		};
+
+		class const_iterator
+		{
+			const flat_hash_map* map;
+			size_t pos;
+
+			void skip()
+			{
+				while (pos < map->cap && map->states[pos] != SLOT_FULL)
+					pos++;
+			}
+		 public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef const typename flat_hash_map::value_type value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef value_type* pointer;
+			typedef value_type& reference;
+
+			const_iterator() : map(NULL), pos(0) { }
+			const_iterator(const flat_hash_map* m, size_t p) : map(m), pos(p) { skip(); }
+			const_iterator(const iterator& other) : map(other.map), pos(other.pos) { }
+
+			const value_type& operator*() const { return map->slots[pos]; }
+			const value_type* operator->() const { return &map->slots[pos]; }
+			const_iterator& operator++() { pos++; skip(); return *this; }
+			const_iterator operator++(int) { const_iterator tmp = *this; ++*this; return tmp; }
+			bool operator==(const const_iterator& other) const { return pos == other.pos; }
+			bool operator!=(const const_iterator& other) const { return pos != other.pos; }
+		};
+
+		flat_hash_map() : slots(NULL), states(NULL), cap(0), used(0), deleted(0) { }
+
+		explicit flat_hash_map(const Hash& h) : slots(NULL), states(NULL), cap(0), used(0), deleted(0), hasher(h) { }
+
+		flat_hash_map(const flat_hash_map& other) : slots(NULL), states(NULL), cap(0), used(0), deleted(0), hasher(other.hasher), equal(other.equal)
+		{
+			for (const_iterator i = other.begin(); i != other.end(); ++i)
+				insert(*i);
+		}
+
+		flat_hash_map& operator=(const flat_hash_map& other)
+		{
+			if (this != &other)
+			{
+				clear();
+				for (const_iterator i = other.begin(); i != other.end(); ++i)
+					insert(*i);
+			}
+			return *this;
+		}
+
+		~flat_hash_map()
+		{
+			destroy();
+		}
+
+		iterator begin() { return iterator(this, 0); }
+		iterator end() { return iterator(this, cap); }
+		const_iterator begin() const { return const_iterator(this, 0); }
+		const_iterator end() const { return const_iterator(this, cap); }
+
+		size_t size() const { return used; }
+		bool empty() const { return !used; }
+		size_t bucket_count() const { return cap; }
+
+		iterator find(const K& key) { return iterator(this, locate(key)); }
+		const_iterator find(const K& key) const { return const_iterator(this, locate(key)); }
+		size_t count(const K& key) const { return locate(key) != cap; }
+
+		std::pair<iterator, bool> insert(const value_type& item)
+		{
+			size_t pos = locate(item.first);
+			if (pos != cap)
+				return std::make_pair(iterator(this, pos), false);
+
+			/* Keep at least a quarter of the slots empty, so that probes stay short */
+			if ((used + deleted + 1) * 4 > cap * 3)
+			{
+				size_t newcap = 16;
+				while (newcap < (used + 1) * 2)
+					newcap *= 2;
+				rebuild(newcap);
+			}
+
+			size_t mask = cap - 1;
+			pos = hasher(item.first) & mask;
+			while (states[pos] == SLOT_FULL)
+				pos = (pos + 1) & mask;
+			if (states[pos] == SLOT_DELETED)
+				deleted--;
+			new (&slots[pos]) value_type(item);
+			states[pos] = SLOT_FULL;
+			used++;
+			return std::make_pair(iterator(this, pos), true);
+		}
+
+		V& operator[](const K& key)
+		{
+			size_t pos = locate(key);
+			if (pos != cap)
+				return slots[pos].second;
+			return insert(value_type(key, V())).first->second;
+		}
+
+		void erase(iterator it)
+		{
+			size_t pos = it.pos;
+			slots[pos].~value_type();
+			used--;
+			/* A slot nothing probes past can go straight back to being empty */
+			if (states[(pos + 1) & (cap - 1)] == SLOT_EMPTY)
+			{
+				states[pos] = SLOT_EMPTY;
+			}
+			else
+			{
+				states[pos] = SLOT_DELETED;
+				deleted++;
+			}
+		}
+
+		size_t erase(const K& key)
+		{
+			size_t pos = locate(key);
+			if (pos == cap)
+				return 0;
+			erase(iterator(this, pos));
+			return 1;
+		}
+
+		void clear()
+		{
+			destroy();
+		}
+	};
+}
+
+#endif
@@ -21,6 +21,9 @@
 #include <map>
 #include <set>
 #include "hash_map.h"
+#ifdef HAS_STDINT
+#include <stdint.h>
+#endif
 
 /*******************************************************
  * This file contains classes and templates that deal
@@ -99,6 +102,23 @@ namespace irc
 		bool operator()(const std::string& s1, const std::string& s2) const;
 	};
 
+	/** Hashes a string case insensitively, like StrHashComp compares them.
+	 * This is SipHash-1-3 over the casefolded string, keyed with a random
+	 * seed, so names which collide cannot be worked out in advance.
+	 */
+	struct CoreExport insensitive_hash
+	{
+		uint64_t k0, k1;
+
+		/** Pick a random seed */
+		insensitive_hash();
+
+		/** Use a given seed */
+		insensitive_hash(uint64_t seed0, uint64_t seed1) : k0(seed0), k1(seed1) { }
+
+		size_t operator()(const std::string& s) const;
+	};
+
 	/** The irc_char_traits class is used for RFC-style comparison of strings.
 	 * This class is used to implement irc::string, a case-insensitive, RFC-
 	 * comparing string class.
@@ -77,10 +77,12 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "socketengine.h"
 #include "snomasks.h"
 #include "filelogger.h"
+#include "profiler.h"
 #include "modules.h"
 #include "threadengine.h"
 #include "configreader.h"
 #include "inspstring.h"
+#include "stringpool.h"
 #include "protocol.h"
 
 #ifndef PATH_MAX
@@ -208,6 +210,10 @@ class serverstats
 	 * due to timeouts and other latency issues.
 	 */
 	unsigned long statsDnsBad;
+	/** Number of DNS lookups which were attached to an identical
+	 * query already in flight instead of sending a new one
+	 */
+	unsigned long statsDnsCoalesced;
 	/** Number of inbound connections seen
 	 */
 	unsigned long statsConnects;
@@ -227,7 +233,7 @@ class serverstats
 	 */
 	serverstats()
 		: statsAccept(0), statsRefused(0), statsUnknown(0), statsCollisions(0), statsDns(0),
-		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0)
+		statsDnsGood(0), statsDnsBad(0), statsDnsCoalesced(0), statsConnects(0), statsSent(0), statsRecv(0)
 	{
 	}
 };
@@ -394,6 +400,10 @@ class CoreExport InspIRCd
 	 */
 	serverstats* stats;
 
+	/** Times command handlers and module hooks, for STATS F
+	 */
+	Profiler Profile;
+
 	/**  Server Config class, holds configuration file data
 	 */
 	ServerConfig* Config;
@@ -419,6 +429,10 @@ class CoreExport InspIRCd
 	 */
 	UserManager *Users;
 
+	/** Shared copies of strings repeated across many users, such as server names
+	 */
+	StringPool Strings;
+
 	/** Channel list, a hash_map containing all channels XXX move to channel manager class
 	 */
 	chan_hash* chanlist;
@@ -806,9 +820,9 @@ class CoreExport InspIRCd
 	 */
 	void Cleanup();
 
-	/** This copies the user and channel hash_maps into new hash maps.
-	 * This frees memory used by the hash_map allocator (which it neglects
-	 * to free, most of the time, using tons of ram)
+	/** This copies the user and channel hashes into new hashes, with new seeds.
+	 * This frees memory held by slots of deleted items, which the hashes
+	 * never give back by themselves.
 	 */
 	void RehashUsersAndChans();
 
@@ -95,6 +95,8 @@ class CoreExport StreamSocket : public EventHandler
 {
 	/** Module that handles raw I/O for this socket, or NULL */
 	reference<Module> IOHook;
+	/** Directions of the stream which no longer pass through the IOHook */
+	int IOHookBypass;
 	/** Private send queue. Note that individual strings may be shared
 	 */
 	std::deque<std::string> sendq;
@@ -105,10 +107,29 @@ class CoreExport StreamSocket : public EventHandler
  protected:
 	std::string recvq;
  public:
-	StreamSocket() : sendq_len(0) {}
+	/** Most data handed to an IOHook in one write. Small queued lines are
+	 * packed together up to this size, which is the largest TLS record.
+	 */
+	static const size_t IOHOOK_WRITE_SIZE = 16384;
+
+	/** Directions which may be passed to BypassIOHook() */
+	enum { BYPASS_READ = 1, BYPASS_WRITE = 2 };
+
+	StreamSocket() : IOHookBypass(0), sendq_len(0) {}
 	inline Module* GetIOHook();
 	inline void AddIOHook(Module* m);
 	inline void DelIOHook();
+	/** Read or write directly on the socket from now on, without going
+	 * through the IOHook. This is for hooks which have handed their work to
+	 * the kernel, such as kernel TLS. The hook stays attached, so it is still
+	 * asked about the connection and told when it closes.
+	 * @param directions BYPASS_READ, BYPASS_WRITE or both
+	 */
+	inline void BypassIOHook(int directions) { IOHookBypass |= directions; }
+	/** Get the directions which bypass the IOHook, for hooks which stack
+	 * themselves over another hook and must do its bypassed I/O themselves
+	 */
+	inline int GetIOHookBypass() { return IOHookBypass; }
 	/** Handle event from socket engine.
 	 * This will call OnDataReady if there is *new* data in recvq
 	 */
@@ -222,6 +243,6 @@ class CoreExport BufferedSocket : public StreamSocket
 #include "modules.h"
 
 inline Module* StreamSocket::GetIOHook() { return IOHook; }
-inline void StreamSocket::AddIOHook(Module* m) { IOHook = m; }
-inline void StreamSocket::DelIOHook() { IOHook = NULL; }
+inline void StreamSocket::AddIOHook(Module* m) { IOHook = m; IOHookBypass = 0; }
+inline void StreamSocket::DelIOHook() { IOHook = NULL; IOHookBypass = 0; }
 #endif
@@ -14,17 +14,57 @@
 #ifndef __LOGMANAGER_H
 #define __LOGMANAGER_H
 
+class LogWriterThread;
+
+/** Settings for a FileWriter which writes its log lines from a
+ * background thread, read from the <log> tag which opened it.
+ */
+struct CoreExport AsyncLogSettings
+{
+	/** Name of the opened file, used when rotating it
+	 */
+	std::string filename;
+
+	/** Maximum number of milliseconds a line may sit in the queue
+	 * before the writer thread wakes up to write it out
+	 */
+	unsigned int flushinterval;
+
+	/** Number of queued bytes which wakes the writer thread early
+	 */
+	unsigned long flushsize;
+
+	/** Maximum number of queued bytes. Lines logged while the queue
+	 * is this full are dropped (and counted) instead of being queued.
+	 */
+	unsigned long maxqueue;
+
+	/** Size in bytes at which the file is rotated, or 0 to never rotate
+	 */
+	unsigned long rotatesize;
+
+	/** Number of rotated files (filename.1 to filename.N) to keep
+	 */
+	unsigned int rotatecount;
+
+	AsyncLogSettings()
+		: flushinterval(1000), flushsize(65536), maxqueue(4194304), rotatesize(0), rotatecount(5)
+	{
+	}
+};
+
 /** This class implements a nonblocking writer.
  * Most people writing an ircd give little thought to their disk
  * i/o. On a congested system, disk writes can block for long
  * periods of time (e.g. if the system is busy and/or swapping
  * a lot). If we just use a blocking fprintf() call, this could
  * block for undesirable amounts of time (half of a second through
- * to whole seconds). We DO NOT want this, so we make our logfile
- * nonblocking and hook it into the SocketEngine.
- * NB: If the operating system does not support nonblocking file
- * I/O (linux seems to, as does freebsd) this will default to
- * blocking behaviour.
+ * to whole seconds). We DO NOT want this, so a FileWriter may be
+ * given to a writer thread with StartAsync(), after which log lines
+ * are only appended to a bounded queue on the main thread, and the
+ * writer thread batches them into large writes.
+ * A FileWriter which has not been made asynchronous writes (and
+ * periodically flushes) each line as it is logged.
  */
 class CoreExport FileWriter
 {
@@ -38,21 +78,44 @@ class CoreExport FileWriter
 	 */
 	int writeops;
 
+	/** The writer thread, or NULL if lines are written synchronously
+	 */
+	LogWriterThread* writer;
+
  public:
 	/** The constructor takes an already opened logfile.
 	 */
 	FileWriter(FILE* logfile);
 
+	/** Hand this log file over to a background writer thread.
+	 * After this has been called, the log file is only accessed by the
+	 * writer thread until the FileWriter is destroyed.
+	 * @param settings Flush, queue and rotation settings for the thread
+	 */
+	void StartAsync(const AsyncLogSettings& settings);
+
 	/** Write one or more preformatted log lines.
-	 * If the data cannot be written immediately,
-	 * this class will insert itself into the
-	 * SocketEngine, and register a write event,
-	 * and when the write event occurs it will
-	 * attempt again to write the data.
+	 * If a writer thread is running, the data is queued for it
+	 * (or dropped if the queue is full), otherwise it is written
+	 * to the file immediately.
 	 */
 	void WriteLogLine(const std::string &line);
 
+	/** Retrieve the queue counters of this writer.
+	 * @param queued Set to the number of lines waiting to be written
+	 * @param dropped Set to the number of lines dropped due to a full queue
+	 * @return True if this writer is asynchronous, false if it has no queue
+	 */
+	bool GetQueueStats(unsigned long& queued, unsigned long& dropped);
+
+	/** Retrieve the problems the writer thread has had with the file since
+	 * the last call, such as being unable to reopen it after rotating it.
+	 * @param reports Each problem is added to this
+	 */
+	void TakeReports(std::vector<std::string>& reports);
+
 	/** Close the log file and cancel any events.
+	 * Lines still queued for the writer thread are written first.
 	 */
 	virtual ~FileWriter();
 };
@@ -167,6 +230,17 @@ class CoreExport LogManager
 	 */
 	void OpenFileLogs();
 
+	/** Sums the queue counters of all asynchronous FileWriters.
+	 * @param queued Set to the number of lines waiting to be written
+	 * @param dropped Set to the number of lines dropped due to full queues
+	 */
+	void GetQueueStats(unsigned long& queued, unsigned long& dropped);
+
+	/** Sends the problems asynchronous FileWriters have had with their files
+	 * to opers, and so to the other logs. Called once a second.
+	 */
+	void ReportFileErrors();
+
 	/** Removes all LogStreams, meaning they have to be readded for logging to continue.
 	 * Only LogStreams that were listed in AllLogStreams are actually closed.
 	 */
@@ -22,6 +22,9 @@ class CoreExport Membership : public Extensible
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
 	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	/** Memberships are allocated from a SlabPool */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
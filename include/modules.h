@@ -119,6 +119,7 @@ struct ModResult {
 		++safei; \
 		try \
 		{ \
+			ProfileHook _ph(*_i, y); \
 			(*_i)->x ; \
 		} \
 		catch (CoreException& modexcept) \
@@ -144,7 +145,10 @@ do { \
 		iter_ ## n ++; \
 		try \
 		{ \
-			v = (mod_ ## n)->n args;
+			{ \
+				ProfileHook ph_ ## n(mod_ ## n, I_ ## n); \
+				v = (mod_ ## n)->n args; \
+			}
 
 #define WHILE_EACH_HOOK(n) \
 		} \
@@ -324,9 +328,9 @@ enum Implementation
 	I_OnPostTopicChange, I_OnEvent, I_OnGlobalOper, I_OnPostConnect, I_OnAddBan,
 	I_OnDelBan, I_OnChangeLocalUserGECOS, I_OnUserRegister, I_OnChannelPreDelete, I_OnChannelDelete,
 	I_OnPostOper, I_OnSyncNetwork, I_OnSetAway, I_OnPostCommand, I_OnPostJoin,
-	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
+	I_OnWhoisLine, I_OnNeighborChannel, I_OnNeighborMember, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnRunTestSuite, I_OnNamesListItem, I_OnNumeric, I_OnHookIO,
-	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent,
+	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnNamesListStyle,
 	I_END
 };
 
@@ -618,16 +622,22 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual ModResult OnUserPreNotice(User* user,void* dest,int target_type, std::string &text,char status, CUList &exempt_list);
 
-	/** Called when sending a message to all "neighbors" of a given user -
-	 * that is, all users that share a common channel. This is used in
+	/** Called for each channel of a user when finding the "neighbors" of the
+	 * user - that is, all users that share a common channel. This is used in
 	 * commands such as NICK, QUIT, etc.
-	 * @param source The source of the message
-	 * @param include_c Channels to scan for users to include
-	 * @param exceptions Map of user->bool that overrides the inclusion decision
-	 *
-	 * Set exceptions[user] = true to include, exceptions[user] = false to exclude
+	 * @param memb The user's membership of the channel
+	 * @return MOD_RES_DENY to hide the user from the members of the channel, who
+	 * are then each passed to OnNeighborMember
+	 */
+	virtual ModResult OnNeighborChannel(Membership* memb);
+
+	/** Called for each local member of a channel which OnNeighborChannel
+	 * hid a user in, when finding the user's neighbors
+	 * @param memb The user's membership of the channel
+	 * @param member The member of the channel
+	 * @return MOD_RES_ALLOW to count the member as a neighbor anyway
 	 */
-	virtual void OnBuildNeighborList(User* source, UserChanList &include_c, std::map<User*,bool> &exceptions);
+	virtual ModResult OnNeighborMember(Membership* memb, User* member);
 
 	/** Called before any nickchange, local or remote. This can be used to implement Q-lines etc.
 	 * Please note that although you can see remote nickchanges through this function, you should
@@ -1267,6 +1277,16 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 
+	/** Called before a member of a channel is sent its NAMES list, which is normally taken from
+	 * NamesCache rather than built with OnNamesListItem. Any module which hooks OnNamesListItem
+	 * must also hook this, or the NAMES list will always be built the slow way.
+	 * @param issuer The member asking for the list
+	 * @param chan The channel
+	 * @param style The NamesCache style flags to use, which modules may add to
+	 * @return MOD_RES_DENY if OnNamesListItem has to be called for every member
+	 */
+	virtual ModResult OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style);
+
 	virtual ModResult OnNumeric(User* user, unsigned int numeric, const std::string &text);
 
 	/** Called whenever a result from /WHO is about to be returned
@@ -0,0 +1,124 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_PROFILER_H
+#define INSPIRCD_PROFILER_H
+
+/** Measures how long command handlers and module hooks take, so that
+ * STATS F can show which of them the server's time goes to. While it is
+ * off, which it is unless <performance:profile> is set, each command and
+ * hook call only tests a flag.
+ */
+class CoreExport Profiler
+{
+ public:
+	/** Times counted in buckets which double in width. The profiler counts
+	 * ticks of the cycle counter; m_testnet's load tests count microseconds.
+	 */
+	struct CoreExport Histogram
+	{
+		static const unsigned int BUCKETS = 48;
+		/** Bucket i counts times of fewer than 2^i units, and at least 2^(i-1) */
+		unsigned long buckets[BUCKETS];
+		unsigned long count;
+		uint64_t total, max;
+
+		Histogram();
+		void Add(uint64_t time);
+
+		/** Get the upper bound of the bucket holding the given percentile */
+		uint64_t Percentile(unsigned int pct) const;
+	};
+
+	typedef std::map<std::string, Histogram> CommandMap;
+	typedef std::map<std::pair<Module*, int>, Histogram> HookMap;
+
+ private:
+	CommandMap commands;
+	HookMap hooks;
+	/** The cycle counter and the clock when profiling was turned on, to find the counter's speed */
+	uint64_t startticks;
+	time_t startsecs;
+	long startnsecs;
+
+ public:
+	/** True while profiling; tested before every measurement */
+	static bool enabled;
+
+	Profiler();
+
+	/** Read the cycle counter */
+	static inline uint64_t Ticks()
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		uint32_t lo, hi;
+		__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+		return ((uint64_t)hi << 32) | lo;
+#elif defined(WINDOWS)
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return now.QuadPart;
+#else
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+	}
+
+	/** Turn profiling on or off. Turning it on starts with no measurements. */
+	void SetEnabled(bool on);
+
+	/** Count a call of a command handler which started at the given tick */
+	void AddCommand(const std::string& name, uint64_t start);
+
+	/** Count a call of a module's hook which started at the given tick */
+	static void AddHook(Module* mod, int hook, uint64_t start);
+
+	/** Drop the measurements of a module which is being unloaded */
+	void Forget(Module* mod);
+
+	/** Get how many ticks of the cycle counter make a microsecond */
+	double TicksPerMicrosecond();
+
+	/** Describe a histogram in microseconds, as shown in STATS F */
+	std::string Format(const Histogram& hist);
+
+	/** Get the name of a hook from its Implementation value */
+	static const char* HookName(int hook);
+
+	const CommandMap& GetCommands() { return commands; }
+	const HookMap& GetHooks() { return hooks; }
+};
+
+/** Times a module's hook call for the Profiler, if it is on. Used by
+ * FOREACH_MOD and FIRST_MOD_RESULT around each call.
+ */
+class ProfileHook
+{
+	Module* const mod;
+	const int hook;
+	const uint64_t start;
+
+ public:
+	ProfileHook(Module* Mod, int Hook) : mod(Mod), hook(Hook), start(Profiler::enabled ? Profiler::Ticks() : 0)
+	{
+	}
+
+	~ProfileHook()
+	{
+		if (start)
+			Profiler::AddHook(mod, hook, start);
+	}
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_SLAB_H
+#define INSPIRCD_SLAB_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/** Hands out fixed size blocks carved from larger slabs. Objects which are
+ * created and destroyed in bulk, such as users and memberships during a
+ * netsplit, come back to the pool's free list instead of the general heap,
+ * so they do not fragment it and are quick to reuse.
+ *
+ * Slabs are kept for the life of the pool; its size follows the peak
+ * number of objects rather than the current one.
+ */
+class CoreExport SlabPool
+{
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	/** Name shown in STATS z */
+	const char* const name;
+	/** Size of each block, rounded up for alignment */
+	const size_t size;
+	/** Number of blocks per slab */
+	const size_t perslab;
+	/** Blocks ready to be handed out */
+	FreeBlock* freelist;
+	/** Every slab allocated */
+	std::vector<char*> slabs;
+	/** Blocks currently handed out */
+	size_t inuse;
+
+	void Grow();
+
+ public:
+	/** Create a pool
+	 * @param Name A name for the pool, shown in statistics
+	 * @param Size The size of the objects it will hold
+	 * @param PerSlab How many objects to allocate at a time
+	 */
+	SlabPool(const char* Name, size_t Size, size_t PerSlab = 256);
+	~SlabPool();
+
+	/** Get a block of the pool's size */
+	void* Allocate()
+	{
+		if (!freelist)
+			Grow();
+		FreeBlock* block = freelist;
+		freelist = block->next;
+		inuse++;
+		return block;
+	}
+
+	/** Return a block obtained from Allocate() */
+	void Deallocate(void* ptr)
+	{
+		FreeBlock* block = static_cast<FreeBlock*>(ptr);
+		block->next = freelist;
+		freelist = block;
+		inuse--;
+	}
+
+	const char* GetName() const { return name; }
+	size_t GetSize() const { return size; }
+	size_t GetInUse() const { return inuse; }
+	size_t GetCapacity() const { return slabs.size() * perslab; }
+
+	/** All pools that currently exist, for statistics */
+	static const std::vector<SlabPool*>& GetPools();
+
+	/** Get the shared pool for blocks of a given size, creating it if needed.
+	 * This backs slab_allocator, so that container nodes of equal size share one pool.
+	 */
+	static SlabPool* ForSize(size_t size);
+};
+
+/** A standard library allocator which takes single objects from the
+ * SlabPool for their size. Use it for node based containers (std::map,
+ * std::set, std::list) whose nodes are created and destroyed in bulk.
+ */
+template<typename T>
+class slab_allocator
+{
+	SlabPool* pool;
+
+	template<typename U> friend class slab_allocator;
+
+ public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template<typename U> struct rebind
+	{
+		typedef slab_allocator<U> other;
+	};
+
+	slab_allocator() : pool(SlabPool::ForSize(sizeof(T))) { }
+	slab_allocator(const slab_allocator& other) : pool(other.pool) { }
+	template<typename U> slab_allocator(const slab_allocator<U>&) : pool(SlabPool::ForSize(sizeof(T))) { }
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	size_type max_size() const { return size_t(-1) / sizeof(T); }
+	void construct(pointer p, const T& val) { new(static_cast<void*>(p)) T(val); }
+	void destroy(pointer p) { p->~T(); }
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		if (n == 1)
+			return static_cast<pointer>(pool->Allocate());
+		return static_cast<pointer>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(pointer p, size_type n)
+	{
+		if (n == 1)
+			pool->Deallocate(p);
+		else
+			::operator delete(p);
+	}
+
+	/* Every slab_allocator<T> draws from the same pool, so any can free what another allocated */
+	bool operator==(const slab_allocator&) const { return true; }
+	bool operator!=(const slab_allocator&) const { return false; }
+};
+
+#endif
@@ -227,7 +227,9 @@ class CoreExport SocketEngine
 	/** Reference table, contains all current handlers
 	 */
 	EventHandler** ref;
-	/** List of handlers that want a trial read/write
+	/** List of handlers that want a trial read/write. DispatchEvents() must
+	 * not wait for new events while this is not empty, as the data for a
+	 * trial read may already be waiting and will not cause a new event.
 	 */
 	std::set<int> trials;
 
@@ -0,0 +1,63 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_STRINGPOOL_H
+#define INSPIRCD_STRINGPOOL_H
+
+#include <map>
+#include <string>
+
+/** Holds one shared copy of strings which many objects carry the same value
+ * of, such as the name of the server each user is on. Objects keep a
+ * reference to the pooled copy instead of their own string, so two values
+ * from the same pool are equal exactly when their addresses are.
+ *
+ * Each Add() must be paired with a Remove() of the same value; the copy is
+ * freed when the last of them is removed.
+ */
+class CoreExport StringPool
+{
+	typedef std::map<std::string, unsigned long> PoolMap;
+	PoolMap pool;
+
+ public:
+	/** Get the pooled copy of a string, adding it if needed
+	 * @param value The string to look up
+	 * @return A reference which stays valid until the matching Remove()
+	 */
+	const std::string& Add(const std::string& value)
+	{
+		PoolMap::iterator i = pool.insert(std::make_pair(value, 0UL)).first;
+		i->second++;
+		return i->first;
+	}
+
+	/** Release a string returned by Add()
+	 * @param value The string to release
+	 */
+	void Remove(const std::string& value)
+	{
+		PoolMap::iterator i = pool.find(value);
+		if (i != pool.end() && !--i->second)
+			pool.erase(i);
+	}
+
+	/** Returns the number of distinct strings in the pool
+	 */
+	size_t size() const
+	{
+		return pool.size();
+	}
+};
+
+#endif
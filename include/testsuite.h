@@ -24,6 +24,8 @@ class TestSuite
 	bool DoWildTests();
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
+	bool DoDNSTests();
+	bool DoHashTests();
 };
 
 #endif
@@ -86,6 +86,14 @@ class CoreExport QueuedThread : public Thread
 	{
 		queue.Wait();
 	}
+	/** Waits for an enqueue operation to complete, or for the
+	 * given number of milliseconds to pass, whichever is first.
+	 * The same locking rules as WaitForQueue() apply.
+	 */
+	void WaitForQueue(unsigned int msecs)
+	{
+		queue.Wait(msecs);
+	}
  public:
 	/** Lock queue.
 	 */
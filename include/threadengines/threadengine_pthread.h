@@ -15,6 +15,7 @@
 #define __THREADENGINE_PTHREAD__
 
 #include <pthread.h>
+#include <sys/time.h>
 #include "typedefs.h"
 
 /** The ThreadEngine class has the responsibility of initialising
@@ -139,6 +140,21 @@ class ThreadQueueData
 	{
 		pthread_cond_wait(&cond, &mutex);
 	}
+
+	void Wait(unsigned int msecs)
+	{
+		struct timeval now;
+		struct timespec abstime;
+		gettimeofday(&now, NULL);
+		abstime.tv_sec = now.tv_sec + msecs / 1000;
+		abstime.tv_nsec = now.tv_usec * 1000 + (msecs % 1000) * 1000000;
+		if (abstime.tv_nsec >= 1000000000)
+		{
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&cond, &mutex, &abstime);
+	}
 };
 
 class ThreadSignalSocket;
@@ -131,6 +131,13 @@ class ThreadQueueData
 		WaitForSingleObject(event, INFINITE);
 		EnterCriticalSection(&mutex);
 	}
+
+	void Wait(unsigned int msecs)
+	{
+		LeaveCriticalSection(&mutex);
+		WaitForSingleObject(event, msecs);
+		EnterCriticalSection(&mutex);
+	}
 };
 
 class ThreadSignalData
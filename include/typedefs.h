@@ -44,20 +44,15 @@ struct ModResult;
 struct ResourceRecord;
 
 #include "hashcomp.h"
+#include "flat_hash_map.h"
 #include "base.h"
+#include "slab.h"
 
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	typedef nspace::hash_map<std::string, User*, nspace::hash_compare<std::string, std::less<std::string> > > user_hash;
-	typedef nspace::hash_map<std::string, Channel*, nspace::hash_compare<std::string, std::less<std::string> > > chan_hash;
-#else
-	#ifdef HASHMAP_DEPRECATED
-		typedef nspace::hash_map<std::string, User*, nspace::insensitive, irc::StrHashComp> user_hash;
-		typedef nspace::hash_map<std::string, Channel*, nspace::insensitive, irc::StrHashComp> chan_hash;
-	#else
-		typedef nspace::hash_map<std::string, User*, nspace::hash<std::string>, irc::StrHashComp> user_hash;
-		typedef nspace::hash_map<std::string, Channel*, nspace::hash<std::string>, irc::StrHashComp> chan_hash;
-	#endif
-#endif
+/** Nick, UUID and channel name lookups. These use a seeded hash, so that
+ * names chosen to collide cannot turn lookups into long probe sequences.
+ */
+typedef irc::flat_hash_map<std::string, User*, irc::insensitive_hash, irc::StrHashComp> user_hash;
+typedef irc::flat_hash_map<std::string, Channel*, irc::insensitive_hash, irc::StrHashComp> chan_hash;
 
 /** A list of failed port bindings, used for informational purposes on startup */
 typedef std::vector<std::pair<std::string, std::string> > FailedPortList;
@@ -72,7 +67,7 @@ typedef std::vector<reference<ConnectClass> > ClassVector;
 
 /** Typedef for the list of user-channel records for a user
  */
-typedef std::set<Channel*> UserChanList;
+typedef std::set<Channel*, std::less<Channel*>, slab_allocator<Channel*> > UserChanList;
 
 /** Shorthand for an iterator into a UserChanList
  */
@@ -114,7 +109,7 @@ typedef std::map<std::string, file_cache> ConfigFileCache;
 typedef nspace::hash_map<std::string,Command*> Commandtable;
 
 /** Membership list of a channel */
-typedef std::map<User*, Membership*> UserMembList;
+typedef std::map<User*, Membership*, std::less<User*>, slab_allocator<std::pair<User* const, Membership*> > > UserMembList;
 /** Iterator of UserMembList */
 typedef UserMembList::iterator UserMembIter;
 /** const Iterator of UserMembList */
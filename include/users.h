@@ -210,6 +210,20 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** Something done for each neighbor of a user by User::ForEachNeighbor
+ */
+class CoreExport NeighborVisitor
+{
+ public:
+	virtual ~NeighborVisitor() {}
+
+	/** Called once for each local user who shares a channel with the user
+	 * and can see them there
+	 * @param user The neighbor
+	 */
+	virtual void Visit(LocalUser* user) = 0;
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -312,8 +326,10 @@ class CoreExport User : public Extensible
 	UserChanList chans;
 
 	/** The server the user is connected to.
+	 * This is the copy held in InspIRCd::Strings, so users on the same
+	 * server share it and can be compared by address.
 	 */
-	const std::string server;
+	const std::string& server;
 
 	/** The user's away message.
 	 * If this string is empty, the user is not marked as away.
@@ -388,6 +404,11 @@ class CoreExport User : public Extensible
 	 */
 	User(const std::string &uid, const std::string& srv, int objtype);
 
+	/** Local and remote users are allocated from SlabPools, as they come and go in bulk
+	 */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	/** Check if the user matches a G or K line, and disconnect them if they do.
 	 * @param doZline True if ZLines should be checked (if IP has changed since initial connect)
 	 * Returns true if the user matched a ban, false else.
@@ -617,6 +638,15 @@ class CoreExport User : public Extensible
 	 */
 	void SendText(const char* text, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Call a visitor for each local user who shares a channel with this user.
+	 * This walks the channels as they are, marking each user visited with
+	 * LocalUser::already_sent, so the visitor must not change which channels
+	 * anyone is in.
+	 * @param visitor The visitor to call
+	 * @param include_self True to visit this user too, if local
+	 */
+	void ForEachNeighbor(NeighborVisitor& visitor, bool include_self = false);
+
 	/** Return true if the user shares at least one channel with another user
 	 * @param other The other user to compare the channel list against
 	 * @return True if the given user shares at least one channel with this user
@@ -816,6 +846,12 @@ class CoreExport LocalUser : public User
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write several lines to the user in one write
+	 * @param text The lines, each already ending in CR LF
+	 * @param count The number of lines in text
+	 */
+	void WriteLines(const std::string& text, unsigned int count);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
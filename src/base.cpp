@@ -17,7 +17,7 @@
 #include "inspircd.h"
 #include <typeinfo>
 
-classbase::classbase()
+classbase::classbase() : culled(false)
 {
 	if (ServerInstance && ServerInstance->Logs)
 		ServerInstance->Logs->Log("CULLLIST", DEBUG, "classbase::+ @%p", (void*)this);
@@ -17,6 +17,21 @@
 #include <cstdarg>
 #include "mode.h"
 
+static SlabPool channelpool("Channel", sizeof(Channel));
+
+void* Channel::operator new(size_t size)
+{
+	return size == sizeof(Channel) ? channelpool.Allocate() : ::operator new(size);
+}
+
+void Channel::operator delete(void* ptr, size_t size)
+{
+	if (size == sizeof(Channel))
+		channelpool.Deallocate(ptr);
+	else
+		::operator delete(ptr);
+}
+
 Channel::Channel(const std::string &cname, time_t ts)
 {
 	chan_hash::iterator findchan = ServerInstance->chanlist->find(cname);
@@ -133,6 +148,7 @@ Membership* Channel::AddUser(User* user)
 {
 	Membership* memb = new Membership(user, this);
 	userlist[user] = memb;
+	names.Add(memb);
 	return memb;
 }
 
@@ -142,6 +158,7 @@ void Channel::DelUser(User* user)
 
 	if (a != userlist.end())
 	{
+		names.Remove(a->second);
 		a->second->cull();
 		delete a->second;
 		userlist.erase(a);
@@ -211,7 +228,7 @@ void Channel::SetDefaultModes()
  * add a channel to a user, creating the record for it if needed and linking
  * it to the user record
  */
-Channel* Channel::JoinUser(User *user, const char* cn, bool override, const char* key, bool bursting, time_t TS)
+Channel* Channel::JoinUser(User *user, const char* cn, bool override, const char* key, bool bursting, time_t TS, JoinBatch* batch)
 {
 	// Fix: unregistered users could be joined using /SAJOIN
 	if (!user || !cn || user->registered != REG_ALL)
@@ -360,10 +377,10 @@ Channel* Channel::JoinUser(User *user, const char* cn, bool override, const char
 		Ptr->SetDefaultModes();
 	}
 
-	return Channel::ForceChan(Ptr, user, privs, bursting, created_by_local);
+	return Channel::ForceChan(Ptr, user, privs, bursting, created_by_local, batch);
 }
 
-Channel* Channel::ForceChan(Channel* Ptr, User* user, const std::string &privs, bool bursting, bool created)
+Channel* Channel::ForceChan(Channel* Ptr, User* user, const std::string &privs, bool bursting, bool created, JoinBatch* batch)
 {
 	std::string nick = user->nick;
 
@@ -385,14 +402,31 @@ Channel* Channel::ForceChan(Channel* Ptr, User* user, const std::string &privs,
 	CUList except_list;
 	FOREACH_MOD(I_OnUserJoin,OnUserJoin(memb, bursting, created, except_list));
 
-	Ptr->WriteAllExcept(user, false, 0, except_list, "JOIN :%s", Ptr->name.c_str());
-
 	/* Theyre not the first ones in here, make sure everyone else sees the modes we gave the user */
 	std::string ms = memb->modes;
 	for(unsigned int i=0; i < memb->modes.length(); i++)
 		ms.append(" ").append(user->nick);
-	if ((Ptr->GetUserCounter() > 1) && (ms.length()))
-		Ptr->WriteAllExceptSender(user, ServerInstance->Config->CycleHostsFromUser, 0, "MODE %s +%s", Ptr->name.c_str(), ms.c_str());
+
+	if (batch && IS_LOCAL(user))
+		batch->Flush();
+	if (batch && !IS_LOCAL(user))
+	{
+		batch->Add(":" + user->GetFullHost() + " JOIN :" + Ptr->name, except_list);
+		if ((Ptr->GetUserCounter() > 1) && (ms.length()))
+		{
+			/* The modes go to the whole channel, as with WriteAllExceptSender, even those the JOIN was kept from */
+			CUList sender;
+			sender.insert(user);
+			batch->Add(":" + (ServerInstance->Config->CycleHostsFromUser ? ServerInstance->Config->ServerName : user->GetFullHost())
+				+ " MODE " + Ptr->name + " +" + ms, sender);
+		}
+	}
+	else
+	{
+		Ptr->WriteAllExcept(user, false, 0, except_list, "JOIN :%s", Ptr->name.c_str());
+		if ((Ptr->GetUserCounter() > 1) && (ms.length()))
+			Ptr->WriteAllExceptSender(user, ServerInstance->Config->CycleHostsFromUser, 0, "MODE %s +%s", Ptr->name.c_str(), ms.c_str());
+	}
 
 	if (IS_LOCAL(user))
 	{
@@ -684,6 +718,65 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 	}
 }
 
+void JoinBatch::Add(const std::string& text, const CUList& except_list)
+{
+	lines.push_back(Line());
+	Line& line = lines.back();
+	line.text = text;
+	/* Modules such as m_delayjoin list every member here; only local ones matter */
+	for (CUList::const_iterator i = except_list.begin(); i != except_list.end(); ++i)
+	{
+		if (IS_LOCAL(*i))
+			line.except.insert(*i);
+	}
+}
+
+void JoinBatch::Send(LocalUser* user, const std::string& block, unsigned int count)
+{
+	user->WriteLines(block, count);
+}
+
+void JoinBatch::Flush()
+{
+	if (lines.empty())
+		return;
+
+	/* Members who aren't left out of any line are all sent the same block */
+	std::string common;
+	CUList excepted;
+	for (std::vector<Line>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+	{
+		common.append(i->text).append("\r\n");
+		excepted.insert(i->except.begin(), i->except.end());
+	}
+
+	for (UserMembIter i = chan->userlist.begin(); i != chan->userlist.end(); ++i)
+	{
+		LocalUser* user = IS_LOCAL(i->first);
+		if (!user)
+			continue;
+
+		if (excepted.find(user) == excepted.end())
+		{
+			Send(user, common, lines.size());
+			continue;
+		}
+
+		std::string block;
+		unsigned int count = 0;
+		for (std::vector<Line>::const_iterator j = lines.begin(); j != lines.end(); ++j)
+		{
+			if (j->except.find(user) != j->except.end())
+				continue;
+			block.append(j->text).append("\r\n");
+			count++;
+		}
+		if (count)
+			Send(user, block, count);
+	}
+	lines.clear();
+}
+
 void Channel::WriteAllExceptSender(User* user, bool serversource, char status, const std::string& text)
 {
 	CUList except_list;
@@ -749,6 +842,114 @@ char* Channel::ChanModes(bool showkey)
 /* compile a userlist of a channel into a string, each nick seperated by
  * spaces and op, voice etc status shown as @ and +, and send it to 'user'
  */
+/** The cached NAMES replies can only be used if every module which changes
+ * entries in the list one at a time can also say which style to use instead.
+ */
+static bool NamesCacheUsable()
+{
+	IntModuleList& items = ServerInstance->Modules->EventHandlers[I_OnNamesListItem];
+	IntModuleList& styles = ServerInstance->Modules->EventHandlers[I_OnNamesListStyle];
+	for (EventHandlerIter i = items.begin(); i != items.end(); ++i)
+	{
+		if (std::find(styles.begin(), styles.end(), *i) == styles.end())
+			return false;
+	}
+	return true;
+}
+
+NamesCache::NamesCache() : limit(0)
+{
+	for (unsigned int i = 0; i < 4; i++)
+		styles[i] = NULL;
+}
+
+NamesCache::~NamesCache()
+{
+	Clear();
+}
+
+void NamesCache::Clear()
+{
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		delete styles[i];
+		styles[i] = NULL;
+	}
+}
+
+std::string NamesCache::Entry(Membership* memb, unsigned int style)
+{
+	std::string entry = (style & ALLPREFIXES) ? memb->chan->GetAllPrefixChars(memb->user) : memb->chan->GetPrefixChar(memb->user);
+	return entry.append((style & FULLHOST) ? memb->user->GetFullHost() : memb->user->nick);
+}
+
+void NamesCache::Insert(std::vector<std::string>& list, const std::string& entry)
+{
+	/* Same split as the numerics built by Channel::UserList, allowing for the longest nick */
+	if (list.empty() || list.back().length() + entry.length() + 1 > limit)
+		list.push_back(std::string());
+	list.back().append(entry).push_back(' ');
+}
+
+bool NamesCache::Erase(std::vector<std::string>& list, const std::string& entry)
+{
+	/* Search from the end, where the most recent joins are */
+	for (std::vector<std::string>::iterator i = list.end(); i != list.begin(); )
+	{
+		--i;
+		std::string::size_type pos = 0;
+		while ((pos = i->find(entry, pos)) != std::string::npos)
+		{
+			/* Every entry is followed by a space, so this cannot run off the end */
+			if ((pos == 0 || (*i)[pos - 1] == ' ') && (*i)[pos + entry.length()] == ' ')
+			{
+				i->erase(pos, entry.length() + 1);
+				if (i->empty())
+					list.erase(i);
+				return true;
+			}
+			pos++;
+		}
+	}
+	return false;
+}
+
+const std::vector<std::string>& NamesCache::Get(Channel* chan, unsigned int style)
+{
+	if (!styles[style])
+	{
+		if (!limit)
+			limit = 480 - (ServerInstance->Config->Limits.NickMax + chan->name.length() + 5);
+		styles[style] = new std::vector<std::string>;
+		const UserMembList* users = chan->GetUsers();
+		for (UserMembCIter i = users->begin(); i != users->end(); ++i)
+			Insert(*styles[style], Entry(i->second, style));
+	}
+	return *styles[style];
+}
+
+void NamesCache::Add(Membership* memb)
+{
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		if (styles[i])
+			Insert(*styles[i], Entry(memb, i));
+	}
+}
+
+void NamesCache::Remove(Membership* memb)
+{
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		/* If the entry has gone astray, build this style again rather than show it twice */
+		if (styles[i] && !Erase(*styles[i], Entry(memb, i)))
+		{
+			delete styles[i];
+			styles[i] = NULL;
+		}
+	}
+}
+
 void Channel::UserList(User *user)
 {
 	char list[MAXBUF];
@@ -763,16 +964,33 @@ void Channel::UserList(User *user)
 		return;
 	}
 
-	dlen = curlen = snprintf(list,MAXBUF,"%s %c %s :", user->nick.c_str(), this->IsModeSet('s') ? '@' : this->IsModeSet('p') ? '*' : '=',  this->name.c_str());
-
-	int numusers = 0;
-	char* ptr = list + dlen;
-
 	/* Improvement by Brain - this doesnt change in value, so why was it inside
 	 * the loop?
 	 */
 	bool has_user = this->HasUser(user);
 
+	unsigned int style = 0;
+	if (has_user && NamesCacheUsable())
+	{
+		ModResult MOD_RESULT;
+		FIRST_MOD_RESULT(OnNamesListStyle, MOD_RESULT, (user, this, style));
+		if (MOD_RESULT != MOD_RES_DENY)
+		{
+			const std::vector<std::string>& pieces = names.Get(this, style);
+			snprintf(list,MAXBUF,"%s %c %s :", user->nick.c_str(), this->IsModeSet('s') ? '@' : this->IsModeSet('p') ? '*' : '=',  this->name.c_str());
+			std::string header(list);
+			for (std::vector<std::string>::const_iterator i = pieces.begin(); i != pieces.end(); ++i)
+				user->WriteNumeric(RPL_NAMREPLY, header + *i);
+			user->WriteNumeric(RPL_ENDOFNAMES, "%s %s :End of /NAMES list.", user->nick.c_str(), this->name.c_str());
+			return;
+		}
+	}
+
+	dlen = curlen = snprintf(list,MAXBUF,"%s %c %s :", user->nick.c_str(), this->IsModeSet('s') ? '@' : this->IsModeSet('p') ? '*' : '=',  this->name.c_str());
+
+	int numusers = 0;
+	char* ptr = list + dlen;
+
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
 		if ((!has_user) && (i->first->IsModeSet('i')))
@@ -878,6 +1096,21 @@ const char* Channel::GetPrefixChar(User *user)
 	return pf;
 }
 
+static SlabPool membershippool("Membership", sizeof(Membership));
+
+void* Membership::operator new(size_t size)
+{
+	return size == sizeof(Membership) ? membershippool.Allocate() : ::operator new(size);
+}
+
+void Membership::operator delete(void* ptr, size_t size)
+{
+	if (size == sizeof(Membership))
+		membershippool.Deallocate(ptr);
+	else
+		::operator delete(ptr);
+}
+
 unsigned int Membership::getRank()
 {
 	char mchar = modes.c_str()[0];
@@ -928,29 +1161,42 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 	UserMembIter m = userlist.find(user);
 	if (m == userlist.end())
 		return false;
-	for(unsigned int i=0; i < m->second->modes.length(); i++)
+	std::string newmodes = m->second->modes;
+	bool changed = adding;
+	bool placed = false;
+	for(unsigned int i=0; i < newmodes.length(); i++)
 	{
-		char mchar = m->second->modes[i];
+		char mchar = newmodes[i];
 		ModeHandler* mh = ServerInstance->Modes->FindMode(mchar, MODETYPE_CHANNEL);
 		if (mh && mh->GetPrefixRank() <= delta_mh->GetPrefixRank())
 		{
-			m->second->modes =
-				m->second->modes.substr(0,i) +
+			newmodes =
+				newmodes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
-				m->second->modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+				newmodes.substr(mchar == prefix ? i+1 : i);
+			changed = adding != (mchar == prefix);
+			placed = true;
+			break;
 		}
 	}
-	if (adding)
-		m->second->modes += std::string(1, prefix);
-	return adding;
+	if (!placed && adding)
+		newmodes += std::string(1, prefix);
+	if (changed)
+	{
+		names.Remove(m->second);
+		m->second->modes = newmodes;
+		names.Add(m->second);
+	}
+	return changed;
 }
 
 void Channel::RemoveAllPrefixes(User* user)
 {
 	UserMembIter m = userlist.find(user);
-	if (m != userlist.end())
+	if (m != userlist.end() && !m->second->modes.empty())
 	{
+		names.Remove(m->second);
 		m->second->modes.clear();
+		names.Add(m->second);
 	}
 }
@@ -330,7 +330,10 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		/*
 		 * WARNING: be careful, the user may be deleted soon
 		 */
+		uint64_t start = Profiler::enabled ? Profiler::Ticks() : 0;
 		CmdResult result = cm->second->Handle(command_p, user);
+		if (start)
+			ServerInstance->Profile.AddCommand(command, start);
 
 		FOREACH_MOD(I_OnPostCommand,OnPostCommand(command, command_p, user, result,cmd));
 		return do_more;
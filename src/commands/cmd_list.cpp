@@ -13,6 +13,85 @@
 
 #include "inspircd.h"
 
+/** How many seconds a channel name snapshot is reused for before a new
+ * LIST causes it to be rebuilt from the live channel table.
+ */
+static const time_t LIST_SNAPSHOT_AGE = 60;
+
+/** The most snapshot entries a single pass of a LIST will examine, so that
+ * a filtered LIST over a huge network cannot stall the event loop.
+ */
+static const size_t LIST_SCAN_BUDGET = 16384;
+
+/** A name-sorted copy of the channel list. Cursors hold a reference to the
+ * snapshot they started on, so a rebuild never invalidates a running LIST.
+ */
+class ListSnapshot : public refcountbase
+{
+ public:
+	std::vector<std::string> names;
+	time_t created;
+
+	ListSnapshot() : created(ServerInstance->Time())
+	{
+		names.reserve(ServerInstance->chanlist->size());
+		for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
+			names.push_back(i->second->name);
+		std::sort(names.begin(), names.end(), ListSnapshot::Compare);
+	}
+
+	static bool Compare(const std::string& one, const std::string& two)
+	{
+		return (irc::irc_char_traits::compare(one.c_str(), two.c_str(), std::min(one.length(), two.length()) + 1) < 0);
+	}
+};
+
+/** The filters a LIST was issued with, all evaluated before a 322 is formatted.
+ * Times are absolute; zero means the bound is not in use.
+ */
+struct ListFilter
+{
+	long minusers;
+	long maxusers;
+	time_t createdafter;
+	time_t createdbefore;
+	time_t topicafter;
+	time_t topicbefore;
+	std::vector<std::string> masks;
+
+	ListFilter() : minusers(0), maxusers(0), createdafter(0), createdbefore(0), topicafter(0), topicbefore(0)
+	{
+	}
+};
+
+/** Position of a local user within a LIST that did not fit in their sendq.
+ */
+struct ListCursor
+{
+	reference<ListSnapshot> snapshot;
+	size_t pos;
+	ListFilter filter;
+
+	ListCursor(ListSnapshot* snap, const ListFilter& f) : snapshot(snap), pos(0), filter(f)
+	{
+	}
+};
+
+class CommandList;
+
+/** Resumes paused LISTs once their owners have drained some of their sendq.
+ */
+class ListResumeTimer : public Timer
+{
+	CommandList* cmd;
+ public:
+	ListResumeTimer(CommandList* c) : Timer(1, ServerInstance->Time(), true), cmd(c)
+	{
+	}
+
+	void Tick(time_t);
+};
+
 /** Handle /LIST. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -20,10 +99,41 @@
  */
 class CommandList : public Command
 {
+	reference<ListSnapshot> snapshot;
+	std::vector<std::string> paused;
+	ListResumeTimer* timer;
+
+	/** Parse the ELIST style conditions in a LIST parameter */
+	void ParseFilter(const std::string& param, ListFilter& filter);
+
+	/** Returns true if the channel passes every filter */
+	bool Matches(Channel* chan, const ListFilter& filter);
+
+	/** Write the 322 for a channel, if the user is allowed to see it */
+	void WriteEntry(User* user, Channel* chan);
+
+	/** Emit entries from the cursor until the user's sendq reaches its watermark.
+	 * @return True if the cursor reached the end of its snapshot
+	 */
+	bool Continue(User* user, ListCursor* cursor);
+
  public:
+	SimpleExtItem<ListCursor> ext;
+
 	/** Constructor for list.
 	 */
-	CommandList ( Module* parent) : Command(parent,"LIST", 0, 0) { Penalty = 5; }
+	CommandList ( Module* parent) : Command(parent,"LIST", 0, 0), ext("list_cursor", parent)
+	{
+		Penalty = 5;
+		timer = new ListResumeTimer(this);
+		ServerInstance->Timers->AddTimer(timer);
+	}
+
+	~CommandList()
+	{
+		ServerInstance->Timers->DelTimer(timer);
+	}
+
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
 	 * @param pcnt The number of parameters passed to teh command
@@ -31,68 +141,195 @@ class CommandList : public Command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
-};
 
+	/** Continue every paused LIST whose owner has room in their sendq.
+	 */
+	void ResumeAll();
+};
 
-/** Handle /LIST
- */
-CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+void ListResumeTimer::Tick(time_t)
 {
-	int minusers = 0, maxusers = 0;
+	cmd->ResumeAll();
+}
 
-	user->WriteNumeric(321, "%s Channel :Users Name",user->nick.c_str());
+void CommandList::ParseFilter(const std::string& param, ListFilter& filter)
+{
+	irc::commasepstream items(param);
+	std::string item;
+	time_t now = ServerInstance->Time();
 
-	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
-	if (parameters.size() == 1)
+	while (items.GetToken(item))
 	{
-		if (parameters[0][0] == '<')
-		{
-			maxusers = atoi((parameters[0].c_str())+1);
-		}
-		else if (parameters[0][0] == '>')
+		if (item.empty())
+			continue;
+
+		/* Work around mIRC suckyness. YOU SUCK, KHALED! */
+		if (item[0] == '<')
+			filter.maxusers = atol(item.c_str() + 1);
+		else if (item[0] == '>')
+			filter.minusers = atol(item.c_str() + 1);
+		else if (item.length() > 2 && (item[0] == 'C' || item[0] == 'c' || item[0] == 'T' || item[0] == 't') && (item[1] == '<' || item[1] == '>'))
 		{
-			minusers = atoi((parameters[0].c_str())+1);
+			/* C<n and T<n: created or topic set less than n minutes ago; C>n and T>n: more than n minutes ago */
+			time_t when = now - atol(item.c_str() + 2) * 60;
+			bool topic = (item[0] == 'T' || item[0] == 't');
+			if (item[1] == '<')
+				(topic ? filter.topicafter : filter.createdafter) = when;
+			else
+				(topic ? filter.topicbefore : filter.createdbefore) = when;
 		}
+		else
+			filter.masks.push_back(item);
+	}
+}
+
+bool CommandList::Matches(Channel* chan, const ListFilter& filter)
+{
+	long users = chan->GetUserCounter();
+
+	if ((filter.minusers && (users <= filter.minusers)) || (filter.maxusers && (users >= filter.maxusers)))
+		return false;
+
+	if ((filter.createdafter && chan->age <= filter.createdafter) || (filter.createdbefore && chan->age >= filter.createdbefore))
+		return false;
+
+	if (filter.topicafter || filter.topicbefore)
+	{
+		if (chan->topic.empty())
+			return false;
+		if ((filter.topicafter && chan->topicset <= filter.topicafter) || (filter.topicbefore && chan->topicset >= filter.topicbefore))
+			return false;
 	}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
+	if (filter.masks.empty())
+		return true;
+
+	// attempt to match a glob pattern
+	for (std::vector<std::string>::const_iterator i = filter.masks.begin(); i != filter.masks.end(); ++i)
 	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
+		if (InspIRCd::Match(chan->name, *i) || InspIRCd::Match(chan->topic, *i))
+			return true;
+	}
+	return false;
+}
 
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
+void CommandList::WriteEntry(User* user, Channel* chan)
+{
+	long users = chan->GetUserCounter();
 
-		if (too_many || too_few)
-			continue;
+	// if the channel is not private/secret, OR the user is on the channel anyway
+	bool n = (chan->HasUser(user) || user->HasPrivPermission("channels/auspex"));
 
-		if (parameters.size() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
+	if (!n && chan->IsModeSet('p'))
+	{
+		/* Channel is +p and user is outside/not privileged */
+		user->WriteNumeric(322, "%s * %ld :",user->nick.c_str(), users);
+	}
+	else
+	{
+		if (n || !chan->IsModeSet('s'))
 		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
-				continue;
+			/* User is in the channel/privileged, channel is not +s */
+			user->WriteNumeric(322, "%s %s %ld :[+%s] %s",user->nick.c_str(),chan->name.c_str(),users,chan->ChanModes(n),chan->topic.c_str());
 		}
+	}
+}
+
+bool CommandList::Continue(User* user, ListCursor* cursor)
+{
+	LocalUser* lu = IS_LOCAL(user);
+	/* Stop filling once half of the hard sendq is taken, leaving room for everything else */
+	size_t watermark = lu ? lu->MyClass->GetSendqHardMax() / 2 : 0;
+	const std::vector<std::string>& names = cursor->snapshot->names;
+	size_t budget = LIST_SCAN_BUDGET;
+
+	while (cursor->pos < names.size())
+	{
+		if (lu && (lu->eh.getSendQSize() >= watermark || !budget--))
+			return false;
+
+		/* The snapshot only holds names, so channels that have since gone away are skipped */
+		Channel* chan = ServerInstance->FindChan(names[cursor->pos++]);
+		if (chan && Matches(chan, cursor->filter))
+			WriteEntry(user, chan);
+	}
+	return true;
+}
+
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+{
+	ListFilter filter;
+
+	/* A new LIST replaces any that is still being sent, keeping its place in the queue */
+	bool queued = (ext.get(user) != NULL);
+	ext.unset(user);
+
+	user->WriteNumeric(321, "%s Channel :Users Name",user->nick.c_str());
+
+	if (parameters.size() == 1)
+		ParseFilter(parameters[0], filter);
+
+	if (!snapshot || snapshot->created + LIST_SNAPSHOT_AGE <= ServerInstance->Time())
+		snapshot = new ListSnapshot;
 
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
+	ListCursor* cursor = new ListCursor(snapshot, filter);
+	if (Continue(user, cursor))
+	{
+		delete cursor;
+		user->WriteNumeric(323, "%s :End of channel list.",user->nick.c_str());
+		return CMD_SUCCESS;
+	}
+
+	ext.set(user, cursor);
+	if (!queued)
+		paused.push_back(user->uuid);
+	return CMD_SUCCESS;
+}
+
+void CommandList::ResumeAll()
+{
+	std::vector<std::string>::iterator i = paused.begin();
+	while (i != paused.end())
+	{
+		User* user = ServerInstance->FindUUID(*i);
+		ListCursor* cursor = user ? ext.get(user) : NULL;
 
-		if (!n && i->second->IsModeSet('p'))
+		if (!cursor)
 		{
-			/* Channel is +p and user is outside/not privileged */
-			user->WriteNumeric(322, "%s * %ld :",user->nick.c_str(), users);
+			/* The user quit, or replaced this LIST with one that finished at once */
+			i = paused.erase(i);
 		}
-		else
+		else if (Continue(user, cursor))
 		{
-			if (n || !i->second->IsModeSet('s'))
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(322, "%s %s %ld :[+%s] %s",user->nick.c_str(),i->second->name.c_str(),users,i->second->ChanModes(n),i->second->topic.c_str());
-			}
+			ext.unset(user);
+			user->WriteNumeric(323, "%s :End of channel list.",user->nick.c_str());
+			i = paused.erase(i);
 		}
+		else
+			++i;
 	}
-	user->WriteNumeric(323, "%s :End of channel list.",user->nick.c_str());
-
-	return CMD_SUCCESS;
 }
 
+class ModuleList : public Module
+{
+	CommandList cmd;
+ public:
+	ModuleList() : cmd(this)
+	{
+	}
+
+	void init()
+	{
+		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(cmd.ext);
+	}
+
+	Version GetVersion()
+	{
+		return Version(cmd.name, VF_VENDOR|VF_CORE);
+	}
+};
 
-COMMAND_INIT(CommandList)
+MODULE_INIT(ModuleList)
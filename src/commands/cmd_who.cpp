@@ -13,6 +13,162 @@
 
 #include "inspircd.h"
 
+typedef std::multimap<std::string, User*> WhoKeyMap;
+
+/** Where a user has been filed in the WHO indexes, so that the entries
+ * can be removed again without knowing what the user's hosts were.
+ */
+struct WhoIndexEntry
+{
+	std::vector<std::pair<WhoKeyMap*, WhoKeyMap::iterator> > hosts;
+	std::string server;
+};
+
+/** Secondary indexes over registered users, so that WHO on a host or
+ * server mask does not have to test every user on the network. Hosts are
+ * kept in sorted maps, both as-is and reversed, which turns a literal
+ * prefix (such as an IP range, 10.0.0.*) or a literal suffix (*.isp.net)
+ * into a range scan. Users are also bucketed by their server.
+ */
+class WhoIndex
+{
+	WhoKeyMap forward;
+	WhoKeyMap reverse;
+	std::map<std::string, std::set<User*> > servers;
+
+	/** Hosts are matched with ascii_case_insensitive_map, so they are filed in lower case */
+	static std::string Key(const std::string& host)
+	{
+		std::string key(host);
+		for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+			*i = ascii_case_insensitive_map[(unsigned char)*i];
+		return key;
+	}
+
+	static void Scan(const WhoKeyMap& map, const std::string& prefix, std::vector<User*>& out)
+	{
+		for (WhoKeyMap::const_iterator i = map.lower_bound(prefix); i != map.end() && !i->first.compare(0, prefix.length(), prefix); ++i)
+			out.push_back(i->second);
+	}
+
+	void AddHost(User* user, WhoIndexEntry* entry, const std::string& host)
+	{
+		std::string key = Key(host);
+		entry->hosts.push_back(std::make_pair(&forward, forward.insert(std::make_pair(key, user))));
+		std::reverse(key.begin(), key.end());
+		entry->hosts.push_back(std::make_pair(&reverse, reverse.insert(std::make_pair(key, user))));
+	}
+
+	void RemoveHosts(WhoIndexEntry* entry)
+	{
+		for (std::vector<std::pair<WhoKeyMap*, WhoKeyMap::iterator> >::iterator i = entry->hosts.begin(); i != entry->hosts.end(); ++i)
+			i->first->erase(i->second);
+		entry->hosts.clear();
+	}
+
+ public:
+	SimpleExtItem<WhoIndexEntry> ext;
+
+	WhoIndex(Module* parent) : ext("who_index", parent)
+	{
+	}
+
+	/** File a user under their real host, displayed host and server */
+	void Add(User* user)
+	{
+		if (ext.get(user))
+			return;
+
+		WhoIndexEntry* entry = new WhoIndexEntry;
+		entry->server = user->server;
+		AddHost(user, entry, user->host);
+		if (user->dhost != user->host)
+			AddHost(user, entry, user->dhost);
+		servers[entry->server].insert(user);
+		ext.set(user, entry);
+	}
+
+	void Remove(User* user)
+	{
+		WhoIndexEntry* entry = ext.get(user);
+		if (!entry)
+			return;
+
+		RemoveHosts(entry);
+		std::map<std::string, std::set<User*> >::iterator bucket = servers.find(entry->server);
+		if (bucket != servers.end())
+		{
+			bucket->second.erase(user);
+			if (bucket->second.empty())
+				servers.erase(bucket);
+		}
+		ext.unset(user);
+	}
+
+	/** Refile a user whose displayed host is about to become newhost */
+	void ChangeHost(User* user, const std::string& newhost)
+	{
+		WhoIndexEntry* entry = ext.get(user);
+		if (!entry)
+			return;
+
+		RemoveHosts(entry);
+		AddHost(user, entry, user->host);
+		if (newhost != user->host)
+			AddHost(user, entry, newhost);
+	}
+
+	/** Find every user that could possibly match a WHO mask by host, nick or server.
+	 * The candidates still have to be checked with whomatch().
+	 * @param mask The WHO mask
+	 * @param servermatch True if the mask may be matched against server names
+	 * @param out Receives the candidates, without duplicates
+	 * @return False if the indexes cannot narrow down the mask, and a full scan is needed
+	 */
+	bool Lookup(const std::string& mask, bool servermatch, std::vector<User*>& out)
+	{
+		std::string::size_type first = mask.find_first_of("*?");
+		std::string::size_type last = mask.find_last_of("*?");
+		std::string prefix = Key(mask.substr(0, first));
+		std::string suffix = Key(last == std::string::npos ? mask : mask.substr(last + 1));
+
+		if (prefix.empty() && suffix.empty())
+			return false;
+
+		if (first == std::string::npos)
+		{
+			/* Without wildcards a nick can only match exactly */
+			User* u = ServerInstance->FindNickOnly(mask);
+			if (u)
+				out.push_back(u);
+		}
+		else if (mask.find_first_of(".:") == std::string::npos)
+		{
+			/* Nicks can never contain these, so only then can a wildcard mask skip them */
+			return false;
+		}
+
+		if (prefix.length() >= suffix.length())
+			Scan(forward, prefix, out);
+		else
+		{
+			std::reverse(suffix.begin(), suffix.end());
+			Scan(reverse, suffix, out);
+		}
+
+		if (servermatch)
+		{
+			for (std::map<std::string, std::set<User*> >::const_iterator i = servers.begin(); i != servers.end(); ++i)
+				if (InspIRCd::Match(i->first, mask))
+					out.insert(out.end(), i->second.begin(), i->second.end());
+		}
+
+		std::sort(out.begin(), out.end());
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+		return true;
+	}
+};
+
 /** Handle /WHO. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -33,13 +189,21 @@ class CommandWho : public Command
 	bool opt_far;
 	bool opt_time;
 
+	/** Returns true if the options only match on host, nick and server, which the index covers */
+	bool CanUseIndex()
+	{
+		return !(opt_mode || opt_metadata || opt_realname || opt_ident || opt_port || opt_away || opt_time);
+	}
+
  public:
+	WhoIndex index;
+
 	/** Constructor for who.
 	 */
-	CommandWho ( Module* parent) : Command(parent,"WHO", 1) {
+	CommandWho ( Module* parent) : Command(parent,"WHO", 1), index(parent) {
 		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf]";
 	}
-	void SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, std::vector<std::string> &whoresults);
+	void SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, size_t& results);
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
 	 * @param pcnt The number of parameters passed to teh command
@@ -179,7 +343,7 @@ bool CommandWho::CanView(Channel* chan, User* user)
 	return false;
 }
 
-void CommandWho::SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, std::vector<std::string> &whoresults)
+void CommandWho::SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, size_t& results)
 {
 	if (!ch)
 		ch = get_first_visible_channel(u);
@@ -217,7 +381,10 @@ void CommandWho::SendWhoLine(User* user, const std::vector<std::string>& parms,
 	FOREACH_MOD(I_OnSendWhoLine, OnSendWhoLine(user, parms, u, wholine));
 
 	if (!wholine.empty())
-		whoresults.push_back(wholine);
+	{
+		user->WriteServ(wholine);
+		results++;
+	}
 }
 
 CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *user)
@@ -243,7 +410,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	opt_time = false;
 
 	Channel *ch = NULL;
-	std::vector<std::string> whoresults;
+	size_t results = 0;
 	std::string initial = "352 " + std::string(user->nick) + " ";
 
 	char matchtext[MAXBUF];
@@ -343,7 +510,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 						continue;
 				}
 
-				SendWhoLine(user, parameters, initial, ch, i->first, whoresults);
+				SendWhoLine(user, parameters, initial, ch, i->first, results);
 			}
 		}
 	}
@@ -365,37 +532,99 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 							continue;
 					}
 
-					SendWhoLine(user, parameters, initial, NULL, oper, whoresults);
+					SendWhoLine(user, parameters, initial, NULL, oper, results);
 				}
 			}
 		}
 		else
 		{
-			for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+			std::vector<User*> candidates;
+			bool servermatch = (ServerInstance->Config->HideWhoisServer.empty() || user->HasPrivPermission("users/auspex"));
+
+			if (CanUseIndex() && index.Lookup(matchtext, servermatch, candidates))
 			{
-				if (whomatch(user, i->second, matchtext))
+				for (std::vector<User*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 				{
-					if (!user->SharesChannelWith(i->second))
+					if (whomatch(user, *i, matchtext))
 					{
-						if (usingwildcards && (i->second->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
-							continue;
+						if (!user->SharesChannelWith(*i))
+						{
+							if (usingwildcards && ((*i)->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
+								continue;
+						}
+
+						SendWhoLine(user, parameters, initial, NULL, *i, results);
 					}
+				}
+			}
+			else
+			{
+				for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+				{
+					if (whomatch(user, i->second, matchtext))
+					{
+						if (!user->SharesChannelWith(i->second))
+						{
+							if (usingwildcards && (i->second->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
+								continue;
+						}
 
-					SendWhoLine(user, parameters, initial, NULL, i->second, whoresults);
+						SendWhoLine(user, parameters, initial, NULL, i->second, results);
+					}
 				}
 			}
 		}
 	}
-	/* Send the results out */
-	for (std::vector<std::string>::const_iterator n = whoresults.begin(); n != whoresults.end(); n++)
-		user->WriteServ(*n);
 	user->WriteNumeric(315, "%s %s :End of /WHO list.",user->nick.c_str(), *parameters[0].c_str() ? parameters[0].c_str() : "*");
 
 	// Penalize the user a bit for large queries
 	// (add one unit of penalty per 200 results)
 	if (IS_LOCAL(user))
-		IS_LOCAL(user)->CommandFloodPenalty += whoresults.size() * 5;
+		IS_LOCAL(user)->CommandFloodPenalty += results * 5;
 	return CMD_SUCCESS;
 }
 
-COMMAND_INIT(CommandWho)
+class ModuleWho : public Module
+{
+	CommandWho cmd;
+ public:
+	ModuleWho() : cmd(this)
+	{
+	}
+
+	void init()
+	{
+		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(cmd.index.ext);
+
+		/* Users already on the network when this is (re)loaded */
+		for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+			if (i->second->registered == REG_ALL)
+				cmd.index.Add(i->second);
+
+		Implementation eventlist[] = { I_OnPostConnect, I_OnUserQuit, I_OnChangeHost };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	void OnPostConnect(User* user)
+	{
+		cmd.index.Add(user);
+	}
+
+	void OnUserQuit(User* user, const std::string&, const std::string&)
+	{
+		cmd.index.Remove(user);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost)
+	{
+		cmd.index.ChangeHost(user, newhost.substr(0, 64));
+	}
+
+	Version GetVersion()
+	{
+		return Version(cmd.name, VF_VENDOR|VF_CORE);
+	}
+};
+
+MODULE_INIT(ModuleWho)
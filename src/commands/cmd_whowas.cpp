@@ -16,7 +16,10 @@
 
 WhoWasMaintainTimer * timer;
 
-CommandWhowas::CommandWhowas( Module* parent) : Command(parent, "WHOWAS", 1)
+/** Approximate size of a std::map node holding the given value type */
+#define WHOWAS_NODE_SIZE(type, keylen) (sizeof(type) + (keylen) + 4 * sizeof(void*))
+
+CommandWhowas::CommandWhowas( Module* parent) : Command(parent, "WHOWAS", 1), oldest(NULL), newest(NULL), entries(0), bytes(0)
 {
 	syntax = "<nick>{,<nick>}";
 	Penalty = 2;
@@ -41,42 +44,29 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
 		return CMD_FAILURE;
 	}
-	else
+
+	for (WhoWasEntry* u = i->second.first; u; u = u->next)
 	{
-		whowas_set* grp = i->second;
-		if (grp->size())
-		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-				time_t rawtime = u->signon;
-				tm *timeinfo;
-				char b[25];
-
-				timeinfo = localtime(&rawtime);
-
-				strncpy(b,asctime(timeinfo),24);
-				b[24] = 0;
-
-				user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
-
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(379, "%s %s :was connecting from *@%s",
-						user->nick.c_str(), parameters[0].c_str(), u->host.c_str());
-
-				if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
-				else
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), u->server.c_str(), b);
-			}
-		}
+		time_t rawtime = u->signon;
+		tm *timeinfo;
+		char b[25];
+
+		timeinfo = localtime(&rawtime);
+
+		strncpy(b,asctime(timeinfo),24);
+		b[24] = 0;
+
+		user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
+			u->GetIdent(),u->GetDisplayedHost(),u->GetGecos());
+
+		if (user->HasPrivPermission("users/auspex"))
+			user->WriteNumeric(379, "%s %s :was connecting from *@%s",
+				user->nick.c_str(), parameters[0].c_str(), u->GetHost());
+
+		if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
 		else
-		{
-			user->WriteNumeric(406, "%s %s :There was no such nickname",user->nick.c_str(),parameters[0].c_str());
-			user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
-			return CMD_FAILURE;
-		}
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), u->server->c_str(), b);
 	}
 
 	user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
@@ -85,19 +75,7 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 
 std::string CommandWhowas::GetStats()
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	whowas_users_fifo::iterator iter;
-	for (iter = whowas_fifo.begin(); iter != whowas_fifo.end(); iter++)
-	{
-		whowas_set* n = (whowas_set*)whowas.find(iter->second)->second;
-		if (n->size())
-		{
-			whowas_size += n->size();
-			whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-		}
-	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+	return "Whowas entries: " +ConvToStr(entries)+" ("+ConvToStr(bytes)+" bytes)";
 }
 
 void CommandWhowas::AddToWhoWas(User* user)
@@ -108,51 +86,123 @@ void CommandWhowas::AddToWhoWas(User* user)
 		return;
 	}
 
-	whowas_users::iterator iter = whowas.find(irc::string(user->nick.c_str()));
-
-	if (iter == whowas.end())
+	/* Lay the entry and its strings out in one block */
+	size_t hostlen = user->host.length() + 1;
+	size_t dhostlen = user->dhost.length() + 1;
+	size_t identlen = user->ident.length() + 1;
+	size_t gecoslen = user->fullname.length() + 1;
+	size_t size = sizeof(WhoWasEntry) - 1 + hostlen + dhostlen + identlen + gecoslen;
+
+	WhoWasEntry* entry = static_cast<WhoWasEntry*>(::operator new(size));
+	entry->size = size;
+	entry->signon = user->signon;
+	entry->added = ServerInstance->Time();
+	entry->dhost = hostlen;
+	entry->ident = entry->dhost + dhostlen;
+	entry->gecos = entry->ident + identlen;
+	memcpy(entry->data, user->host.c_str(), hostlen);
+	memcpy(entry->data + entry->dhost, user->dhost.c_str(), dhostlen);
+	memcpy(entry->data + entry->ident, user->ident.c_str(), identlen);
+	memcpy(entry->data + entry->gecos, user->fullname.c_str(), gecoslen);
+	bytes += size;
+	entries++;
+
+	whowas_servers::iterator server = servers.find(user->server);
+	if (server == servers.end())
 	{
-		whowas_set* n = new whowas_set;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		n->push_back(a);
-		whowas[user->nick.c_str()] = n;
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(),user->nick.c_str()));
+		server = servers.insert(std::make_pair(user->server, 0)).first;
+		bytes += WHOWAS_NODE_SIZE(whowas_servers::value_type, user->server.length());
+	}
+	server->second++;
+	entry->server = &server->first;
 
-		if ((int)(whowas.size()) > ServerInstance->Config->WhoWasMaxGroups)
-		{
-			whowas_users::iterator iter2 = whowas.find(whowas_fifo[0].second);
-			if (iter2 != whowas.end())
-			{
-				whowas_set* n2 = (whowas_set*)iter2->second;
-
-				if (n2->size())
-				{
-					while (n2->begin() != n2->end())
-					{
-						WhoWasGroup *a2 = *(n2->begin());
-						delete a2;
-						n2->pop_front();
-					}
-				}
-
-				delete n2;
-				whowas.erase(iter2);
-			}
-			whowas_fifo.pop_front();
-		}
+	std::pair<whowas_users::iterator, bool> ins = whowas.insert(std::make_pair(irc::string(user->nick.c_str()), WhoWasGroup()));
+	WhoWasGroup& group = ins.first->second;
+	if (ins.second)
+	{
+		group.nick = &ins.first->first;
+		group.first = group.last = NULL;
+		group.count = 0;
+		bytes += WHOWAS_NODE_SIZE(whowas_users::value_type, user->nick.length());
 	}
+
+	entry->group = &group;
+	entry->next = NULL;
+	if (group.last)
+		group.last->next = entry;
+	else
+		group.first = entry;
+	group.last = entry;
+	group.count++;
+
+	entry->newer = NULL;
+	entry->older = newest;
+	if (newest)
+		newest->newer = entry;
+	else
+		oldest = entry;
+	newest = entry;
+
+	if ((int)group.count > ServerInstance->Config->WhoWasGroupSize)
+		DeleteEntry(group.first);
+
+	Evict(entry->added);
+}
+
+void CommandWhowas::DeleteEntry(WhoWasEntry* entry)
+{
+	/* Entries are added in time order, so anything removed is always the oldest for its nick */
+	WhoWasGroup* group = entry->group;
+	group->first = entry->next;
+	if (!group->first)
+		group->last = NULL;
+	group->count--;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		oldest = entry->newer;
+	if (entry->newer)
+		entry->newer->older = entry->older;
 	else
+		newest = entry->older;
+
+	whowas_servers::iterator server = servers.find(*entry->server);
+	if (server != servers.end() && !--server->second)
 	{
-		whowas_set* group = (whowas_set*)iter->second;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		group->push_back(a);
+		bytes -= WHOWAS_NODE_SIZE(whowas_servers::value_type, server->first.length());
+		servers.erase(server);
+	}
 
-		if ((int)(group->size()) > ServerInstance->Config->WhoWasGroupSize)
-		{
-			WhoWasGroup *a2 = (WhoWasGroup*)*(group->begin());
-			delete a2;
-			group->pop_front();
-		}
+	if (!group->count)
+	{
+		irc::string nick = *group->nick;
+		bytes -= WHOWAS_NODE_SIZE(whowas_users::value_type, nick.length());
+		whowas.erase(nick);
+	}
+
+	bytes -= entry->size;
+	entries--;
+	::operator delete(entry);
+}
+
+void CommandWhowas::Evict(time_t t)
+{
+	size_t maxmemory = ServerInstance->Config->WhoWasMaxMemory;
+	size_t maxgroups = ServerInstance->Config->WhoWasMaxGroups;
+	time_t expiry = t - ServerInstance->Config->WhoWasMaxKeep;
+
+	while (oldest && ((maxmemory && bytes > maxmemory) || oldest->added < expiry))
+		DeleteEntry(oldest);
+
+	/* Too many nicks: forget the nick seen longest ago entirely, rather than
+	 * the oldest entry of each of many nicks
+	 */
+	while (oldest && whowas.size() > maxgroups)
+	{
+		WhoWasGroup* group = oldest->group;
+		for (size_t n = group->count; n; n--)
+			DeleteEntry(group->first);
 	}
 }
 
@@ -161,89 +211,29 @@ void CommandWhowas::PruneWhoWas(time_t t)
 {
 	/* config values */
 	int groupsize = ServerInstance->Config->WhoWasGroupSize;
-	int maxgroups = ServerInstance->Config->WhoWasMaxGroups;
-	int maxkeep =   ServerInstance->Config->WhoWasMaxKeep;
 
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
+	if (groupsize == 0 || ServerInstance->Config->WhoWasMaxGroups == 0)
 	{
-		if (fifosize > maxgroups || whowas_fifo[0].first < t - maxkeep)
-		{
-			iter = whowas.find(whowas_fifo[0].second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS",DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-
-			whowas_set* n = (whowas_set*)iter->second;
-
-			if (n->size())
-			{
-				while (n->begin() != n->end())
-				{
-					WhoWasGroup *a = *(n->begin());
-					delete a;
-					n->pop_front();
-				}
-			}
-
-			delete n;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
+		while (oldest)
+			DeleteEntry(oldest);
+		return;
 	}
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	fifosize = (int)whowas_fifo.size();
-	for (int i = 0; i < fifosize; i++)
+	/* first cut the whowas sets to new size (groupsize) */
+	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); iter++)
 	{
-		iter = whowas.find(whowas_fifo[0].second);
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS",DEFAULT, "BUG: Whowas maps got corrupted! (2)");
-			return;
-		}
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			int nickcount = n->size();
-			while (n->begin() != n->end() && nickcount > groupsize)
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-				nickcount--;
-			}
-		}
+		while ((int)iter->second.count > groupsize)
+			DeleteEntry(iter->second.first);
 	}
+
+	/* then prune the oldest entries until the list fits the other limits */
+	Evict(t);
 }
 
 /* call maintain once an hour to remove expired nicks */
 void CommandWhowas::MaintainWhoWas(time_t t)
 {
-	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); iter++)
-	{
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			while ((n->begin() != n->end()) && ((*n->begin())->signon < t - ServerInstance->Config->WhoWasMaxKeep))
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->erase(n->begin());
-			}
-		}
-	}
+	Evict(t);
 }
 
 CommandWhowas::~CommandWhowas()
@@ -253,45 +243,8 @@ CommandWhowas::~CommandWhowas()
 		ServerInstance->Timers->DelTimer(timer);
 	}
 
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
-	{
-		iter = whowas.find(whowas_fifo[0].second);
-
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS",DEFAULT, "BUG: Whowas maps got corrupted! (3)");
-			return;
-		}
-
-		whowas_set* n = (whowas_set*)iter->second;
-
-		if (n->size())
-		{
-			while (n->begin() != n->end())
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-			}
-		}
-
-		delete n;
-		whowas.erase(iter);
-		whowas_fifo.pop_front();
-	}
-}
-
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server), gecos(user->fullname), signon(user->signon)
-{
-}
-
-WhoWasGroup::~WhoWasGroup()
-{
+	while (oldest)
+		DeleteEntry(oldest);
 }
 
 /* every hour, run this function which removes all entries older than Config->WhoWasMaxKeep */
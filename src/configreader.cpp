@@ -21,9 +21,11 @@
 ServerConfig::ServerConfig()
 {
 	WhoWasGroupSize = WhoWasMaxGroups = WhoWasMaxKeep = 0;
-	RawLog = NoUserDns = HideBans = HideSplits = UndernetMsgPrefix = false;
+	WhoWasMaxMemory = 0;
+	RawLog = NoUserDns = Profile = HideBans = HideSplits = UndernetMsgPrefix = false;
 	WildcardIPv6 = CycleHosts = InvBypassModes = true;
 	dns_timeout = 5;
+	dns_cachesize = 10000;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
 	SoftLimit = ServerInstance->SE->GetMaxFds();
@@ -469,6 +471,7 @@ void ServerConfig::Fill()
 	ModPath = ConfValue("path")->getString("moduledir", MOD_PATH);
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240);
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
+	dns_cachesize = std::max(ConfValue("dns")->getInt("cachesize", 10000), 1L);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
 	UserStats = security->getString("userstats");
@@ -480,6 +483,7 @@ void ServerConfig::Fill()
 	RestrictBannedUsers = security->getBool("restrictbannedusers", true);
 	GenericOper = security->getBool("genericoper");
 	NoUserDns = ConfValue("performance")->getBool("nouserdns");
+	Profile = ConfValue("performance")->getBool("profile");
 	SyntaxHints = options->getBool("syntaxhints");
 	CycleHosts = options->getBool("cyclehosts");
 	CycleHostsFromUser = options->getBool("cyclehostsfromuser");
@@ -491,6 +495,7 @@ void ServerConfig::Fill()
 	WhoWasGroupSize = ConfValue("whowas")->getInt("groupsize");
 	WhoWasMaxGroups = ConfValue("whowas")->getInt("maxgroups");
 	WhoWasMaxKeep = ServerInstance->Duration(ConfValue("whowas")->getString("maxkeep"));
+	WhoWasMaxMemory = ConfValue("whowas")->getInt("maxmemory");
 	MaxChans = ConfValue("channels")->getInt("users", 20);
 	OperMaxChans = ConfValue("channels")->getInt("opers", 60);
 	c_ipv4_range = ConfValue("cidr")->getInt("ipv4clone", 32);
@@ -513,6 +518,7 @@ void ServerConfig::Fill()
 	range(WhoWasGroupSize, 0, 10000, 10, "<whowas:groupsize>");
 	range(WhoWasMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
 	range(WhoWasMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
+	range(WhoWasMaxMemory, 0L, LONG_MAX, 0L, "<whowas:maxmemory>");
 
 	ValidIP(DNSServer, "<dns:server>");
 
@@ -883,6 +889,7 @@ void ConfigReaderThread::Finish()
 		ServerInstance->Res->Rehash();
 		ServerInstance->ResetMaxBans();
 		Config->ApplyDisabledCommands(Config->DisabledCommands);
+		ServerInstance->Profile.SetEnabled(Config->Profile);
 		User* user = ServerInstance->FindNick(TheUserUID);
 		FOREACH_MOD(I_OnRehash, OnRehash(user));
 		ServerInstance->BuildISupport();
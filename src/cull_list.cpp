@@ -29,14 +29,14 @@ void CullList::Apply()
 		}
 		working.clear();
 	}
-	std::set<classbase*> gone;
 	std::vector<classbase*> queue;
 	queue.reserve(list.size() + 32);
 	for(unsigned int i=0; i < list.size(); i++)
 	{
 		classbase* c = list[i];
-		if (gone.insert(c).second)
+		if (!c->culled)
 		{
+			c->culled = true;
 			ServerInstance->Logs->Log("CULLLIST", DEBUG, "Deleting %s @%p", typeid(*c).name(),
 				(void*)c);
 			c->cull();
@@ -97,6 +97,7 @@ class DNSRequest
 	DNS*            dnsobj;		/* DNS caller (where we get our FD from) */
 	unsigned long	ttl;		/* Time to live */
 	std::string     orig;		/* Original requested name/ip */
+	time_t          deadline;	/* Time at which the request times out */
 
 	DNSRequest(DNS* dns, int id, const std::string &original);
 	~DNSRequest();
@@ -120,36 +121,24 @@ class CacheTimer : public Timer
 
 class RequestTimeout : public Timer
 {
-	DNSRequest* watch;
-	int watchid;
+	DNS* dns;
  public:
-	RequestTimeout(unsigned long n, DNSRequest* watching, int id) : Timer(n, ServerInstance->Time()), watch(watching), watchid(id)
-	{
-	}
-	~RequestTimeout()
-	{
-		if (ServerInstance->Res)
-			Tick(0);
-	}
+	RequestTimeout(DNS* thisdns)
+		: Timer(1, ServerInstance->Time(), true), dns(thisdns) { }
 
-	void Tick(time_t)
+	virtual void Tick(time_t TIME)
 	{
-		if (ServerInstance->Res->requests[watchid] == watch)
-		{
-			/* Still exists, whack it */
-			if (ServerInstance->Res->Classes[watchid])
-			{
-				ServerInstance->Res->Classes[watchid]->OnError(RESOLVER_TIMEOUT, "Request timed out");
-				delete ServerInstance->Res->Classes[watchid];
-				ServerInstance->Res->Classes[watchid] = NULL;
-			}
-			ServerInstance->Res->requests[watchid] = NULL;
-			delete watch;
-		}
+		dns->TimeoutRequests(TIME);
 	}
 };
 
-CachedQuery::CachedQuery(const std::string &res, unsigned int ttl) : data(res)
+/** A cached item which has been used at least this many times
+ * since it was fetched is refreshed before it expires
+ */
+static const unsigned int CACHE_REFRESH_HITS = 3;
+
+CachedQuery::CachedQuery(const std::string &res, unsigned int timetolive)
+	: data(res), ttl(timetolive), hits(0), refreshing(false), type(DNS_QUERY_NONE)
 {
 	expires = ServerInstance->Time() + ttl;
 }
@@ -169,8 +158,7 @@ DNSRequest::DNSRequest(DNS* dns, int rid, const std::string &original) : dnsobj(
 	res = new unsigned char[sizeof(DNSHeader) * 2];
 	*res = 0;
 	orig = original;
-	RequestTimeout* RT = new RequestTimeout(ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5, this, rid);
-	ServerInstance->Timers->AddTimer(RT); /* The timer manager frees this */
+	deadline = ServerInstance->Time() + (ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5);
 }
 
 /* Deallocate the processing buffer */
@@ -246,10 +234,10 @@ DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 	if (this->GetFd() == -1)
 		return NULL;
 
-	/* Create an id */
-	do {
-		id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID);
-	} while (requests[id]);
+	/* Take a random id from the pool of unused ones */
+	id = this->AllocateId();
+	if (id == -1)
+		return NULL;
 
 	DNSRequest* req = new DNSRequest(this, id, original);
 
@@ -266,33 +254,136 @@ DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 	 * so there needs to be no second check for the ::end()
 	 */
 	requests[id] = req;
+	timeouts.push_back(std::make_pair(req->deadline, id));
 
 	/* According to the C++ spec, new never returns NULL. */
 	return req;
 }
 
+int DNS::AllocateId()
+{
+	if (!freeids)
+		return -1;
+
+	/* Swap a random free id to the end of the free section, then shrink it */
+	int pos = ServerInstance->GenRandomInt(freeids);
+	int last = --freeids;
+	unsigned short id = idpool[pos];
+	idpool[pos] = idpool[last];
+	idpos[idpool[pos]] = pos;
+	idpool[last] = id;
+	idpos[id] = last;
+	return id;
+}
+
+void DNS::ReleaseId(int id)
+{
+	if (requests[id] || Classes[id] || idpos[id] < freeids)
+		return;
+
+	/* Swap the id to the front of the used section, then grow the free section over it */
+	int pos = idpos[id];
+	int first = freeids++;
+	idpool[pos] = idpool[first];
+	idpos[idpool[pos]] = pos;
+	idpool[first] = id;
+	idpos[id] = first;
+}
+
+void DNS::TimeoutRequests(time_t now)
+{
+	while (!timeouts.empty() && timeouts.front().first <= now)
+	{
+		int id = timeouts.front().second;
+		timeouts.pop_front();
+
+		/* The id may since have been reused by a request with a later deadline */
+		DNSRequest* req = requests[id];
+		if (!req || req->deadline > now)
+			continue;
+
+		/* If this was a refresh, let the cached item expire normally */
+		dnscache::iterator ci = cache->find(CacheKey(req->orig, req->type));
+		if (ci != cache->end())
+			ci->second.refreshing = false;
+
+		EndInFlight(id, req->orig, req->type);
+		requests[id] = NULL;
+		delete req;
+
+		std::vector<Resolver*> waiting;
+		TakeResolvers(id, waiting);
+		ReleaseId(id);
+		for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
+		{
+			(*i)->OnError(RESOLVER_TIMEOUT, "Request timed out");
+			delete *i;
+		}
+	}
+}
+
+void DNS::TakeResolvers(int id, std::vector<Resolver*> &out)
+{
+	if (Classes[id])
+	{
+		out.push_back(Classes[id]);
+		Classes[id] = NULL;
+	}
+
+	std::pair<std::multimap<int, Resolver*>::iterator, std::multimap<int, Resolver*>::iterator> range = waiters.equal_range(id);
+	for (std::multimap<int, Resolver*>::iterator i = range.first; i != range.second; ++i)
+		out.push_back(i->second);
+	waiters.erase(range.first, range.second);
+}
+
+void DNS::EndInFlight(int id, const std::string &source, QueryType qt)
+{
+	dnsinflight::iterator i = inflight.find(CacheKey(source, qt));
+	if (i != inflight.end() && i->second == id)
+		inflight.erase(i);
+}
+
+int DNS::FindInFlight(const std::string &source, QueryType qt)
+{
+	dnsinflight::iterator i = inflight.find(CacheKey(source, qt));
+	if (i == inflight.end() || !requests[i->second])
+		return -1;
+	return i->second;
+}
+
 int DNS::ClearCache()
 {
 	/* This ensures the buckets are reset to sane levels */
 	int rv = this->cache->size();
 	delete this->cache;
 	this->cache = new dnscache();
+	cachelru.clear();
 	return rv;
 }
 
 int DNS::PruneCache()
 {
 	int n = 0;
-	dnscache* newcache = new dnscache();
-	for (dnscache::iterator i = this->cache->begin(); i != this->cache->end(); i++)
-		/* Dont include expired items (theres no point) */
+	for (dnscache::iterator i = this->cache->begin(); i != this->cache->end(); )
+	{
+		/* Dont keep expired items (theres no point) */
 		if (i->second.CalcTTLRemaining())
-			newcache->insert(*i);
-		else
-			n++;
+		{
+			i++;
+			continue;
+		}
+		cachelru.erase(i->second.lru);
+		this->cache->erase(i++);
+		n++;
+	}
 
-	delete this->cache;
-	this->cache = newcache;
+	/* The cache may have been made smaller by a rehash */
+	while (cache->size() > ServerInstance->Config->dns_cachesize)
+	{
+		cache->erase(cachelru.back());
+		cachelru.pop_back();
+		n++;
+	}
 	return n;
 }
 
@@ -360,9 +451,11 @@ DNS::DNS()
 	/* Clear the requests class table */
 	memset(requests,0,sizeof(requests));
 
-	/* Set the id of the next request to 0
+	/* Every id starts off free
 	 */
-	currid = 0;
+	for (int i = 0; i < MAX_REQUEST_ID; i++)
+		idpool[i] = idpos[i] = i;
+	freeids = MAX_REQUEST_ID;
 
 	/* DNS::Rehash() sets this to a valid ptr
 	 */
@@ -378,8 +471,10 @@ DNS::DNS()
 	this->Rehash();
 
 	this->PruneTimer = new CacheTimer(this);
+	this->TimeoutTimer = new RequestTimeout(this);
 
 	ServerInstance->Timers->AddTimer(this->PruneTimer);
+	ServerInstance->Timers->AddTimer(this->TimeoutTimer);
 }
 
 /** Build a payload to be placed after the header, based upon input data, a resource type, a class and a pointer to a buffer */
@@ -630,8 +725,9 @@ DNSResult DNS::GetResult()
 		 * Put the error message in the second field.
 		 */
 		std::string ro = req->orig;
+		QueryType rt = req->type;
 		delete req;
-		return DNSResult(this_id | ERROR_MASK, data.second, 0, ro);
+		return DNSResult(this_id | ERROR_MASK, data.second, 0, ro, rt);
 	}
 	else
 	{
@@ -687,8 +783,9 @@ DNSResult DNS::GetResult()
 
 		/* Build the reply with the id and hostname/ip in it */
 		std::string ro = req->orig;
+		QueryType rt = req->type;
 		delete req;
-		return DNSResult(this_id,resultstr,ttl,ro);
+		return DNSResult(this_id,resultstr,ttl,ro,rt);
 	}
 }
 
@@ -878,22 +975,132 @@ DNS::~DNS()
 	ServerInstance->SE->Shutdown(this, 2);
 	ServerInstance->SE->Close(this);
 	ServerInstance->Timers->DelTimer(this->PruneTimer);
+	ServerInstance->Timers->DelTimer(this->TimeoutTimer);
+
+	/* Whatever is still in use sits after the free ids in the pool */
+	for (int i = freeids; i < MAX_REQUEST_ID; i++)
+	{
+		int id = idpool[i];
+		delete requests[id];
+		delete Classes[id];
+	}
+	for (std::multimap<int, Resolver*>::iterator i = waiters.begin(); i != waiters.end(); ++i)
+		delete i->second;
+
 	if (cache)
 		delete cache;
 }
 
-CachedQuery* DNS::GetCache(const std::string &source)
+irc::string DNS::CacheKey(const std::string &source, QueryType qt)
+{
+	if (qt == DNS_QUERY_PTR4 || qt == DNS_QUERY_PTR6)
+		qt = DNS_QUERY_PTR;
+	return irc::string((ConvToStr(qt) + " " + source).c_str());
+}
+
+CachedQuery* DNS::GetCache(const std::string &source, QueryType qt)
+{
+	dnscache::iterator x = cache->find(CacheKey(source, qt));
+	if (x == cache->end())
+		return NULL;
+
+	CachedQuery* cq = &(x->second);
+	cachelru.splice(cachelru.begin(), cachelru, cq->lru);
+	cq->hits++;
+
+	/* Refresh items in frequent use once less than a fifth of their TTL remains,
+	 * so that lookups for them keep being answered from the cache.
+	 */
+	int remaining = cq->CalcTTLRemaining();
+	if (remaining && !cq->refreshing && cq->hits >= CACHE_REFRESH_HITS && (unsigned int)remaining * 5 <= cq->ttl)
+		RefreshCache(cq);
+
+	return cq;
+}
+
+void DNS::DelCache(const std::string &source, QueryType qt)
 {
-	dnscache::iterator x = cache->find(source.c_str());
+	dnscache::iterator x = cache->find(CacheKey(source, qt));
+	if (x == cache->end())
+		return;
+	cachelru.erase(x->second.lru);
+	cache->erase(x);
+}
+
+void DNS::AddCache(const std::string &source, QueryType qt, const std::string &result, unsigned int ttl)
+{
+	irc::string key = CacheKey(source, qt);
+	dnscache::iterator x = cache->find(key);
 	if (x != cache->end())
-		return &(x->second);
+	{
+		/* A refreshed item keeps its place in the LRU list */
+		std::list<irc::string>::iterator pos = x->second.lru;
+		x->second = CachedQuery(result, ttl);
+		x->second.lru = pos;
+	}
 	else
-		return NULL;
+	{
+		if (cache->size() >= ServerInstance->Config->dns_cachesize && !cachelru.empty())
+		{
+			cache->erase(cachelru.back());
+			cachelru.pop_back();
+		}
+		x = cache->insert(std::make_pair(key, CachedQuery(result, ttl))).first;
+		cachelru.push_front(key);
+		x->second.lru = cachelru.begin();
+	}
+	x->second.source = source;
+	x->second.type = (qt == DNS_QUERY_PTR4 || qt == DNS_QUERY_PTR6) ? DNS_QUERY_PTR : qt;
 }
 
-void DNS::DelCache(const std::string &source)
+void DNS::RefreshCache(CachedQuery* cq)
 {
-	cache->erase(source.c_str());
+	QueryType qt = cq->type;
+	if (qt == DNS_QUERY_PTR)
+		qt = (cq->source.find(':') != std::string::npos) ? DNS_QUERY_PTR6 : DNS_QUERY_PTR4;
+
+	/* The result is cached by HandleEvent; there is no Resolver to tell */
+	if (StartQuery(cq->source, qt) != -1)
+	{
+		cq->refreshing = true;
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Refreshing cached %s (%d seconds left)", cq->source.c_str(), cq->CalcTTLRemaining());
+	}
+}
+
+int DNS::StartQuery(const std::string &source, QueryType qt)
+{
+	int id;
+	switch (qt)
+	{
+		case DNS_QUERY_A:
+			id = this->GetIP(source.c_str());
+		break;
+
+		case DNS_QUERY_PTR4:
+			id = this->GetNameForce(source.c_str(), PROTOCOL_IPV4);
+		break;
+
+		case DNS_QUERY_PTR6:
+			id = this->GetNameForce(source.c_str(), PROTOCOL_IPV6);
+		break;
+
+		case DNS_QUERY_AAAA:
+			id = this->GetIP6(source.c_str());
+		break;
+
+		case DNS_QUERY_CNAME:
+			id = this->GetCName(source.c_str());
+		break;
+
+		default:
+			ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS request with unknown query type %d", qt);
+			return -1;
+	}
+
+	/* Later lookups of the same name and type can attach to this one */
+	if (id != -1)
+		inflight[CacheKey(source, qt)] = id;
+	return id;
 }
 
 void Resolver::TriggerCachedResult()
@@ -908,13 +1115,14 @@ Resolver::Resolver(const std::string &source, QueryType qt, bool &cached, Module
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Resolver::Resolver");
 	cached = false;
 
-	CQ = ServerInstance->Res->GetCache(source);
+	CQ = ServerInstance->Res->GetCache(source, qt);
 	if (CQ)
 	{
 		time_left = CQ->CalcTTLRemaining();
 		if (!time_left)
 		{
-			ServerInstance->Res->DelCache(source);
+			ServerInstance->Res->DelCache(source, qt);
+			CQ = NULL;
 		}
 		else
 		{
@@ -923,35 +1131,19 @@ Resolver::Resolver(const std::string &source, QueryType qt, bool &cached, Module
 		}
 	}
 
-	switch (querytype)
+	/* Share an identical lookup which is already in flight, rather than sending another */
+	this->myid = ServerInstance->Res->FindInFlight(source, querytype);
+	if (this->myid != -1)
 	{
-		case DNS_QUERY_A:
-			this->myid = ServerInstance->Res->GetIP(source.c_str());
-		break;
-
-		case DNS_QUERY_PTR4:
-			querytype = DNS_QUERY_PTR;
-			this->myid = ServerInstance->Res->GetNameForce(source.c_str(), PROTOCOL_IPV4);
-		break;
-
-		case DNS_QUERY_PTR6:
-			querytype = DNS_QUERY_PTR;
-			this->myid = ServerInstance->Res->GetNameForce(source.c_str(), PROTOCOL_IPV6);
-		break;
-
-		case DNS_QUERY_AAAA:
-			this->myid = ServerInstance->Res->GetIP6(source.c_str());
-		break;
+		if (ServerInstance->stats)
+			ServerInstance->stats->statsDnsCoalesced++;
+	}
+	else
+		this->myid = ServerInstance->Res->StartQuery(source, querytype);
 
-		case DNS_QUERY_CNAME:
-			this->myid = ServerInstance->Res->GetCName(source.c_str());
-		break;
+	if (querytype == DNS_QUERY_PTR4 || querytype == DNS_QUERY_PTR6)
+		querytype = DNS_QUERY_PTR;
 
-		default:
-			ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS request with unknown query type %d", querytype);
-			this->myid = -1;
-		break;
-	}
 	if (this->myid == -1)
 	{
 		throw ModuleException("Resolver: Couldn't get an id to make a request");
@@ -1005,31 +1197,44 @@ void DNS::HandleEvent(EventType, int)
 		{
 			/* Mask off the error bit */
 			res.id -= ERROR_MASK;
-			/* Marshall the error to the correct class */
-			if (Classes[res.id])
+
+			/* If this was a refresh, let the cached item expire normally */
+			dnscache::iterator ci = cache->find(CacheKey(res.original, res.type));
+			if (ci != cache->end())
+				ci->second.refreshing = false;
+
+			EndInFlight(res.id, res.original, res.type);
+			std::vector<Resolver*> waiting;
+			TakeResolvers(res.id, waiting);
+			ReleaseId(res.id);
+
+			/* Marshall the error to every class which asked for it */
+			if (!waiting.empty() && ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsBad++;
+			for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
 			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsBad++;
-				Classes[res.id]->OnError(RESOLVER_NXDOMAIN, res.result);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
+				(*i)->OnError(RESOLVER_NXDOMAIN, res.result);
+				delete *i;
 			}
 			return;
 		}
 		else
 		{
-			/* It is a non-error result, marshall the result to the correct class */
-			if (Classes[res.id])
+			/* Cache the result even if nobody is waiting for it, as it may be a refresh */
+			this->AddCache(res.original, res.type, res.result, res.ttl);
+
+			EndInFlight(res.id, res.original, res.type);
+			std::vector<Resolver*> waiting;
+			TakeResolvers(res.id, waiting);
+			ReleaseId(res.id);
+
+			/* It is a non-error result, marshall the result to every class which asked for it */
+			if (!waiting.empty() && ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsGood++;
+			for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
 			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsGood++;
-
-				if (!this->GetCache(res.original.c_str()))
-					this->cache->insert(std::make_pair(res.original.c_str(), CachedQuery(res.result, res.ttl)));
-
-				Classes[res.id]->OnLookupComplete(res.result, res.ttl, false);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
+				(*i)->OnLookupComplete(res.result, res.ttl, false);
+				delete *i;
 			}
 		}
 
@@ -1055,6 +1260,12 @@ bool DNS::AddResolverClass(Resolver* r)
 			Classes[r->GetId()] = r;
 			return true;
 		}
+		else if (requests[r->GetId()])
+		{
+			/* This class attached to a lookup already in flight */
+			waiters.insert(std::make_pair(r->GetId(), r));
+			return true;
+		}
 		else
 			/* Duplicate id */
 			return false;
@@ -1073,16 +1284,34 @@ bool DNS::AddResolverClass(Resolver* r)
 
 void DNS::CleanResolvers(Module* module)
 {
-	for (int i = 0; i < MAX_REQUEST_ID; i++)
+	/* Only the ids after the free ones in the pool can be in use */
+	for (int i = freeids; i < MAX_REQUEST_ID; i++)
 	{
-		if (Classes[i])
+		int id = idpool[i];
+		if (Classes[id])
 		{
-			if (Classes[i]->GetCreator() == module)
+			if (Classes[id]->GetCreator() == module)
 			{
-				Classes[i]->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
-				delete Classes[i];
-				Classes[i] = NULL;
+				Classes[id]->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
+				delete Classes[id];
+				Classes[id] = NULL;
+				/* The request is still in flight, so the id stays in use
+				 * (and in the same place in the pool) until it completes
+				 */
 			}
 		}
 	}
+
+	/* Classes sharing a lookup with another module's go too, leaving the rest waiting */
+	for (std::multimap<int, Resolver*>::iterator i = waiters.begin(); i != waiters.end(); )
+	{
+		if (i->second->GetCreator() == module)
+		{
+			i->second->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
+			delete i->second;
+			waiters.erase(i++);
+		}
+		else
+			++i;
+	}
 }
@@ -141,6 +141,85 @@ void nspace::strlower(char *n)
 }
 
 
+/** Fill a hash seed from the kernel's random pool. The core's GenRandom is
+ * only random() until an SSL module replaces it, which is too late and too
+ * predictable for the tables built at startup.
+ */
+static void ReadSeed(char* seed, size_t len)
+{
+#ifndef WINDOWS
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0)
+	{
+		size_t got = 0;
+		while (got < len)
+		{
+			ssize_t n = read(fd, seed + got, len - got);
+			if (n <= 0)
+				break;
+			got += n;
+		}
+		close(fd);
+		if (got == len)
+			return;
+	}
+#endif
+	ServerInstance->GenRandom(seed, len);
+}
+
+irc::insensitive_hash::insensitive_hash()
+{
+	uint64_t seed[2];
+	ReadSeed((char*)seed, sizeof(seed));
+	k0 = seed[0];
+	k1 = seed[1];
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+	} while (0)
+#define U64(hi, lo) (((uint64_t)(hi) << 32) | (lo))
+
+size_t irc::insensitive_hash::operator()(const std::string& s) const
+{
+	uint64_t v0 = k0 ^ U64(0x736f6d65, 0x70736575);
+	uint64_t v1 = k1 ^ U64(0x646f7261, 0x6e646f6d);
+	uint64_t v2 = k0 ^ U64(0x6c796765, 0x6e657261);
+	uint64_t v3 = k1 ^ U64(0x74656462, 0x79746573);
+
+	/* Fold and hash a whole 64 bit word at a time */
+	const unsigned char* map = national_case_insensitive_map;
+	const unsigned char* p = (const unsigned char*)s.data();
+	size_t len = s.length();
+	const unsigned char* end = p + (len & ~(size_t)7);
+	for (; p != end; p += 8)
+	{
+		uint64_t m = (uint64_t)map[p[0]] | ((uint64_t)map[p[1]] << 8) | ((uint64_t)map[p[2]] << 16) | ((uint64_t)map[p[3]] << 24)
+			| ((uint64_t)map[p[4]] << 32) | ((uint64_t)map[p[5]] << 40) | ((uint64_t)map[p[6]] << 48) | ((uint64_t)map[p[7]] << 56);
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	uint64_t b = (uint64_t)len << 56;
+	for (size_t i = 0; i < (len & 7); i++)
+		b |= (uint64_t)map[p[i]] << (8 * i);
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return (size_t)(v0 ^ v1 ^ v2 ^ v3);
+}
+
 #if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
 	size_t nspace::hash_compare<irc::string, std::less<irc::string> >::operator()(const irc::string &s) const
 #else
@@ -171,10 +171,10 @@ void InspIRCd::ResetMaxBans()
 		i->second->ResetMaxBans();
 }
 
-/** Because hash_map doesn't free its buckets when we delete items, we occasionally
+/** Because the hashes don't shrink when we delete items, we occasionally
  * recreate the hash to free them up.
  * We do this by copying the entries from the old hash to a new hash, causing all
- * empty buckets to be weeded out of the hash.
+ * empty slots to be weeded out of the hash. The new hashes also get new seeds.
  * Since this is quite expensive, it's not done very often.
  */
 void InspIRCd::RehashUsersAndChans()
@@ -364,6 +364,9 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 
 	this->Users->unregistered_count = 0;
 
+	/* The user and channel lists take their hash seeds from this */
+	srandom(TIME.tv_nsec ^ TIME.tv_sec);
+
 	this->Users->clientlist = new user_hash();
 	this->Users->uuidlist = new user_hash();
 	this->chanlist = new chan_hash();
@@ -380,8 +383,6 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->Config->cmdline.argv = argv;
 	this->Config->cmdline.argc = argc;
 
-	srandom(TIME.tv_nsec ^ TIME.tv_sec);
-
 	struct option longopts[] =
 	{
 		{ "nofork",	no_argument,		&do_nofork,	1	},
@@ -568,6 +569,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	/* Just in case no modules were loaded - fix for bug #101 */
 	this->BuildISupport();
 	Config->ApplyDisabledCommands(Config->DisabledCommands);
+	Profile.SetEnabled(Config->Profile);
 
 	if (!pl.empty())
 	{
@@ -774,6 +776,7 @@ int InspIRCd::Run()
 
 			Timers->TickTimers(TIME.tv_sec);
 			this->DoBackgroundUserStuff();
+			Logs->ReportFileErrors();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
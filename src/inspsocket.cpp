@@ -162,7 +162,7 @@ bool StreamSocket::GetNextLine(std::string& line, char delim)
 
 void StreamSocket::DoRead()
 {
-	if (IOHook)
+	if (IOHook && !(IOHookBypass & BYPASS_READ))
 	{
 		int rv = -1;
 		try
@@ -230,8 +230,10 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
+	bool hooked = IOHook && !(IOHookBypass & BYPASS_WRITE);
+
 #ifndef DISABLE_WRITEV
-	if (IOHook)
+	if (hooked)
 #endif
 	{
 		int rv = -1;
@@ -239,25 +241,41 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				if (sendq.size() > 1 && sendq[0].length() < IOHOOK_WRITE_SIZE)
 				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
+					// Pack small lines into writes of up to one full TLS record.
+					// This adds a single copy of the data, but saves a record
+					// header, MAC and usually a system call per line.
+					//
+					// Lines are not held back waiting for more: everything queued
+					// during this pass of the main loop is written by the trial
+					// write at its end, so only what is already queued is packed.
 					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
+					// The front string only ever has data appended to it, so an
+					// IOHook which is retrying a blocked write still sees the
+					// same data it was given first.
 					std::string tmp;
-					tmp.reserve(sendq_len);
-					for(unsigned int i=0; i < sendq.size(); i++)
-						tmp.append(sendq[i]);
-					sendq.clear();
-					sendq.push_back(tmp);
+					tmp.reserve(IOHOOK_WRITE_SIZE);
+					while (!sendq.empty() && tmp.length() < IOHOOK_WRITE_SIZE)
+					{
+						std::string& item = sendq.front();
+						size_t room = IOHOOK_WRITE_SIZE - tmp.length();
+						if (item.length() <= room)
+						{
+							tmp.append(item);
+							sendq.pop_front();
+						}
+						else
+						{
+							tmp.append(item, 0, room);
+							item.erase(0, room);
+						}
+					}
+					sendq.push_front(tmp);
 				}
 				std::string& front = sendq.front();
 				int itemlen = front.length();
-				if (IOHook)
+				if (hooked)
 				{
 					rv = IOHook->OnStreamSocketWrite(this, front);
 					if (rv > 0)
@@ -110,6 +110,17 @@ void LogManager::OpenFileLogs()
 			strftime(realtarget, MAXBUF, target.c_str(), mytime);
 			FILE* f = fopen(realtarget, "a");
 			fw = new FileWriter(f);
+			if (f && tag->getBool("async"))
+			{
+				AsyncLogSettings settings;
+				settings.filename = realtarget;
+				settings.flushinterval = std::max(tag->getInt("flushinterval", 1000), 10L);
+				settings.flushsize = std::max(tag->getInt("flushsize", 65536), 512L);
+				settings.maxqueue = std::max<long>(tag->getInt("maxqueue", 4194304), settings.flushsize);
+				settings.rotatesize = std::max(tag->getInt("rotatesize", 0), 0L);
+				settings.rotatecount = std::max(tag->getInt("rotatecount", 5), 1L);
+				fw->StartAsync(settings);
+			}
 			logmap.insert(std::make_pair(target, fw));
 		}
 		else
@@ -122,6 +133,30 @@ void LogManager::OpenFileLogs()
 	}
 }
 
+void LogManager::GetQueueStats(unsigned long& queued, unsigned long& dropped)
+{
+	queued = dropped = 0;
+	for (FileLogMap::iterator i = FileLogs.begin(); i != FileLogs.end(); ++i)
+	{
+		unsigned long q, d;
+		if (i->first->GetQueueStats(q, d))
+		{
+			queued += q;
+			dropped += d;
+		}
+	}
+}
+
+void LogManager::ReportFileErrors()
+{
+	std::vector<std::string> reports;
+	for (FileLogMap::iterator i = FileLogs.begin(); i != FileLogs.end(); ++i)
+		i->first->TakeReports(reports);
+	/* Server notices are logged too, so this also reaches the logs which still work */
+	for (std::vector<std::string>::iterator i = reports.begin(); i != reports.end(); ++i)
+		ServerInstance->SNO->WriteToSnoMask('a', *i);
+}
+
 void LogManager::CloseLogs()
 {
 	if (ServerInstance->Config && ServerInstance->Config->cmdline.forcedebug)
@@ -333,27 +368,240 @@ void LogManager::Log(const std::string &type, int loglevel, const std::string &m
 }
 
 
+/** Writes the log lines queued by a FileWriter in the background.
+ * The main thread appends lines to a buffer under the queue lock; this
+ * thread swaps the whole buffer out and writes it with a single fwrite()
+ * whenever flushsize bytes have built up or flushinterval has passed.
+ */
+class LogWriterThread : public QueuedThread
+{
+	/** The file being written; only touched by this thread once started
+	 */
+	FILE* log;
+
+	/** Settings this writer was started with
+	 */
+	const AsyncLogSettings settings;
+
+	/** Bytes written to the current file, for rotation
+	 */
+	unsigned long filesize;
+
+	/** Lines dropped since the file could not be reopened
+	 */
+	unsigned long lost;
+
+	/** Queue a message for the main thread to report
+	 */
+	void Report(const std::string& msg)
+	{
+		this->LockQueue();
+		reports.push_back(msg);
+		this->UnlockQueue();
+	}
+
+	/** Opens the log again, after rotating it or failing to
+	 */
+	bool Reopen()
+	{
+		log = fopen(settings.filename.c_str(), "a");
+		if (!log)
+			return false;
+		long pos = ftell(log);
+		filesize = pos > 0 ? pos : 0;
+		return true;
+	}
+
+	/** Moves filename.N-1 to filename.N and so on, then reopens the log
+	 */
+	void Rotate()
+	{
+		fclose(log);
+		for (unsigned int i = settings.rotatecount; i > 1; i--)
+			rename((settings.filename + "." + ConvToStr(i - 1)).c_str(), (settings.filename + "." + ConvToStr(i)).c_str());
+		rename(settings.filename.c_str(), (settings.filename + ".1").c_str());
+		if (!Reopen())
+			Report("Cannot reopen log file " + settings.filename + " after rotating it: " + strerror(errno) + "; retrying on each write");
+	}
+
+	void Write(const std::string& data)
+	{
+		if (data.empty())
+			return;
+		if (!log)
+		{
+			/* Try again, and count what is lost while the file can't be opened */
+			if (!Reopen())
+			{
+				lost += std::count(data.begin(), data.end(), '\n');
+				return;
+			}
+			Report("Reopened log file " + settings.filename + ", " + ConvToStr(lost) + " lines were lost while it was closed");
+			this->LockQueue();
+			dropped += lost;
+			this->UnlockQueue();
+			lost = 0;
+		}
+		fwrite(data.data(), 1, data.length(), log);
+		fflush(log);
+		filesize += data.length();
+		if (settings.rotatesize && filesize >= settings.rotatesize)
+			Rotate();
+	}
+
+ public:
+	/** Lines waiting to be written, guarded by the queue lock
+	 */
+	std::string pending;
+
+	/** Number of lines in pending, guarded by the queue lock
+	 */
+	unsigned long pendinglines;
+
+	/** Number of lines dropped because pending was full, guarded by the queue lock
+	 */
+	unsigned long dropped;
+
+	/** Problems with the file for the main thread to report, guarded by the queue lock
+	 */
+	std::vector<std::string> reports;
+
+	LogWriterThread(FILE* logfile, const AsyncLogSettings& s)
+		: log(logfile), settings(s), filesize(0), lost(0), pendinglines(0), dropped(0)
+	{
+		long pos = ftell(log);
+		if (pos > 0)
+			filesize = pos;
+	}
+
+	/** Returns the file to the FileWriter once the thread has been joined
+	 */
+	FILE* GetFile()
+	{
+		return log;
+	}
+
+	/** Queue a line for writing, called on the main thread
+	 */
+	void Queue(const std::string& line)
+	{
+		this->LockQueue();
+		if (pending.length() + line.length() > settings.maxqueue)
+		{
+			dropped++;
+			this->UnlockQueue();
+			return;
+		}
+		pending.append(line);
+		pendinglines++;
+		if (pending.length() >= settings.flushsize)
+			this->UnlockQueueWakeup();
+		else
+			this->UnlockQueue();
+	}
+
+	void Run()
+	{
+		std::string batch;
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (pending.length() < settings.flushsize)
+				this->WaitForQueue(settings.flushinterval);
+			batch.swap(pending);
+			pendinglines = 0;
+			this->UnlockQueue();
+
+			Write(batch);
+			batch.clear();
+
+			this->LockQueue();
+		}
+		/* Anything queued before the exit flag was set still gets written */
+		batch.swap(pending);
+		pendinglines = 0;
+		this->UnlockQueue();
+		Write(batch);
+	}
+};
+
 FileWriter::FileWriter(FILE* logfile)
-: log(logfile), writeops(0)
+: log(logfile), writeops(0), writer(NULL)
 {
 }
 
+void FileWriter::StartAsync(const AsyncLogSettings& settings)
+{
+	if (writer || !log)
+		return;
+	writer = new LogWriterThread(log, settings);
+	try
+	{
+		ServerInstance->Threads->Start(writer);
+	}
+	catch (CoreException& e)
+	{
+		ServerInstance->Logs->Log("STARTUP", DEFAULT, "Unable to start log writer thread for %s, writing synchronously: %s",
+			settings.filename.c_str(), e.GetReason());
+		delete writer;
+		writer = NULL;
+		return;
+	}
+	/* The writer thread owns the file from here on */
+	log = NULL;
+}
+
 void FileWriter::WriteLogLine(const std::string &line)
 {
+	if (writer)
+	{
+		writer->Queue(line);
+		return;
+	}
+
 	if (log == NULL)
 		return;
 // XXX: For now, just return. Don't throw an exception. It'd be nice to find out if this is happening, but I'm terrified of breaking so close to final release. -- w00t
 //		throw CoreException("FileWriter::WriteLogLine called with a closed logfile");
 
 	fprintf(log,"%s",line.c_str());
-	if (writeops++ % 20)
+	if (!(++writeops % 20))
 	{
 		fflush(log);
 	}
 }
 
+bool FileWriter::GetQueueStats(unsigned long& queued, unsigned long& dropped)
+{
+	if (!writer)
+		return false;
+	writer->LockQueue();
+	queued = writer->pendinglines;
+	dropped = writer->dropped;
+	writer->UnlockQueue();
+	return true;
+}
+
+void FileWriter::TakeReports(std::vector<std::string>& reports)
+{
+	if (!writer)
+		return;
+	writer->LockQueue();
+	reports.insert(reports.end(), writer->reports.begin(), writer->reports.end());
+	writer->reports.clear();
+	writer->UnlockQueue();
+}
+
 FileWriter::~FileWriter()
 {
+	if (writer)
+	{
+		/* join() flushes whatever is still queued */
+		writer->join();
+		log = writer->GetFile();
+		delete writer;
+		writer = NULL;
+	}
 	if (log)
 	{
 		fflush(log);
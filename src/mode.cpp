@@ -688,6 +688,9 @@ bool ModeParser::DelMode(ModeHandler* mh)
 			for (chan_hash::iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
 			{
 				mh->RemoveMode(i->second);
+				/* Cached NAMES replies may still show the prefix */
+				if (mh->GetPrefix())
+					i->second->names.Clear();
 			}
 		break;
 	}
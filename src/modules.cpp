@@ -153,12 +153,14 @@ ModResult	Module::OnChannelPreDelete(Channel*) { return MOD_RES_PASSTHRU; }
 void		Module::OnChannelDelete(Channel*) { }
 ModResult	Module::OnSetAway(User*, const std::string &) { return MOD_RES_PASSTHRU; }
 ModResult	Module::OnWhoisLine(User*, User*, int&, std::string&) { return MOD_RES_PASSTHRU; }
-void		Module::OnBuildNeighborList(User*, UserChanList&, std::map<User*,bool>&) { }
+ModResult	Module::OnNeighborChannel(Membership*) { return MOD_RES_PASSTHRU; }
+ModResult	Module::OnNeighborMember(Membership*, User*) { return MOD_RES_PASSTHRU; }
 void		Module::OnGarbageCollect() { }
 ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { return MOD_RES_PASSTHRU; }
 void 		Module::OnText(User*, void*, int, const std::string&, char, CUList&) { }
 void		Module::OnRunTestSuite() { }
 void		Module::OnNamesListItem(User*, Membership*, std::string&, std::string&) { }
+ModResult	Module::OnNamesListStyle(User*, Channel*, unsigned int&) { return MOD_RES_PASSTHRU; }
 ModResult	Module::OnNumeric(User*, unsigned int, const std::string&) { return MOD_RES_PASSTHRU; }
 void		Module::OnHookIO(StreamSocket*, ListenSocket*) { }
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { return MOD_RES_PASSTHRU; }
@@ -374,6 +376,7 @@ void ModuleManager::DoSafeUnload(Module* mod)
 	FOREACH_MOD(I_OnUnloadModule,OnUnloadModule(mod));
 
 	DetachAll(mod);
+	ServerInstance->Profile.Forget(mod);
 
 	Modules.erase(modfind);
 	ServerInstance->GlobalCulls.AddItem(mod);
@@ -0,0 +1,49 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+/** A streaming compression format which can be started on a connected
+ * StreamSocket. It layers itself over any IOHook the socket already has,
+ * so a link can be both compressed and encrypted. Each direction of the
+ * stream is started on its own, once both ends agree where it begins.
+ */
+class CompressProvider : public DataProvider
+{
+ public:
+	/** Name of the format, as used in the provider name "compress/<format>" */
+	const std::string format;
+
+	CompressProvider(Module* mod, const std::string& Format)
+		: DataProvider(mod, "compress/" + Format), format(Format) {}
+
+	/** Compress everything written to the socket from now on. Data which is
+	 * already in its sendq is sent as it is, ahead of the compressed stream.
+	 * @param sock The socket to compress
+	 * @param label Name of the connection, as shown in /STATS T
+	 * @return False if the stream could not be started
+	 */
+	virtual bool StartCompress(StreamSocket* sock, const std::string& label) = 0;
+
+	/** Decompress everything read from the socket from now on.
+	 * @param sock The socket to decompress
+	 * @param recvq Data already read from the socket which is part of the
+	 * compressed stream. It is decompressed in place.
+	 * @param label Name of the connection, as shown in /STATS T
+	 * @return False if the stream could not be started, or recvq is not valid
+	 */
+	virtual bool StartDecompress(StreamSocket* sock, std::string& recvq, const std::string& label) = 0;
+};
+
+#endif
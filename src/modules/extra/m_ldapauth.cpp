@@ -25,6 +25,7 @@
 #include "users.h"
 #include "channels.h"
 #include "modules.h"
+#include "hash.h"
 
 #include <ldap.h>
 
@@ -36,213 +37,427 @@
 /* $ModDesc: Allow/Deny connections based upon answer from LDAP server */
 /* $LinkerFlags: -lldap */
 
-class ModuleLDAPAuth : public Module
+class ModuleLDAPAuth;
+
+enum AuthState {
+	AUTH_STATE_NONE = 0,
+	AUTH_STATE_BUSY = 1,
+	AUTH_STATE_FAIL = 2
+};
+
+/** Settings the worker thread connects and searches with */
+struct LDAPSettings
 {
-	LocalIntExt ldapAuthed;
 	std::string base;
 	std::string attribute;
-	std::string ldapserver;
-	std::string allowpattern;
-	std::string killreason;
+	std::string server;
 	std::string username;
 	std::string password;
 	int searchscope;
+	int timeout;
+	bool useusername;
+	/** Bumped on every rehash, so the worker knows to reconnect */
+	unsigned int generation;
+	LDAPSettings() : searchscope(LDAP_SCOPE_SUBTREE), timeout(5), useusername(false), generation(0) {}
+};
+
+/** A credential check, filled in by the worker thread */
+struct LDAPRequest
+{
+	std::string uid;
+	std::string nick;
+	std::string ident;
+	/** The password to check; trimmed if it was given as user:password */
+	std::string password;
+	bool result;
+	std::string reason;
+	LDAPRequest(LocalUser* user) : uid(user->uuid), nick(user->nick), ident(user->ident), password(user->password), result(false) {}
+};
+
+/** Performs the blocking LDAP binds and searches, so that a slow
+ * LDAP server only delays the users waiting on it
+ */
+class LDAPWorker : public SocketThread
+{
+	ModuleLDAPAuth* const Parent;
+	LDAP* conn;
+	unsigned int connected;
+
+	bool Connect(const LDAPSettings& conf, std::string& reason);
+	void Check(LDAPRequest* req, const LDAPSettings& conf);
+ public:
+	std::deque<LDAPRequest*> requests; // MUST HOLD MUTEX
+	std::deque<LDAPRequest*> results;  // MUST HOLD MUTEX
+	LDAPSettings settings;             // MUST HOLD MUTEX
+
+	LDAPWorker(ModuleLDAPAuth* Creator) : Parent(Creator), conn(NULL), connected(0) { }
+	~LDAPWorker();
+	virtual void Run();
+	virtual void OnNotify();
+};
+
+/** A successful check, remembered for a while. The password itself is
+ * never kept, only a salted HMAC-SHA256 of it.
+ */
+struct LDAPCacheEntry
+{
+	std::string salt;
+	std::string hash;
+	/** How much of the password was a user: prefix trimmed by the check */
+	std::string::size_type trim;
+	time_t expires;
+};
+
+class ModuleLDAPAuth : public Module
+{
+	LocalIntExt ldapAuthed;
+	LocalIntExt pendingExt;
+	LocalIntExt deadlineExt;
+	std::string allowpattern;
+	std::string killreason;
+	int timeout;
+	unsigned int cachettl;
 	bool verbose;
 	bool useusername;
-	LDAP *conn;
+	LDAPWorker* Worker;
+	std::map<std::string, LDAPCacheEntry> cache;
+	dynamic_reference<HashProvider> sha256;
 
 public:
-	ModuleLDAPAuth() : ldapAuthed("ldapauth", this)
+	ModuleLDAPAuth() : ldapAuthed("ldapauth", this), pendingExt("ldapauth-wait", this), deadlineExt("ldapauth-deadline", this), Worker(NULL), sha256(this, "hash/sha256")
 	{
-		conn = NULL;
 	}
 
 	void init()
 	{
-		Implementation eventlist[] = { I_OnCheckReady, I_OnRehash, I_OnUserRegister };
-		ServerInstance->Modules->Attach(eventlist, this, 3);
+		ServerInstance->Modules->AddService(ldapAuthed);
+		ServerInstance->Modules->AddService(pendingExt);
+		ServerInstance->Modules->AddService(deadlineExt);
+		Worker = new LDAPWorker(this);
 		OnRehash(NULL);
+		ServerInstance->Threads->Start(Worker);
+		Implementation eventlist[] = { I_OnCheckReady, I_OnRehash, I_OnUserRegister, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, 4);
 	}
 
 	~ModuleLDAPAuth()
 	{
-		if (conn)
-			ldap_unbind_ext(conn, NULL, NULL);
+		if (Worker)
+		{
+			Worker->join();
+			for (std::deque<LDAPRequest*>::iterator i = Worker->requests.begin(); i != Worker->requests.end(); ++i)
+				delete *i;
+			for (std::deque<LDAPRequest*>::iterator i = Worker->results.begin(); i != Worker->results.end(); ++i)
+				delete *i;
+			delete Worker;
+		}
 	}
 
 	void OnRehash(User* user)
 	{
 		ConfigReader Conf;
+		LDAPSettings conf;
 
-		base 			= Conf.ReadValue("ldapauth", "baserdn", 0);
-		attribute		= Conf.ReadValue("ldapauth", "attribute", 0);
-		ldapserver		= Conf.ReadValue("ldapauth", "server", 0);
+		conf.base 		= Conf.ReadValue("ldapauth", "baserdn", 0);
+		conf.attribute		= Conf.ReadValue("ldapauth", "attribute", 0);
+		conf.server		= Conf.ReadValue("ldapauth", "server", 0);
 		allowpattern		= Conf.ReadValue("ldapauth", "allowpattern", 0);
 		killreason		= Conf.ReadValue("ldapauth", "killreason", 0);
 		std::string scope	= Conf.ReadValue("ldapauth", "searchscope", 0);
-		username		= Conf.ReadValue("ldapauth", "binddn", 0);
-		password		= Conf.ReadValue("ldapauth", "bindauth", 0);
+		conf.username		= Conf.ReadValue("ldapauth", "binddn", 0);
+		conf.password		= Conf.ReadValue("ldapauth", "bindauth", 0);
 		verbose			= Conf.ReadFlag("ldapauth", "verbose", 0);		/* Set to true if failed connects should be reported to operators */
 		useusername		= Conf.ReadFlag("ldapauth", "userfield", 0);
+		conf.useusername	= useusername;
+
+		ConfigTag* tag = ServerInstance->Config->ConfValue("ldapauth");
+		timeout = tag->getInt("timeout", 5);
+		if (timeout < 1)
+			timeout = 1;
+		conf.timeout = timeout;
+		cachettl = tag->getInt("cachettl", 0);
+		cache.clear();
 
 		if (scope == "base")
-			searchscope = LDAP_SCOPE_BASE;
+			conf.searchscope = LDAP_SCOPE_BASE;
 		else if (scope == "onelevel")
-			searchscope = LDAP_SCOPE_ONELEVEL;
-		else searchscope = LDAP_SCOPE_SUBTREE;
+			conf.searchscope = LDAP_SCOPE_ONELEVEL;
+		else conf.searchscope = LDAP_SCOPE_SUBTREE;
 
-		Connect();
+		Worker->LockQueue();
+		conf.generation = Worker->settings.generation + 1;
+		Worker->settings = conf;
+		Worker->UnlockQueue();
 	}
 
-	bool Connect()
+	ModResult OnUserRegister(LocalUser* user)
 	{
-		if (conn != NULL)
-			ldap_unbind_ext(conn, NULL, NULL);
-		int res, v = LDAP_VERSION3;
-		res = ldap_initialize(&conn, ldapserver.c_str());
-		if (res != LDAP_SUCCESS)
+		if ((!allowpattern.empty()) && (InspIRCd::Match(user->nick,allowpattern)))
 		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "LDAP connection failed: %s", ldap_err2string(res));
-			conn = NULL;
-			return false;
+			ldapAuthed.set(user,1);
+			return MOD_RES_PASSTHRU;
 		}
 
-		res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
-		if (res != LDAP_SUCCESS)
+		if (user->password.empty())
 		{
 			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "LDAP set protocol to v3 failed: %s", ldap_err2string(res));
-			ldap_unbind_ext(conn, NULL, NULL);
-			conn = NULL;
-			return false;
+				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (No password provided)", user->nick.c_str(), user->ident.c_str(), user->host.c_str());
+			ServerInstance->Users->QuitUser(user, killreason);
+			return MOD_RES_DENY;
 		}
-		return true;
-	}
 
-	ModResult OnUserRegister(LocalUser* user)
-	{
-		if ((!allowpattern.empty()) && (InspIRCd::Match(user->nick,allowpattern)))
+		std::map<std::string, LDAPCacheEntry>::iterator i = cache.find(CacheKey(user->nick, user->ident));
+		if (i != cache.end() && i->second.expires > ServerInstance->Time() && sha256 && sha256->hmac(i->second.salt, user->password) == i->second.hash)
 		{
+			user->password.erase(0, i->second.trim);
 			ldapAuthed.set(user,1);
 			return MOD_RES_PASSTHRU;
 		}
 
-		if (!CheckCredentials(user))
-		{
-			ServerInstance->Users->QuitUser(user, killreason);
-			return MOD_RES_DENY;
-		}
+		/* Registration is held by OnCheckReady until the worker answers */
+		pendingExt.set(user, AUTH_STATE_BUSY);
+		deadlineExt.set(user, ServerInstance->Time() + timeout);
+		Worker->LockQueue();
+		Worker->requests.push_back(new LDAPRequest(user));
+		Worker->UnlockQueueWakeup();
 		return MOD_RES_PASSTHRU;
 	}
 
-	bool CheckCredentials(LocalUser* user)
+	std::string CacheKey(const std::string& nick, const std::string& ident)
 	{
-		if (conn == NULL)
-			if (!Connect())
-				return false;
+		return useusername ? ident : nick;
+	}
 
-		if (user->password.empty())
+	/** Called on the main thread with the answer to a request */
+	void OnResult(LDAPRequest* req)
+	{
+		User* u = ServerInstance->FindUUID(req->uid);
+		LocalUser* user = u ? IS_LOCAL(u) : NULL;
+		if (!user || pendingExt.get(user) != AUTH_STATE_BUSY)
+			return;
+
+		if (req->result)
+		{
+			if (cachettl && sha256)
+			{
+				LDAPCacheEntry& entry = cache[CacheKey(req->nick, req->ident)];
+				char salt[16];
+				ServerInstance->GenRandom(salt, sizeof(salt));
+				entry.salt.assign(salt, sizeof(salt));
+				entry.hash = sha256->hmac(entry.salt, user->password);
+				entry.trim = user->password.length() - req->password.length();
+				entry.expires = ServerInstance->Time() + cachettl;
+			}
+			user->password = req->password;
+			ldapAuthed.set(user,1);
+			pendingExt.set(user, AUTH_STATE_NONE);
+		}
+		else
 		{
 			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (No password provided)", user->nick.c_str(), user->ident.c_str(), user->host.c_str());
-			return false;
+				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (%s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), req->reason.c_str());
+			pendingExt.set(user, AUTH_STATE_FAIL);
 		}
+	}
 
-		int res;
-		// bind anonymously if no bind DN and authentication are given in the config
-		struct berval cred;
-		cred.bv_val = const_cast<char*>(password.c_str());
-		cred.bv_len = password.length();
+	void OnBackgroundTimer(time_t curtime)
+	{
+		for (std::map<std::string, LDAPCacheEntry>::iterator i = cache.begin(); i != cache.end(); )
+		{
+			if (i->second.expires <= curtime)
+				cache.erase(i++);
+			else
+				++i;
+		}
+	}
 
-		if ((res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+	ModResult OnCheckReady(LocalUser* user)
+	{
+		switch (pendingExt.get(user))
 		{
-			if (res == LDAP_SERVER_DOWN)
-			{
-				// Attempt to reconnect if the connection dropped
+			case AUTH_STATE_BUSY:
+				if (ServerInstance->Time() < deadlineExt.get(user))
+					return MOD_RES_DENY;
 				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('a', "LDAP server has gone away - reconnecting...");
-				Connect();
-				res = ldap_sasl_bind_s(conn, username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-			}
+					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (LDAP server did not answer in time)", user->nick.c_str(), user->ident.c_str(), user->host.c_str());
+				/* Fall through */
+			case AUTH_STATE_FAIL:
+				ServerInstance->Users->QuitUser(user, killreason);
+				return MOD_RES_DENY;
+		}
+		return ldapAuthed.get(user) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
+	}
 
-			if (res != LDAP_SUCCESS)
-			{
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (LDAP bind failed: %s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), ldap_err2string(res));
-				ldap_unbind_ext(conn, NULL, NULL);
-				conn = NULL;
-				return false;
-			}
+	Version GetVersion()
+	{
+		return Version("Allow/Deny connections based upon answer from LDAP server", VF_VENDOR);
+	}
+
+};
+
+LDAPWorker::~LDAPWorker()
+{
+	if (conn)
+		ldap_unbind_ext(conn, NULL, NULL);
+}
+
+bool LDAPWorker::Connect(const LDAPSettings& conf, std::string& reason)
+{
+	if (conn != NULL)
+		ldap_unbind_ext(conn, NULL, NULL);
+	int res, v = LDAP_VERSION3;
+	res = ldap_initialize(&conn, conf.server.c_str());
+	if (res != LDAP_SUCCESS)
+	{
+		reason = "LDAP connection failed: " + std::string(ldap_err2string(res));
+		conn = NULL;
+		return false;
+	}
+
+	res = ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, (void *)&v);
+	if (res != LDAP_SUCCESS)
+	{
+		reason = "LDAP set protocol to v3 failed: " + std::string(ldap_err2string(res));
+		ldap_unbind_ext(conn, NULL, NULL);
+		conn = NULL;
+		return false;
+	}
+
+	/* Never wait on the server for longer than a user would */
+	struct timeval tv;
+	tv.tv_sec = conf.timeout;
+	tv.tv_usec = 0;
+	ldap_set_option(conn, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+	ldap_set_option(conn, LDAP_OPT_TIMEOUT, &tv);
+	connected = conf.generation;
+	return true;
+}
+
+void LDAPWorker::Check(LDAPRequest* req, const LDAPSettings& conf)
+{
+	if (conn == NULL || connected != conf.generation)
+		if (!Connect(conf, req->reason))
+			return;
+
+	int res;
+	// bind anonymously if no bind DN and authentication are given in the config
+	struct berval cred;
+	cred.bv_val = const_cast<char*>(conf.password.c_str());
+	cred.bv_len = conf.password.length();
+
+	if ((res = ldap_sasl_bind_s(conn, conf.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) != LDAP_SUCCESS)
+	{
+		if (res == LDAP_SERVER_DOWN)
+		{
+			// Attempt to reconnect if the connection dropped
+			if (!Connect(conf, req->reason))
+				return;
+			res = ldap_sasl_bind_s(conn, conf.username.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
 		}
 
-		LDAPMessage *msg, *entry;
-		std::string what = (attribute + "=" + (useusername ? user->ident : user->nick));
-		if ((res = ldap_search_ext_s(conn, base.c_str(), searchscope, what.c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg)) != LDAP_SUCCESS)
+		if (res != LDAP_SUCCESS)
 		{
-			// Do a second search, based on password, if it contains a :
-			// That is, PASS <user>:<password> will work.
-			size_t pos = user->password.find(":");
-			if (pos != std::string::npos)
-			{
-				res = ldap_search_ext_s(conn, base.c_str(), searchscope, user->password.substr(0, pos).c_str(), NULL, 0, NULL, NULL, NULL, 0, &msg);
+			req->reason = "LDAP bind failed: " + std::string(ldap_err2string(res));
+			ldap_unbind_ext(conn, NULL, NULL);
+			conn = NULL;
+			return;
+		}
+	}
 
-				if (res)
-				{
-					// Trim the user: prefix, leaving just 'pass' for later password check
-					user->password = user->password.substr(pos + 1);
-				}
-			}
+	struct timeval tv;
+	tv.tv_sec = conf.timeout;
+	tv.tv_usec = 0;
 
-			// It may have found based on user:pass check above.
-			if (!res)
+	LDAPMessage *msg, *entry;
+	std::string what = (conf.attribute + "=" + (conf.useusername ? req->ident : req->nick));
+	if ((res = ldap_search_ext_s(conn, conf.base.c_str(), conf.searchscope, what.c_str(), NULL, 0, NULL, NULL, &tv, 0, &msg)) != LDAP_SUCCESS)
+	{
+		// Do a second search, based on password, if it contains a :
+		// That is, PASS <user>:<password> will work.
+		size_t pos = req->password.find(":");
+		if (pos != std::string::npos)
+		{
+			res = ldap_search_ext_s(conn, conf.base.c_str(), conf.searchscope, req->password.substr(0, pos).c_str(), NULL, 0, NULL, NULL, &tv, 0, &msg);
+
+			if (res == LDAP_SUCCESS)
 			{
-				if (verbose)
-					ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (LDAP search failed: %s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), ldap_err2string(res));
-				return false;
+				// Trim the user: prefix, leaving just 'pass' for later password check
+				req->password = req->password.substr(pos + 1);
 			}
 		}
-		if (ldap_count_entries(conn, msg) > 1)
+
+		// It may have found based on user:pass check above.
+		if (res != LDAP_SUCCESS)
 		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (LDAP search returned more than one result: %s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), ldap_err2string(res));
-			ldap_msgfree(msg);
-			return false;
+			req->reason = "LDAP search failed: " + std::string(ldap_err2string(res));
+			return;
 		}
-		if ((entry = ldap_first_entry(conn, msg)) == NULL)
-		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (LDAP search returned no results: %s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), ldap_err2string(res));
-			ldap_msgfree(msg);
-			return false;
-		}
-		cred.bv_val = (char*)user->password.data();
-		cred.bv_len = user->password.length();
-		if ((res = ldap_sasl_bind_s(conn, ldap_get_dn(conn, entry), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL)) == LDAP_SUCCESS)
+	}
+	if (ldap_count_entries(conn, msg) > 1)
+	{
+		req->reason = "LDAP search returned more than one result: " + std::string(ldap_err2string(res));
+		ldap_msgfree(msg);
+		return;
+	}
+	if ((entry = ldap_first_entry(conn, msg)) == NULL)
+	{
+		req->reason = "LDAP search returned no results: " + std::string(ldap_err2string(res));
+		ldap_msgfree(msg);
+		return;
+	}
+	cred.bv_val = (char*)req->password.data();
+	cred.bv_len = req->password.length();
+	char* dn = ldap_get_dn(conn, entry);
+	res = ldap_sasl_bind_s(conn, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+	ldap_memfree(dn);
+	ldap_msgfree(msg);
+	if (res == LDAP_SUCCESS)
+		req->result = true;
+	else
+		req->reason = ldap_err2string(res);
+}
+
+void LDAPWorker::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (!requests.empty())
 		{
-			ldap_msgfree(msg);
-			ldapAuthed.set(user,1);
-			return true;
+			LDAPRequest* req = requests.front();
+			requests.pop_front();
+			LDAPSettings conf = settings;
+			this->UnlockQueue();
+
+			Check(req, conf);
+
+			this->LockQueue();
+			results.push_back(req);
+			NotifyParent();
 		}
 		else
 		{
-			if (verbose)
-				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s!%s@%s (%s)", user->nick.c_str(), user->ident.c_str(), user->host.c_str(), ldap_err2string(res));
-			ldap_msgfree(msg);
-			return false;
+			/* We know the queue is empty, we can safely hang this thread until
+			 * something happens
+			 */
+			this->WaitForQueue();
 		}
 	}
+	this->UnlockQueue();
+}
 
-	ModResult OnCheckReady(LocalUser* user)
-	{
-		return ldapAuthed.get(user) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
-	}
+void LDAPWorker::OnNotify()
+{
+	std::deque<LDAPRequest*> batch;
+	this->LockQueue();
+	batch.swap(results);
+	this->UnlockQueue();
 
-	Version GetVersion()
+	for (std::deque<LDAPRequest*>::iterator i = batch.begin(); i != batch.end(); ++i)
 	{
-		return Version("Allow/Deny connections based upon answer from LDAP server", VF_VENDOR);
+		Parent->OnResult(*i);
+		delete *i;
 	}
-
-};
+}
 
 MODULE_INIT(ModuleLDAPAuth)
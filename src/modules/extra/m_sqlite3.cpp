@@ -69,40 +69,129 @@ class SQLite3Result : public SQLResult
 	}
 };
 
+/** A query waiting for, or being run on, an sqlite3 worker */
+class SQLite3Job : public SQLJob
+{
+ public:
+	/** The query text, with a '?' for each bound parameter */
+	std::string text;
+	ParamL binds;
+	SQLite3Result res;
+	SQLerror err;
+
+	SQLite3Job(SQLQuery* Query, SQLConn* Conn);
+
+	void Run();
+
+	void Deliver()
+	{
+		if (err.id == SQL_NO_ERROR)
+			query->OnResult(res);
+		else
+			query->OnError(err);
+	}
+};
+
 class SQLConn : public SQLProvider
 {
  private:
 	sqlite3* conn;
 	reference<ConfigTag> config;
+	SQLExecutor* const executor;
+
+	/** Prepared statements by query text, oldest first in stmtorder (worker thread only) */
+	std::map<std::string, sqlite3_stmt*> stmts;
+	std::deque<std::string> stmtorder;
+	unsigned int maxstmts;
+
+	/** Fill in a parameter. One quoted on its own, as '?' or '$name', is bound
+	 * so that the prepared statement can be reused; any other is escaped inline.
+	 */
+	static void AddParam(SQLite3Job* job, const std::string& value, bool quoted)
+	{
+		if (quoted)
+		{
+			job->text[job->text.length() - 1] = '?';
+			job->binds.push_back(value);
+			return;
+		}
+		char* escaped = sqlite3_mprintf("%q", value.c_str());
+		job->text.append(escaped);
+		sqlite3_free(escaped);
+	}
+
+	/** Check if the parameter ending at q[end] is quoted on its own */
+	static bool IsQuoted(SQLite3Job* job, const std::string& q, std::string::size_type end)
+	{
+		const std::string& text = job->text;
+		return !text.empty() && text[text.length() - 1] == '\'' && end + 1 < q.length() && q[end + 1] == '\'';
+	}
 
  public:
-	SQLConn(Module* Parent, ConfigTag* tag) : SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag)
+	SQLConn(Module* Parent, ConfigTag* tag, SQLExecutor* Executor)
+		: SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag), executor(Executor)
 	{
+		maxstmts = tag->getInt("preparedcache", 32);
 		std::string host = tag->getString("hostname");
 		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
 		{
 			ServerInstance->Logs->Log("m_sqlite3",DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
 			conn = NULL;
 		}
+		executor->Attach(this);
 	}
 
 	~SQLConn()
 	{
-		sqlite3_interrupt(conn);
+		/* Once detached no worker can be using the connection */
+		executor->Detach(this);
+		for (std::map<std::string, sqlite3_stmt*>::iterator i = stmts.begin(); i != stmts.end(); ++i)
+			sqlite3_finalize(i->second);
 		sqlite3_close(conn);
 	}
 
-	void Query(SQLQuery* query, const std::string& q)
+	/** Find or prepare the statement for a query. Called on the worker thread. */
+	sqlite3_stmt* Prepare(const std::string& q)
+	{
+		std::map<std::string, sqlite3_stmt*>::iterator i = stmts.find(q);
+		if (i != stmts.end())
+			return i->second;
+
+		sqlite3_stmt* stmt;
+		if (sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL) != SQLITE_OK)
+			return NULL;
+		if (!maxstmts)
+			return stmt;
+
+		if (stmts.size() >= maxstmts)
+		{
+			sqlite3_finalize(stmts[stmtorder.front()]);
+			stmts.erase(stmtorder.front());
+			stmtorder.pop_front();
+		}
+		stmts[q] = stmt;
+		stmtorder.push_back(q);
+		return stmt;
+	}
+
+	/** Run a query. Called on the worker thread. */
+	void Query(SQLite3Job* job)
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
+		SQLite3Result& res = job->res;
+		if (!conn)
 		{
-			SQLerror error(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
+			job->err = SQLerror(SQL_BAD_CONN);
 			return;
 		}
+		sqlite3_stmt* stmt = Prepare(job->text);
+		if (!stmt)
+		{
+			job->err = SQLerror(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
+			return;
+		}
+		for (unsigned int i = 0; i < job->binds.size(); i++)
+			sqlite3_bind_text(stmt, i + 1, job->binds[i].data(), job->binds[i].length(), SQLITE_TRANSIENT);
+
 		int cols = sqlite3_column_count(stmt);
 		res.columns.resize(cols);
 		for(int i=0; i < cols; i++)
@@ -111,7 +200,7 @@ class SQLConn : public SQLProvider
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
@@ -127,53 +216,61 @@ class SQLConn : public SQLProvider
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQLerror error(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				job->err = SQLerror(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
 				break;
 			}
 		}
-		sqlite3_finalize(stmt);
+
+		/* Cached statements are kept for next time, others are finished with */
+		if (maxstmts)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+		}
+		else
+			sqlite3_finalize(stmt);
 	}
 
 	virtual void submit(SQLQuery* query, const std::string& q)
 	{
-		Query(query, q);
-		delete query;
+		SQLite3Job* job = new SQLite3Job(query, this);
+		job->text = q;
+		executor->Submit(job);
 	}
 
 	virtual void submit(SQLQuery* query, const std::string& q, const ParamL& p)
 	{
-		std::string res;
+		SQLite3Job* job = new SQLite3Job(query, this);
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
 			if (q[i] != '?')
-				res.push_back(q[i]);
+				job->text.push_back(q[i]);
 			else
 			{
 				if (param < p.size())
 				{
-					char* escaped = sqlite3_mprintf("%q", p[param++].c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
+					bool quoted = IsQuoted(job, q, i);
+					AddParam(job, p[param++], quoted);
+					if (quoted)
+						i++;
 				}
 			}
 		}
-		submit(query, res);
+		executor->Submit(job);
 	}
 
 	virtual void submit(SQLQuery* query, const std::string& q, const ParamM& p)
 	{
-		std::string res;
+		SQLite3Job* job = new SQLite3Job(query, this);
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
 			if (q[i] != '$')
-				res.push_back(q[i]);
+				job->text.push_back(q[i]);
 			else
 			{
 				std::string field;
@@ -185,37 +282,50 @@ class SQLConn : public SQLProvider
 				ParamM::const_iterator it = p.find(field);
 				if (it != p.end())
 				{
-					char* escaped = sqlite3_mprintf("%q", it->second.c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
+					bool quoted = IsQuoted(job, q, i);
+					AddParam(job, it->second, quoted);
+					if (quoted)
+						i++;
 				}
 			}
 		}
-		submit(query, res);
+		executor->Submit(job);
 	}
 };
 
+SQLite3Job::SQLite3Job(SQLQuery* Query, SQLConn* Conn) : SQLJob(Query, Conn), err(SQL_NO_ERROR)
+{
+}
+
+void SQLite3Job::Run()
+{
+	static_cast<SQLConn*>(conn)->Query(this);
+}
+
 class ModuleSQLite3 : public Module
 {
  private:
 	ConnMap conns;
+	SQLExecutor* executor;
 
  public:
-	ModuleSQLite3()
+	ModuleSQLite3() : executor(NULL)
 	{
 	}
 
 	void init()
 	{
+		executor = new SQLExecutor(ServerInstance->Config->ConfValue("sqlite")->getInt("threads", 2));
 		ReadConf();
 
-		Implementation eventlist[] = { I_OnRehash };
-		ServerInstance->Modules->Attach(eventlist, this, 1);
+		Implementation eventlist[] = { I_OnRehash, I_OnUnloadModule };
+		ServerInstance->Modules->Attach(eventlist, this, 2);
 	}
 
 	virtual ~ModuleSQLite3()
 	{
 		ClearConns();
+		delete executor;
 	}
 
 	void ClearConns()
@@ -237,7 +347,7 @@ class ModuleSQLite3 : public Module
 		{
 			if (i->second->getString("module", "sqlite") != "sqlite")
 				continue;
-			SQLConn* conn = new SQLConn(this, i->second);
+			SQLConn* conn = new SQLConn(this, i->second, executor);
 			conns.insert(std::make_pair(i->second->getString("id"), conn));
 			ServerInstance->Modules->AddService(*conn);
 		}
@@ -248,6 +358,11 @@ class ModuleSQLite3 : public Module
 		ReadConf();
 	}
 
+	void OnUnloadModule(Module* mod)
+	{
+		executor->Cancel(mod);
+	}
+
 	Version GetVersion()
 	{
 		return Version("sqlite3 provider", VF_VENDOR);
@@ -66,6 +66,141 @@ static ssize_t gnutls_push_wrapper(gnutls_transport_ptr_t user_wrap, const void*
 	return rv;
 }
 
+/** A bounded store of server sessions, so returning clients can resume them.
+ * Every session lives for the same time, so they expire in the order they
+ * were stored, and the oldest is dropped when the store is full.
+ */
+class SessionCache
+{
+	struct Entry
+	{
+		std::string data;
+		time_t expires;
+	};
+	std::map<std::string, Entry> entries;
+	/** Keys in the order they were stored, with the expiry they were stored with */
+	std::deque<std::pair<std::string, time_t> > order;
+
+ public:
+	size_t maxsize;
+	time_t lifetime;
+
+	SessionCache() : maxsize(20000), lifetime(3600) {}
+
+	void Store(const std::string& key, const std::string& data)
+	{
+		Entry& entry = entries[key];
+		entry.data = data;
+		entry.expires = ServerInstance->Time() + lifetime;
+		order.push_back(std::make_pair(key, entry.expires));
+		Trim();
+	}
+
+	bool Retrieve(const std::string& key, std::string& data)
+	{
+		std::map<std::string, Entry>::iterator i = entries.find(key);
+		if (i == entries.end() || i->second.expires <= ServerInstance->Time())
+			return false;
+		data = i->second.data;
+		return true;
+	}
+
+	void Remove(const std::string& key)
+	{
+		entries.erase(key);
+	}
+
+	/** Drop expired sessions, and the oldest ones while there are too many */
+	void Trim()
+	{
+		while (!order.empty())
+		{
+			std::pair<std::string, time_t>& oldest = order.front();
+			std::map<std::string, Entry>::iterator i = entries.find(oldest.first);
+			// Skip keys which were removed or stored again since
+			bool current = (i != entries.end() && i->second.expires == oldest.second);
+			if (current && entries.size() <= maxsize && oldest.second > ServerInstance->Time())
+				break;
+			if (current)
+				entries.erase(i);
+			order.pop_front();
+		}
+	}
+
+	size_t size() const { return entries.size(); }
+};
+
+static SessionCache sessioncache;
+
+static int db_store(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+{
+	if (!sessioncache.maxsize)
+		return -1;
+	sessioncache.Store(std::string(reinterpret_cast<char*>(key.data), key.size), std::string(reinterpret_cast<char*>(data.data), data.size));
+	return 0;
+}
+
+static gnutls_datum_t db_retrieve(void* ptr, gnutls_datum_t key)
+{
+	gnutls_datum_t result = { NULL, 0 };
+	std::string data;
+	if (sessioncache.Retrieve(std::string(reinterpret_cast<char*>(key.data), key.size), data))
+	{
+		// GnuTLS frees this itself
+		result.data = static_cast<unsigned char*>(gnutls_malloc(data.length()));
+		if (result.data)
+		{
+			memcpy(result.data, data.data(), data.length());
+			result.size = data.length();
+		}
+	}
+	return result;
+}
+
+static int db_remove(void* ptr, gnutls_datum_t key)
+{
+	sessioncache.Remove(std::string(reinterpret_cast<char*>(key.data), key.size));
+	return 0;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030100 && GNUTLS_VERSION_NUMBER < 0x030604
+/** Find the name of the key a ClientHello's session ticket was issued under,
+ * which is the first 16 bytes of the ticket
+ */
+static const unsigned char* GetTicketKeyName(const gnutls_datum_t* msg)
+{
+	const unsigned char* d = msg->data;
+	size_t size = msg->size;
+	// Skip the version and random, then the session ID, cipher suites and compression methods
+	size_t pos = 34;
+	if (pos + 1 > size)
+		return NULL;
+	pos += 1 + d[pos];
+	if (pos + 2 > size)
+		return NULL;
+	pos += 2 + (d[pos] << 8 | d[pos + 1]);
+	if (pos + 1 > size)
+		return NULL;
+	pos += 1 + d[pos];
+	if (pos + 2 > size)
+		return NULL;
+	pos += 2;
+
+	while (pos + 4 <= size)
+	{
+		unsigned int type = d[pos] << 8 | d[pos + 1];
+		size_t len = d[pos + 2] << 8 | d[pos + 3];
+		pos += 4;
+		if (pos + len > size)
+			return NULL;
+		if (type == 35)
+			return len >= 16 ? d + pos : NULL;
+		pos += len;
+	}
+	return NULL;
+}
+#endif
+
 class RandGen : public HandlerBase2<void, char*, size_t>
 {
  public:
@@ -84,6 +219,8 @@ public:
 	gnutls_session_t sess;
 	issl_status status;
 	reference<ssl_cert> cert;
+	/** Address of the server an outbound session connects to, or empty if inbound */
+	std::string peer;
 	issl_session() : sess(NULL) {}
 };
 
@@ -147,6 +284,27 @@ class ModuleSSLGnuTLS : public Module
 
 	bool cred_alloc;
 
+	bool use_tickets;
+	gnutls_datum_t ticketkey;
+	/** The key before the last rotation, whose tickets are still accepted */
+	gnutls_datum_t prevticketkey;
+	time_t nextkeyrotation;
+
+	/** A session a server we link to gave us, and when */
+	struct ClientSession
+	{
+		std::string data;
+		time_t saved;
+	};
+	/** The last session each server we link to gave us, by address */
+	std::map<std::string, ClientSession> clientsessions;
+
+	/** Handshakes completed, and how many of them resumed a session */
+	unsigned long inbound_handshakes;
+	unsigned long inbound_resumed;
+	unsigned long outbound_handshakes;
+	unsigned long outbound_resumed;
+
 	RandGen randhandler;
 	CommandStartTLS starttls;
 
@@ -155,7 +313,9 @@ class ModuleSSLGnuTLS : public Module
  public:
 
 	ModuleSSLGnuTLS()
-		: starttls(this), capHandler(this, "tls"), iohook(this, "ssl/gnutls", SERVICE_IOHOOK)
+		: use_tickets(false), nextkeyrotation(0)
+		, inbound_handshakes(0), inbound_resumed(0), outbound_handshakes(0), outbound_resumed(0)
+		, starttls(this), capHandler(this, "tls"), iohook(this, "ssl/gnutls", SERVICE_IOHOOK)
 	{
 		sessions = new issl_session[ServerInstance->SE->GetMaxFds()];
 
@@ -163,6 +323,10 @@ class ModuleSSLGnuTLS : public Module
 		gnutls_x509_privkey_init(&x509_key);
 
 		cred_alloc = false;
+		ticketkey.data = NULL;
+		ticketkey.size = 0;
+		prevticketkey.data = NULL;
+		prevticketkey.size = 0;
 	}
 
 	void init()
@@ -175,7 +339,7 @@ class ModuleSSLGnuTLS : public Module
 		// Void return, guess we assume success
 		gnutls_certificate_set_dh_params(x509_cred, dh_params);
 		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnUserConnect,
-			I_OnEvent, I_OnHookIO };
+			I_OnEvent, I_OnHookIO, I_OnStats, I_OnBackgroundTimer };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 
 		ServerInstance->Modules->AddService(iohook);
@@ -232,6 +396,19 @@ class ModuleSSLGnuTLS : public Module
 		if((dh_bits != 768) && (dh_bits != 1024) && (dh_bits != 2048) && (dh_bits != 3072) && (dh_bits != 4096))
 			dh_bits = 1024;
 
+		int cachesize = Conf->getInt("sessioncache", 20000);
+		sessioncache.maxsize = cachesize > 0 ? cachesize : 0;
+		sessioncache.lifetime = Conf->getInt("sessiontimeout", 3600);
+		if (sessioncache.lifetime < 1)
+			sessioncache.lifetime = 3600;
+		sessioncache.Trim();
+
+		use_tickets = Conf->getBool("tickets", true);
+		if (use_tickets && !ticketkey.data)
+			gnutls_session_ticket_key_generate(&ticketkey);
+		if (!nextkeyrotation || nextkeyrotation > ServerInstance->Time() + sessioncache.lifetime)
+			nextkeyrotation = ServerInstance->Time() + sessioncache.lifetime;
+
 		if (hashname == "md5")
 			hash = GNUTLS_DIG_MD5;
 		else if (hashname == "sha1")
@@ -321,11 +498,80 @@ class ModuleSSLGnuTLS : public Module
 			gnutls_dh_params_deinit(dh_params);
 			gnutls_certificate_free_credentials(x509_cred);
 		}
+		if (ticketkey.data)
+			gnutls_free(ticketkey.data);
+		if (prevticketkey.data)
+			gnutls_free(prevticketkey.data);
 		gnutls_global_deinit();
 		delete[] sessions;
 		ServerInstance->GenRandom = &ServerInstance->HandleGenRandom;
 	}
 
+	void OnBackgroundTimer(time_t curtime)
+	{
+		sessioncache.Trim();
+
+#if GNUTLS_VERSION_NUMBER < 0x030604
+		/* Newer GnuTLS derives short-lived keys from this one by itself. Here
+		 * the old key is kept for a lifetime, so that from GnuTLS 3.1, which
+		 * lets OnClientHello pick it, tickets issued just before a rotation
+		 * are still accepted after it.
+		 */
+		if (ticketkey.data && curtime >= nextkeyrotation)
+		{
+			if (prevticketkey.data)
+				gnutls_free(prevticketkey.data);
+			prevticketkey = ticketkey;
+			ticketkey.data = NULL;
+			gnutls_session_ticket_key_generate(&ticketkey);
+			nextkeyrotation = curtime + sessioncache.lifetime;
+		}
+#endif
+
+		for (std::map<std::string, ClientSession>::iterator i = clientsessions.begin(); i != clientsessions.end(); )
+		{
+			if (i->second.saved + sessioncache.lifetime < curtime)
+				clientsessions.erase(i++);
+			else
+				++i;
+		}
+	}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030100 && GNUTLS_VERSION_NUMBER < 0x030604
+	/** GnuTLS only takes one ticket key per session, so before it reads a
+	 * ClientHello offering a ticket from the previous key, give it that key.
+	 * The ticket issued in turn is under that key too, and lasts until the
+	 * next rotation.
+	 */
+	static int OnClientHello(gnutls_session_t sess, unsigned int htype, unsigned int when, unsigned int incoming, const gnutls_datum_t* msg)
+	{
+		ModuleSSLGnuTLS* mod = static_cast<ModuleSSLGnuTLS*>(gnutls_session_get_ptr(sess));
+		if (!mod || !mod->prevticketkey.data)
+			return 0;
+		const unsigned char* name = GetTicketKeyName(msg);
+		if (name && !memcmp(name, mod->prevticketkey.data, 16))
+			gnutls_session_ticket_enable_server(sess, &mod->prevticketkey);
+		return 0;
+	}
+#endif
+
+	static std::string ResumeRate(unsigned long handshakes, unsigned long resumed)
+	{
+		return ConvToStr(handshakes) + " resumed " + ConvToStr(resumed) + " (" + ConvToStr(handshakes ? resumed * 100 / handshakes : 0) + "%)";
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list &results)
+	{
+		if (symbol != 'T')
+			return MOD_RES_PASSTHRU;
+
+		std::string prefix = ServerInstance->Config->ServerName + " 249 " + user->nick + " :gnutls ";
+		results.push_back(prefix + "inbound handshakes " + ResumeRate(inbound_handshakes, inbound_resumed));
+		results.push_back(prefix + "outbound handshakes " + ResumeRate(outbound_handshakes, outbound_resumed));
+		results.push_back(prefix + "cached sessions " + ConvToStr(sessioncache.size()) + " servers " + ConvToStr(clientsessions.size()));
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnCleanup(int target_type, void* item)
 	{
 		if(target_type == TYPE_USER)
@@ -397,6 +643,20 @@ class ModuleSSLGnuTLS : public Module
 
 		gnutls_certificate_server_set_request(session->sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
 
+		session->peer.clear();
+		gnutls_db_set_retrieve_function(session->sess, db_retrieve);
+		gnutls_db_set_store_function(session->sess, db_store);
+		gnutls_db_set_remove_function(session->sess, db_remove);
+		gnutls_db_set_cache_expiration(session->sess, sessioncache.lifetime);
+		if (use_tickets && ticketkey.data)
+		{
+			gnutls_session_ticket_enable_server(session->sess, &ticketkey);
+#if GNUTLS_VERSION_NUMBER >= 0x030100 && GNUTLS_VERSION_NUMBER < 0x030604
+			gnutls_session_set_ptr(session->sess, this);
+			gnutls_handshake_set_hook_function(session->sess, GNUTLS_HANDSHAKE_CLIENT_HELLO, GNUTLS_HOOK_PRE, OnClientHello);
+#endif
+		}
+
 		Handshake(session, user);
 	}
 
@@ -413,6 +673,20 @@ class ModuleSSLGnuTLS : public Module
 		gnutls_transport_set_push_function(session->sess, gnutls_push_wrapper);
 		gnutls_transport_set_pull_function(session->sess, gnutls_pull_wrapper);
 
+		/* Offer the session we had with this server last time, so a relink after a split is cheap */
+		session->peer.clear();
+		irc::sockets::sockaddrs addr;
+		socklen_t addrlen = sizeof(addr);
+		if (getpeername(user->GetFd(), &addr.sa, &addrlen) == 0)
+		{
+			session->peer = addr.str();
+			if (use_tickets)
+				gnutls_session_ticket_enable_client(session->sess);
+			std::map<std::string, ClientSession>::iterator saved = clientsessions.find(session->peer);
+			if (saved != clientsessions.end())
+				gnutls_session_set_data(session->sess, saved->second.data.data(), saved->second.data.length());
+		}
+
 		Handshake(session, user);
 	}
 
@@ -557,6 +831,9 @@ class ModuleSSLGnuTLS : public Module
 			}
 			else
 			{
+				// Don't offer a session the server may have turned us away over again
+				if (!session->peer.empty())
+					clientsessions.erase(session->peer);
 				user->SetError(std::string("Handshake Failed - ") + gnutls_strerror(ret));
 				CloseSession(session);
 				session->status = ISSL_CLOSING;
@@ -569,6 +846,25 @@ class ModuleSSLGnuTLS : public Module
 			// Change the seesion state
 			session->status = ISSL_HANDSHAKEN;
 
+			bool resumed = gnutls_session_is_resumed(session->sess);
+			if (!session->peer.empty())
+			{
+				outbound_handshakes++;
+				if (resumed)
+					outbound_resumed++;
+				else
+				{
+					// The server turned down the session we offered; it is replaced when this link closes
+					clientsessions.erase(session->peer);
+				}
+			}
+			else
+			{
+				inbound_handshakes++;
+				if (resumed)
+					inbound_resumed++;
+			}
+
 			VerifyCertificate(session,user);
 
 			// Finish writing, if any left
@@ -601,11 +897,25 @@ class ModuleSSLGnuTLS : public Module
 	{
 		if (session->sess)
 		{
+			// Save the session for the next link to this server. This is done
+			// at the end, as TLS 1.3 only sends tickets after the handshake.
+			if (session->status == ISSL_HANDSHAKEN && !session->peer.empty())
+			{
+				gnutls_datum_t data;
+				if (gnutls_session_get_data2(session->sess, &data) == 0)
+				{
+					ClientSession& saved = clientsessions[session->peer];
+					saved.data.assign(reinterpret_cast<char*>(data.data), data.size);
+					saved.saved = ServerInstance->Time();
+					gnutls_free(data.data);
+				}
+			}
 			gnutls_bye(session->sess, GNUTLS_SHUT_WR);
 			gnutls_deinit(session->sess);
 		}
 		session->sess = NULL;
 		session->cert = NULL;
+		session->peer.clear();
 		session->status = ISSL_NONE;
 	}
 
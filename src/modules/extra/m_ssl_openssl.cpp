@@ -14,6 +14,12 @@
 #include "inspircd.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#else
+# include <openssl/hmac.h>
+#endif
 #include "ssl.h"
 
 #ifdef WINDOWS
@@ -39,8 +45,6 @@
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
-
 char* get_error()
 {
 	return ERR_error_string(ERR_get_error(), NULL);
@@ -48,6 +52,8 @@ char* get_error()
 
 static int error_callback(const char *str, size_t len, void *u);
 
+class HandshakeJob;
+
 /** Represents an SSL user's extra data
  */
 class issl_session
@@ -60,14 +66,132 @@ public:
 	int fd;
 	bool outbound;
 	bool data_to_write;
+	/** Directions the kernel encrypts, as passed to StreamSocket::BypassIOHook() */
+	int offloaded;
+	/** Address of the other end. Outbound sessions are saved under it for resumption,
+	 * and inbound handshakes are queued fairly by it.
+	 */
+	std::string peer;
+	/** The handshake step queued on or running in the handshake pool, if any */
+	HandshakeJob* job;
+	/** Set by OnVerify when the peer's certificate signs itself */
+	bool selfsigned;
 
 	issl_session()
 	{
 		outbound = false;
 		data_to_write = false;
+		offloaded = 0;
+		job = NULL;
+		selfsigned = false;
 	}
 };
 
+/** A key for encrypting session tickets */
+struct TicketKey
+{
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+};
+
+/** Tickets are issued under the current key and still accepted under the
+ * previous one, so rotating the keys every session lifetime never turns
+ * away a ticket which hasn't expired.
+ */
+static TicketKey ticketkeys[2];
+static bool haveprevkey = false;
+/** Guards the keys, which handshake workers read */
+static Mutex ticketlock;
+
+static void GenerateTicketKey(TicketKey& key)
+{
+	if (RAND_bytes(reinterpret_cast<unsigned char*>(&key), sizeof(key)) <= 0)
+		ServerInstance->GenRandom(reinterpret_cast<char*>(&key), sizeof(key));
+}
+
+static void RotateTicketKeys()
+{
+	TicketKey key;
+	GenerateTicketKey(key);
+	ticketlock.Lock();
+	ticketkeys[1] = ticketkeys[0];
+	ticketkeys[0] = key;
+	haveprevkey = true;
+	ticketlock.Unlock();
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/** OpenSSL 3 deprecates HMAC_CTX, and keys the ticket MAC through EVP_MAC */
+typedef EVP_MAC_CTX TicketMAC;
+
+static bool InitTicketMAC(TicketMAC* mac, TicketKey& key)
+{
+	OSSL_PARAM params[2];
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+	params[1] = OSSL_PARAM_construct_end();
+	return EVP_MAC_init(mac, key.hmac, sizeof(key.hmac), params) == 1;
+}
+#else
+typedef HMAC_CTX TicketMAC;
+
+static bool InitTicketMAC(TicketMAC* mac, TicketKey& key)
+{
+	return HMAC_Init_ex(mac, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL) != 0;
+}
+#endif
+
+static int OnTicketKey(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* ectx, TicketMAC* mac, int enc)
+{
+	TicketKey keys[2];
+	ticketlock.Lock();
+	keys[0] = ticketkeys[0];
+	keys[1] = ticketkeys[1];
+	int keycount = haveprevkey ? 2 : 1;
+	ticketlock.Unlock();
+
+	if (enc)
+	{
+		TicketKey& key = keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+		memcpy(name, key.name, sizeof(key.name));
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv) || !InitTicketMAC(mac, key))
+			return -1;
+		return 1;
+	}
+
+	for (int i = 0; i < keycount; i++)
+	{
+		TicketKey& key = keys[i];
+		if (memcmp(name, key.name, sizeof(key.name)))
+			continue;
+		if (!InitTicketMAC(mac, key) || !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+			return -1;
+		// Ask for a ticket under the current key if this one is about to go
+		return i ? 2 : 1;
+	}
+	return 0;
+}
+
+/** The last session each server we link to gave us, by address */
+typedef std::map<std::string, SSL_SESSION*> ClientSessionMap;
+static ClientSessionMap clientsessions;
+
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* sess)
+{
+	issl_session* session = static_cast<issl_session*>(SSL_get_app_data(ssl));
+	if (!session || session->peer.empty())
+		return 0;
+
+	SSL_SESSION*& saved = clientsessions[session->peer];
+	if (saved)
+		SSL_SESSION_free(saved);
+	saved = sess;
+	// We keep the reference OpenSSL handed us
+	return 1;
+}
+
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 {
 	/* XXX: This will allow self signed certificates.
@@ -77,11 +201,267 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 */
 	int ve = X509_STORE_CTX_get_error(ctx);
 
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+	/* This may run on a handshake worker, so the answer goes in the session */
+	SSL* ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+	issl_session* session = ssl ? static_cast<issl_session*>(SSL_get_app_data(ssl)) : NULL;
+	if (session)
+		session->selfsigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
 
 	return 1;
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/** OpenSSL before 1.1 must be handed locks before it is used from several threads */
+static Mutex* openssl_locks = NULL;
+
+static void OnOpenSSLLock(int mode, int n, const char* file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		openssl_locks[n].Lock();
+	else
+		openssl_locks[n].Unlock();
+}
+#endif
+
+class ModuleSSLOpenSSL;
+class HandshakeWorker;
+
+/** One step of an inbound handshake, run on a HandshakeWorker */
+class HandshakeJob
+{
+ public:
+	/** The session to step, or NULL once it has been cancelled (main thread only) */
+	issl_session* session;
+	StreamSocket* const sock;
+	/** The address handshakes are queued fairly by */
+	const std::string ip;
+	/** The worker the job was given to, or NULL while it waits in the pool (main thread only) */
+	HandshakeWorker* worker;
+	/** What SSL_accept() and SSL_get_error() returned */
+	int result;
+	int error;
+
+	HandshakeJob(issl_session* Session, StreamSocket* Sock, const std::string& IP)
+		: session(Session), sock(Sock), ip(IP), worker(NULL), result(0), error(SSL_ERROR_NONE) {}
+};
+
+class HandshakePool;
+
+/** A thread which runs handshake steps for the main thread. Jobs are
+ * handed over and returned in the same way as SQLWorker does it.
+ */
+class HandshakeWorker : public SocketThread
+{
+ public:
+	HandshakePool* const pool;
+	/** Jobs waiting to run (hold the queue lock) */
+	std::deque<HandshakeJob*> pending;
+	/** Jobs which have run and are waiting to be delivered (hold the queue lock) */
+	std::deque<HandshakeJob*> done;
+	/** The job being run (hold the queue lock) */
+	HandshakeJob* current;
+	/** Held for as long as a job is being run */
+	Mutex running;
+	/** Jobs given to this worker and not yet delivered (main thread only) */
+	unsigned int inflight;
+
+	HandshakeWorker(HandshakePool* Pool) : pool(Pool), current(NULL), inflight(0) {}
+
+	void Run()
+	{
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (pending.empty())
+			{
+				this->WaitForQueue();
+				continue;
+			}
+			current = pending.front();
+			pending.pop_front();
+			running.Lock();
+			this->UnlockQueue();
+
+			SSL* sess = current->session->sess;
+			ERR_clear_error();
+			current->result = SSL_accept(sess);
+			current->error = current->result > 0 ? SSL_ERROR_NONE : SSL_get_error(sess, current->result);
+
+			running.Unlock();
+			this->LockQueue();
+			/* Only the first result of a batch needs to wake the main thread */
+			bool wake = done.empty();
+			done.push_back(current);
+			current = NULL;
+			if (wake)
+				NotifyParent();
+		}
+		this->UnlockQueue();
+	}
+
+	void OnNotify();
+};
+
+/** Runs the expensive steps of inbound handshakes on worker threads.
+ *
+ * Steps wait in one queue per client address and are handed out in turn,
+ * one address at a time, so a flood of connects from a few hosts can only
+ * hold up its own handshakes. The queue is bounded, both overall and per
+ * address; a connection which doesn't fit is dropped.
+ */
+class HandshakePool
+{
+	std::vector<HandshakeWorker*> workers;
+	std::map<std::string, std::deque<HandshakeJob*> > waiting;
+	/** Addresses with waiting jobs, in the order they are served */
+	std::deque<std::string> turns;
+
+ public:
+	ModuleSSLOpenSSL* const mod;
+	/** Jobs waiting for a worker */
+	size_t queued;
+	size_t maxqueue;
+	size_t maxperip;
+	/** Connections dropped because the queue was full */
+	unsigned long dropped;
+
+	HandshakePool(ModuleSSLOpenSSL* Mod, unsigned int threads)
+		: mod(Mod), queued(0), maxqueue(1000), maxperip(10), dropped(0)
+	{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		openssl_locks = new Mutex[CRYPTO_num_locks()];
+		CRYPTO_set_locking_callback(OnOpenSSLLock);
+#endif
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			HandshakeWorker* worker = new HandshakeWorker(this);
+			ServerInstance->Threads->Start(worker);
+			workers.push_back(worker);
+		}
+	}
+
+	~HandshakePool()
+	{
+		for (std::vector<HandshakeWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			HandshakeWorker* worker = *i;
+			worker->join();
+			for (std::deque<HandshakeJob*>::iterator j = worker->pending.begin(); j != worker->pending.end(); ++j)
+				delete *j;
+			for (std::deque<HandshakeJob*>::iterator j = worker->done.begin(); j != worker->done.end(); ++j)
+				delete *j;
+			delete worker;
+		}
+		for (std::map<std::string, std::deque<HandshakeJob*> >::iterator i = waiting.begin(); i != waiting.end(); ++i)
+			for (std::deque<HandshakeJob*>::iterator j = i->second.begin(); j != i->second.end(); ++j)
+				delete *j;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		CRYPTO_set_locking_callback(NULL);
+		delete[] openssl_locks;
+		openssl_locks = NULL;
+#endif
+	}
+
+	size_t threads() const { return workers.size(); }
+
+	/** Queue a job, or return false if there is no room for it */
+	bool Submit(HandshakeJob* job)
+	{
+		std::map<std::string, std::deque<HandshakeJob*> >::iterator i = waiting.find(job->ip);
+		size_t mine = (i == waiting.end()) ? 0 : i->second.size();
+		if (queued >= maxqueue || mine >= maxperip)
+		{
+			dropped++;
+			return false;
+		}
+
+		if (!mine)
+			turns.push_back(job->ip);
+		waiting[job->ip].push_back(job);
+		queued++;
+		Dispatch();
+		return true;
+	}
+
+	/** Hand waiting jobs to workers, taking one from each address in turn.
+	 * Each worker gets at most two, so it has the next one to hand while
+	 * the main thread collects the last.
+	 */
+	void Dispatch()
+	{
+		while (!turns.empty())
+		{
+			HandshakeWorker* idle = NULL;
+			for (std::vector<HandshakeWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+				if ((*i)->inflight < 2 && (!idle || (*i)->inflight < idle->inflight))
+					idle = *i;
+			if (!idle)
+				return;
+
+			std::string ip = turns.front();
+			turns.pop_front();
+			std::map<std::string, std::deque<HandshakeJob*> >::iterator i = waiting.find(ip);
+			HandshakeJob* job = i->second.front();
+			i->second.pop_front();
+			if (i->second.empty())
+				waiting.erase(i);
+			else
+				turns.push_back(ip);
+			queued--;
+
+			job->worker = idle;
+			idle->inflight++;
+			idle->LockQueue();
+			idle->pending.push_back(job);
+			idle->UnlockQueueWakeup();
+		}
+	}
+
+	/** Withdraw a job whose session is closing. If it is running, this waits
+	 * for it to finish, after which the session may be freed.
+	 */
+	void Cancel(HandshakeJob* job)
+	{
+		HandshakeWorker* worker = job->worker;
+		if (!worker)
+		{
+			std::map<std::string, std::deque<HandshakeJob*> >::iterator i = waiting.find(job->ip);
+			std::deque<HandshakeJob*>& jobs = i->second;
+			jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+			if (jobs.empty())
+			{
+				waiting.erase(i);
+				turns.erase(std::find(turns.begin(), turns.end(), job->ip));
+			}
+			queued--;
+			delete job;
+			return;
+		}
+
+		worker->LockQueue();
+		std::deque<HandshakeJob*>::iterator pos = std::find(worker->pending.begin(), worker->pending.end(), job);
+		if (pos != worker->pending.end())
+		{
+			worker->pending.erase(pos);
+			worker->inflight--;
+			worker->UnlockQueue();
+			delete job;
+			// Its place on the worker can go to a job which is waiting
+			Dispatch();
+			return;
+		}
+		bool busy = (worker->current == job);
+		worker->UnlockQueue();
+		if (busy)
+		{
+			worker->running.Lock();
+			worker->running.Unlock();
+		}
+		// It is returned through the done queue, and dropped there
+		job->session = NULL;
+	}
+};
+
 class ModuleSSLOpenSSL : public Module
 {
 	int inbufsize;
@@ -94,11 +474,27 @@ class ModuleSSLOpenSSL : public Module
 
 	std::string sslports;
 	bool use_sha;
+	bool use_ktls;
+
+	/** How long a session may be resumed for, and how often the ticket keys change */
+	long sessiontimeout;
+	time_t nextkeyrotation;
+
+	/** Handshakes completed, and how many of them resumed a session */
+	unsigned long inbound_handshakes;
+	unsigned long inbound_resumed;
+	unsigned long outbound_handshakes;
+	unsigned long outbound_resumed;
+
+	/** Runs inbound handshakes off the main thread, if enabled */
+	HandshakePool* pool;
 
 	ServiceProvider iohook;
  public:
 
-	ModuleSSLOpenSSL() : iohook(this, "ssl/openssl", SERVICE_IOHOOK)
+	ModuleSSLOpenSSL() : use_ktls(false), sessiontimeout(3600), nextkeyrotation(0)
+		, inbound_handshakes(0), inbound_resumed(0), outbound_handshakes(0), outbound_resumed(0)
+		, pool(NULL), iohook(this, "ssl/openssl", SERVICE_IOHOOK)
 	{
 		sessions = new issl_session[ServerInstance->SE->GetMaxFds()];
 
@@ -120,13 +516,28 @@ class ModuleSSLOpenSSL : public Module
 
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
 		SSL_CTX_set_verify(clictx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
+
+		/* Resumed sessions must come from this server; OpenSSL refuses to resume without this when verifying peers */
+		SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>("inspircd"), 8);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, OnTicketKey);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, OnTicketKey);
+#endif
+
+		/* Outbound sessions are kept by peer address rather than in OpenSSL's cache */
+		SSL_CTX_set_session_cache_mode(clictx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(clictx, OnNewClientSession);
+
+		GenerateTicketKey(ticketkeys[0]);
+		haveprevkey = false;
 	}
 
 	void init()
 	{
 		// Needs the flag as it ignores a plain /rehash
 		OnModuleRehash(NULL,"ssl");
-		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnHookIO, I_OnUserConnect };
+		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnHookIO, I_OnUserConnect, I_OnStats, I_OnBackgroundTimer };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		ServerInstance->Modules->AddService(iohook);
 	}
@@ -187,6 +598,55 @@ class ModuleSSLOpenSSL : public Module
 			throw ModuleException("Unknown hash type " + hash);
 		use_sha = (hash == "sha1");
 
+		sessiontimeout = conf->getInt("sessiontimeout", 3600);
+		if (sessiontimeout < 1)
+			sessiontimeout = 3600;
+		long cachesize = conf->getInt("sessioncache", 20000);
+
+		/* OpenSSL's own cache is bounded: once full, adding a session drops the
+		 * least recently used one, and expired ones are purged as it goes.
+		 */
+		SSL_CTX_set_session_cache_mode(ctx, cachesize > 0 ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+		SSL_CTX_sess_set_cache_size(ctx, cachesize > 0 ? cachesize : 0);
+		SSL_CTX_set_timeout(ctx, sessiontimeout);
+		SSL_CTX_set_timeout(clictx, sessiontimeout);
+		if (conf->getBool("tickets", true))
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+		else
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		if (!nextkeyrotation || nextkeyrotation > ServerInstance->Time() + sessiontimeout)
+			nextkeyrotation = ServerInstance->Time() + sessiontimeout;
+
+		/* The number of threads is fixed until the module is reloaded */
+		int threads = conf->getInt("handshakethreads");
+		if (threads > 0 && !pool)
+			pool = new HandshakePool(this, threads);
+		if (pool)
+		{
+			pool->maxqueue = conf->getInt("handshakequeue", 1000);
+			pool->maxperip = conf->getInt("handshakeperip", 10);
+		}
+
+		use_ktls = conf->getBool("ktls");
+#ifdef SSL_OP_ENABLE_KTLS
+		/* OpenSSL installs the keys with TCP_ULP itself, and quietly carries on
+		 * in user space if the kernel or the negotiated cipher can't do it.
+		 * This only affects sessions started from now on.
+		 */
+		if (use_ktls)
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+			SSL_CTX_set_options(clictx, SSL_OP_ENABLE_KTLS);
+		}
+		else
+		{
+			SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+			SSL_CTX_clear_options(clictx, SSL_OP_ENABLE_KTLS);
+		}
+#else
+		if (use_ktls)
+			ServerInstance->Logs->Log("m_ssl_openssl",DEFAULT, "m_ssl_openssl.so: This OpenSSL was built without kernel TLS support, ignoring <openssl:ktls>");
+#endif
 
 		/* Load our keys and certificates
 		 * NOTE: OpenSSL's error logging API sucks, don't blame us for this clusterfuck.
@@ -237,8 +697,52 @@ class ModuleSSLOpenSSL : public Module
 			output.append(" SSL=" + sslports);
 	}
 
+	void OnBackgroundTimer(time_t curtime)
+	{
+		if (curtime >= nextkeyrotation)
+		{
+			RotateTicketKeys();
+			nextkeyrotation = curtime + sessiontimeout;
+		}
+
+		for (ClientSessionMap::iterator i = clientsessions.begin(); i != clientsessions.end(); )
+		{
+			SSL_SESSION* sess = i->second;
+			if (SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) < curtime)
+			{
+				SSL_SESSION_free(sess);
+				clientsessions.erase(i++);
+			}
+			else
+				++i;
+		}
+	}
+
+	static std::string ResumeRate(unsigned long handshakes, unsigned long resumed)
+	{
+		return ConvToStr(handshakes) + " resumed " + ConvToStr(resumed) + " (" + ConvToStr(handshakes ? resumed * 100 / handshakes : 0) + "%)";
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list &results)
+	{
+		if (symbol != 'T')
+			return MOD_RES_PASSTHRU;
+
+		std::string prefix = ServerInstance->Config->ServerName + " 249 " + user->nick + " :openssl ";
+		results.push_back(prefix + "inbound handshakes " + ResumeRate(inbound_handshakes, inbound_resumed));
+		results.push_back(prefix + "outbound handshakes " + ResumeRate(outbound_handshakes, outbound_resumed));
+		results.push_back(prefix + "cached sessions " + ConvToStr(SSL_CTX_sess_number(ctx)) + " servers " + ConvToStr(clientsessions.size()));
+		if (pool)
+			results.push_back(prefix + "handshake threads " + ConvToStr(pool->threads()) + " queued " + ConvToStr(pool->queued) + " dropped " + ConvToStr(pool->dropped));
+		return MOD_RES_PASSTHRU;
+	}
+
 	~ModuleSSLOpenSSL()
 	{
+		delete pool;
+		for (ClientSessionMap::iterator i = clientsessions.begin(); i != clientsessions.end(); ++i)
+			SSL_SESSION_free(i->second);
+		clientsessions.clear();
 		SSL_CTX_free(ctx);
 		SSL_CTX_free(clictx);
 		delete[] sessions;
@@ -299,11 +803,16 @@ class ModuleSSLOpenSSL : public Module
 		session->sess = SSL_new(ctx);
 		session->status = ISSL_NONE;
 		session->outbound = false;
+		session->offloaded = 0;
+		session->peer = client ? client->addr() : "";
+		session->selfsigned = false;
 		session->cert = NULL;
 
 		if (session->sess == NULL)
 			return;
 
+		SSL_set_app_data(session->sess, session);
+
 		if (SSL_set_fd(session->sess, fd) == 0)
 		{
 			ServerInstance->Logs->Log("m_ssl_openssl",DEBUG,"BUG: Can't set fd with SSL_set_fd: %d", fd);
@@ -326,10 +835,26 @@ class ModuleSSLOpenSSL : public Module
 		session->sess = SSL_new(clictx);
 		session->status = ISSL_NONE;
 		session->outbound = true;
+		session->offloaded = 0;
+		session->peer.clear();
+		session->selfsigned = false;
 
 		if (session->sess == NULL)
 			return;
 
+		SSL_set_app_data(session->sess, session);
+
+		/* Offer the session we had with this server last time, so a relink after a split is cheap */
+		irc::sockets::sockaddrs addr;
+		socklen_t addrlen = sizeof(addr);
+		if (getpeername(fd, &addr.sa, &addrlen) == 0)
+		{
+			session->peer = addr.str();
+			ClientSessionMap::iterator saved = clientsessions.find(session->peer);
+			if (saved != clientsessions.end())
+				SSL_set_session(session->sess, saved->second);
+		}
+
 		if (SSL_set_fd(session->sess, fd) == 0)
 		{
 			ServerInstance->Logs->Log("m_ssl_openssl",DEBUG,"BUG: Can't set fd with SSL_set_fd: %d", fd);
@@ -382,6 +907,8 @@ class ModuleSSLOpenSSL : public Module
 		{
 			char* buffer = ServerInstance->GetReadBuffer();
 			size_t bufsiz = ServerInstance->Config->NetBufferSize;
+			// SSL_get_error() looks at the thread's error queue, so it must not hold anything older
+			ERR_clear_error();
 			int ret = SSL_read(session->sess, buffer, bufsiz);
 
 			if (ret > 0)
@@ -445,10 +972,16 @@ class ModuleSSLOpenSSL : public Module
 					return -1;
 				return 0;
 			}
+
+			// The handshake finished and the kernel has taken over writes. Leave
+			// the data queued; the trial write Handshake() added sends it.
+			if (session->offloaded & StreamSocket::BYPASS_WRITE)
+				return 0;
 		}
 
 		if (session->status == ISSL_OPEN)
 		{
+			ERR_clear_error();
 			int ret = SSL_write(session->sess, buffer.data(), buffer.size());
 			if (ret == (int)buffer.length())
 			{
@@ -493,17 +1026,63 @@ class ModuleSSLOpenSSL : public Module
 
 	bool Handshake(StreamSocket* user, issl_session* session)
 	{
+		// A worker is on it; the socket is told when it has finished
+		if (session->job)
+			return true;
+
+		if (pool && !session->outbound)
+		{
+			session->status = ISSL_HANDSHAKING;
+			session->job = new HandshakeJob(session, user, session->peer);
+			if (!pool->Submit(session->job))
+			{
+				delete session->job;
+				session->job = NULL;
+				CloseSession(session);
+				ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+				return false;
+			}
+			// Nothing can be done with the socket until the worker hands it back
+			ServerInstance->SE->ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+			return true;
+		}
+
 		int ret;
 
+		ERR_clear_error();
 		if (session->outbound)
 			ret = SSL_connect(session->sess);
 		else
 			ret = SSL_accept(session->sess);
 
-		if (ret < 0)
+		return HandshakeResult(user, session, ret, ret < 0 ? SSL_get_error(session->sess, ret) : SSL_ERROR_NONE);
+	}
+
+	/** Called when a worker has run a handshake step */
+	void HandshakeDone(HandshakeJob* job)
+	{
+		issl_session* session = job->session;
+		StreamSocket* user = job->sock;
+		session->job = NULL;
+
+		HandshakeResult(user, session, job->result, job->error);
+		if (session->status == ISSL_NONE)
+		{
+			// Let the socket find out that the session is gone
+			ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+		}
+		else if (session->status == ISSL_OPEN)
 		{
-			int err = SSL_get_error(session->sess, ret);
+			// The client may have sent its first lines along with the end of the handshake
+			ServerInstance->SE->ChangeEventMask(user, FD_ADD_TRIAL_READ);
+		}
+	}
 
+	/** Act on what SSL_accept() or SSL_connect() returned */
+	bool HandshakeResult(StreamSocket* user, issl_session* session, int ret, int err)
+	{
+		if (ret < 0)
+		{
 			if (err == SSL_ERROR_WANT_READ)
 			{
 				ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
@@ -528,7 +1107,22 @@ class ModuleSSLOpenSSL : public Module
 			// Handshake complete.
 			VerifyCertificate(session, user);
 
+			bool resumed = SSL_session_reused(session->sess);
+			if (session->outbound)
+			{
+				outbound_handshakes++;
+				if (resumed)
+					outbound_resumed++;
+			}
+			else
+			{
+				inbound_handshakes++;
+				if (resumed)
+					inbound_resumed++;
+			}
+
 			session->status = ISSL_OPEN;
+			Offload(user, session);
 
 			ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
 
@@ -543,8 +1137,35 @@ class ModuleSSLOpenSSL : public Module
 		return true;
 	}
 
+	/** If OpenSSL handed writes to kernel TLS, let the core write directly
+	 * on the socket. Reads always go through OpenSSL, even when the kernel
+	 * decrypts them: a plain recv() fails with EIO on records which are not
+	 * application data, such as TLS 1.3 session tickets, key updates and
+	 * alerts, while OpenSSL reads those with recvmsg() and handles them.
+	 */
+	void Offload(StreamSocket* user, issl_session* session)
+	{
+#ifdef SSL_OP_ENABLE_KTLS
+		if (!(SSL_get_options(session->sess) & SSL_OP_ENABLE_KTLS))
+			return;
+		if (session->offloaded || !BIO_get_ktls_send(SSL_get_wbio(session->sess)))
+			return;
+
+		ServerInstance->Logs->Log("m_ssl_openssl",DEBUG, "Kernel TLS on fd %d for writes (%s)", session->fd,
+			SSL_get_cipher_name(session->sess));
+		session->offloaded = StreamSocket::BYPASS_WRITE;
+		user->BypassIOHook(StreamSocket::BYPASS_WRITE);
+#endif
+	}
+
 	void CloseSession(issl_session* session)
 	{
+		if (session->job)
+		{
+			pool->Cancel(session->job);
+			session->job = NULL;
+		}
+
 		if (session->sess)
 		{
 			SSL_shutdown(session->sess);
@@ -553,6 +1174,7 @@ class ModuleSSLOpenSSL : public Module
 
 		session->sess = NULL;
 		session->status = ISSL_NONE;
+		session->offloaded = 0;
 		errno = EIO;
 	}
 
@@ -578,7 +1200,7 @@ class ModuleSSLOpenSSL : public Module
 
 		certinfo->invalid = (SSL_get_verify_result(session->sess) != X509_V_OK);
 
-		if (SelfSigned)
+		if (session->selfsigned)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -610,6 +1232,23 @@ class ModuleSSLOpenSSL : public Module
 	}
 };
 
+void HandshakeWorker::OnNotify()
+{
+	std::deque<HandshakeJob*> batch;
+	this->LockQueue();
+	batch.swap(done);
+	this->UnlockQueue();
+
+	for (std::deque<HandshakeJob*>::iterator i = batch.begin(); i != batch.end(); ++i)
+	{
+		inflight--;
+		if ((*i)->session)
+			pool->mod->HandshakeDone(*i);
+		delete *i;
+	}
+	pool->Dispatch();
+}
+
 static int error_callback(const char *str, size_t len, void *u)
 {
 	ServerInstance->Logs->Log("m_ssl_openssl",DEFAULT, "SSL error: " + std::string(str, len - 1));
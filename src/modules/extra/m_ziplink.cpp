@@ -0,0 +1,463 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "compress.h"
+#include "ssl.h"
+
+#include <zlib.h>
+
+#ifdef WINDOWS
+# pragma comment(lib, "zlib.lib")
+#endif
+
+/* $ModDesc: Provides zlib stream compression for server to server links */
+/* $LinkerFlags: -lz */
+
+/** Size of the buffer zlib writes into, and of the largest raw read */
+static const size_t ZIP_CHUNK = 16384;
+
+/** The compression state of one socket. The socket's own IOHook, if it had
+ * one when compression started, is kept as the inner hook and is passed
+ * the compressed stream, so TLS is applied after compression.
+ */
+class ZipSession
+{
+ public:
+	/** Hook which was on the socket before us, or NULL for a plain socket */
+	reference<Module> inner;
+	/** Directions the inner hook had handed to the kernel, which we read or write directly */
+	int bypass;
+	std::string label;
+
+	z_stream zout;
+	z_stream zin;
+	bool deflating;
+	bool inflating;
+
+	/** Bytes of the sendq which were queued before compression started */
+	size_t plain;
+	/** Output which the inner hook or the socket has not yet taken */
+	std::string pending;
+	/** Compressed data read, waiting to be inflated */
+	std::string readbuf;
+
+	unsigned long bytes_out;
+	unsigned long zipped_out;
+	unsigned long bytes_in;
+	unsigned long zipped_in;
+	/** Processor time spent in zlib */
+	clock_t cpu;
+
+	ZipSession(StreamSocket* sock, const std::string& Label)
+		: inner(sock->GetIOHook()), bypass(sock->GetIOHookBypass()), label(Label), deflating(false), inflating(false), plain(0),
+		bytes_out(0), zipped_out(0), bytes_in(0), zipped_in(0), cpu(0)
+	{
+	}
+
+	~ZipSession()
+	{
+		if (deflating)
+			deflateEnd(&zout);
+		if (inflating)
+			inflateEnd(&zin);
+	}
+
+	/** True if the given direction goes straight to the socket, not through the inner hook */
+	bool Raw(int direction)
+	{
+		return !inner || (bypass & direction);
+	}
+
+	/** Pick up directions the inner hook has just handed to the kernel. The bypass
+	 * is kept here instead, so that the socket still passes everything through us.
+	 */
+	void CheckBypass(StreamSocket* sock, Module* self)
+	{
+		int b = sock->GetIOHookBypass();
+		if (b)
+		{
+			bypass |= b;
+			sock->AddIOHook(self);
+		}
+	}
+
+	/** Compress data onto the end of the pending output.
+	 * @param flush Z_SYNC_FLUSH to make everything so far decodable by the other end
+	 */
+	bool Deflate(const std::string& data, int flush)
+	{
+		char out[ZIP_CHUNK];
+		clock_t start = clock();
+		size_t before = pending.length();
+
+		zout.next_in = (Bytef*)data.data();
+		zout.avail_in = data.length();
+		do
+		{
+			zout.next_out = (Bytef*)out;
+			zout.avail_out = sizeof(out);
+			if (deflate(&zout, flush) == Z_STREAM_ERROR)
+				return false;
+			pending.append(out, sizeof(out) - zout.avail_out);
+		} while (zout.avail_out == 0);
+
+		bytes_out += data.length();
+		zipped_out += pending.length() - before;
+		cpu += clock() - start;
+		return true;
+	}
+
+	/** Decompress data onto the end of a recvq */
+	bool Inflate(const std::string& data, std::string& recvq)
+	{
+		char out[ZIP_CHUNK];
+		clock_t start = clock();
+		size_t before = recvq.length();
+
+		zin.next_in = (Bytef*)data.data();
+		zin.avail_in = data.length();
+		do
+		{
+			zin.next_out = (Bytef*)out;
+			zin.avail_out = sizeof(out);
+			int rv = inflate(&zin, Z_SYNC_FLUSH);
+			// The stream never ends while the link is up, so Z_STREAM_END is an error too
+			if (rv != Z_OK && rv != Z_BUF_ERROR)
+				return false;
+			recvq.append(out, sizeof(out) - zin.avail_out);
+		} while (zin.avail_out == 0);
+
+		zipped_in += data.length();
+		bytes_in += recvq.length() - before;
+		cpu += clock() - start;
+		return true;
+	}
+};
+
+typedef std::map<StreamSocket*, ZipSession*> ZipSessionMap;
+
+class ZlibProvider : public CompressProvider
+{
+ public:
+	ZipSessionMap sessions;
+	int level;
+
+	ZlibProvider(Module* mod) : CompressProvider(mod, "zlib"), level(Z_DEFAULT_COMPRESSION)
+	{
+	}
+
+	ZipSession* Find(StreamSocket* sock)
+	{
+		ZipSessionMap::iterator i = sessions.find(sock);
+		return i == sessions.end() ? NULL : i->second;
+	}
+
+	/** Get the session for a socket, stacking ourselves over its hook if this is the first direction started */
+	ZipSession* Get(StreamSocket* sock, const std::string& label)
+	{
+		ZipSession* session = Find(sock);
+		if (!session)
+		{
+			session = new ZipSession(sock, label);
+			sessions[sock] = session;
+			sock->AddIOHook(creator);
+		}
+		return session;
+	}
+
+	bool StartCompress(StreamSocket* sock, const std::string& label)
+	{
+		ZipSession* session = Get(sock, label);
+		if (session->deflating)
+			return false;
+
+		memset(&session->zout, 0, sizeof(session->zout));
+		if (deflateInit(&session->zout, level) != Z_OK)
+			return false;
+		session->deflating = true;
+		session->plain = sock->getSendQSize();
+		return true;
+	}
+
+	bool StartDecompress(StreamSocket* sock, std::string& recvq, const std::string& label)
+	{
+		ZipSession* session = Get(sock, label);
+		if (session->inflating)
+			return false;
+
+		memset(&session->zin, 0, sizeof(session->zin));
+		if (inflateInit(&session->zin) != Z_OK)
+			return false;
+		session->inflating = true;
+
+		std::string data;
+		data.swap(recvq);
+		return session->Inflate(data, recvq);
+	}
+};
+
+class ModuleZipLink : public Module
+{
+	ZlibProvider zlib;
+
+	/** Read from the socket directly, as the core would */
+	int RawRead(StreamSocket* sock, std::string& recvq)
+	{
+		char* buffer = ServerInstance->GetReadBuffer();
+		size_t bufsiz = std::min<size_t>(ServerInstance->Config->NetBufferSize, ZIP_CHUNK);
+		int n = recv(sock->GetFd(), buffer, bufsiz, 0);
+		if (n > 0)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, (size_t)n == bufsiz ? FD_WANT_FAST_READ | FD_ADD_TRIAL_READ : FD_WANT_FAST_READ);
+			recvq.append(buffer, n);
+			return 1;
+		}
+		else if (n == 0)
+		{
+			sock->SetError("Connection closed");
+			return -1;
+		}
+		else if (errno == EAGAIN)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+			return 0;
+		}
+		else if (errno == EINTR)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+			return 0;
+		}
+		sock->SetError(strerror(errno));
+		return -1;
+	}
+
+	/** Write to the socket directly, as the core would. Anything not written is left in data.
+	 * @return 1 if everything was written, 0 if the socket blocked, -1 on error
+	 */
+	int RawWrite(StreamSocket* sock, std::string& data)
+	{
+		int rv = ServerInstance->SE->Send(sock, data.data(), data.length(), 0);
+		if (rv == (int)data.length())
+		{
+			data.clear();
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_EDGE_WRITE);
+			return 1;
+		}
+		else if (rv > 0)
+		{
+			data.erase(0, rv);
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+			return 0;
+		}
+		else if (rv == 0)
+		{
+			sock->SetError("Connection closed");
+			return -1;
+		}
+		else if (errno == EAGAIN || errno == EINTR)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+			return 0;
+		}
+		sock->SetError(strerror(errno));
+		return -1;
+	}
+
+	/** Write data out through the inner hook, or directly if there is none */
+	int Write(StreamSocket* sock, ZipSession* session, std::string& data)
+	{
+		// zlib may have kept everything it was given so far
+		if (data.empty())
+			return 1;
+
+		if (session->Raw(StreamSocket::BYPASS_WRITE))
+			return RawWrite(sock, data);
+
+		int rv = session->inner->OnStreamSocketWrite(sock, data);
+		if (rv > 0)
+			data.clear();
+		session->CheckBypass(sock, this);
+		return rv;
+	}
+
+	static std::string Ratio(unsigned long raw, unsigned long zipped)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.2f:1", zipped ? (double)raw / zipped : 0.0);
+		return buf;
+	}
+
+ public:
+	ModuleZipLink() : zlib(this)
+	{
+	}
+
+	void init()
+	{
+		ServerInstance->Modules->AddService(zlib);
+		OnRehash(NULL);
+		Implementation eventlist[] = { I_OnRehash, I_OnStats, I_OnUnloadModule };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	void OnRehash(User* user)
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("ziplink");
+		zlib.level = tag->getInt("level", Z_DEFAULT_COMPRESSION);
+		if (zlib.level < Z_DEFAULT_COMPRESSION || zlib.level > Z_BEST_COMPRESSION)
+			zlib.level = Z_DEFAULT_COMPRESSION;
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list &results)
+	{
+		if (symbol != 'T')
+			return MOD_RES_PASSTHRU;
+
+		std::string prefix = ServerInstance->Config->ServerName + " 249 " + user->nick + " :ziplink ";
+		for (ZipSessionMap::iterator i = zlib.sessions.begin(); i != zlib.sessions.end(); ++i)
+		{
+			ZipSession* session = i->second;
+			results.push_back(prefix + session->label +
+				" sent " + ConvToStr(session->bytes_out) + " as " + ConvToStr(session->zipped_out) + " (" + Ratio(session->bytes_out, session->zipped_out) + ")" +
+				" recv " + ConvToStr(session->bytes_in) + " as " + ConvToStr(session->zipped_in) + " (" + Ratio(session->bytes_in, session->zipped_in) + ")" +
+				" cpu " + ConvToStr(session->cpu * 1000000 / CLOCKS_PER_SEC) + "us");
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUnloadModule(Module* mod)
+	{
+		// The stream can't carry on without the hook beneath us, so drop the link as spanningtree would
+		std::vector<StreamSocket*> dead;
+		for (ZipSessionMap::iterator i = zlib.sessions.begin(); i != zlib.sessions.end(); ++i)
+		{
+			if (i->second->inner == mod)
+				dead.push_back(i->first);
+		}
+		for (std::vector<StreamSocket*>::iterator i = dead.begin(); i != dead.end(); ++i)
+		{
+			(*i)->SetError("SSL module unloaded");
+			(*i)->Close();
+		}
+	}
+
+	void OnRequest(Request& request)
+	{
+		if (strcmp("GET_SSL_CERT", request.id) == 0)
+		{
+			SocketCertificateRequest& req = static_cast<SocketCertificateRequest&>(request);
+			ZipSession* session = zlib.Find(req.sock);
+			if (session && session->inner)
+				session->inner->OnRequest(request);
+		}
+	}
+
+	void OnStreamSocketClose(StreamSocket* sock)
+	{
+		ZipSessionMap::iterator i = zlib.sessions.find(sock);
+		if (i == zlib.sessions.end())
+			return;
+
+		ZipSession* session = i->second;
+		zlib.sessions.erase(i);
+		if (session->inner)
+			session->inner->OnStreamSocketClose(sock);
+		delete session;
+	}
+
+	int OnStreamSocketRead(StreamSocket* sock, std::string& recvq)
+	{
+		ZipSession* session = zlib.Find(sock);
+		if (!session)
+			return -1;
+
+		std::string& data = session->inflating ? session->readbuf : recvq;
+		int rv;
+		if (session->Raw(StreamSocket::BYPASS_READ))
+		{
+			rv = RawRead(sock, data);
+		}
+		else
+		{
+			rv = session->inner->OnStreamSocketRead(sock, data);
+			session->CheckBypass(sock, this);
+		}
+
+		if (rv <= 0 || !session->inflating)
+			return rv;
+
+		bool ok = session->Inflate(session->readbuf, recvq);
+		session->readbuf.clear();
+		if (!ok)
+		{
+			sock->SetError("Decompression error");
+			return -1;
+		}
+		return 1;
+	}
+
+	int OnStreamSocketWrite(StreamSocket* sock, std::string& buffer)
+	{
+		ZipSession* session = zlib.Find(sock);
+		if (!session)
+			return -1;
+
+		if (!session->deflating)
+			return Write(sock, session, buffer);
+
+		// Output held back by a blocked socket goes first. Nothing more is taken
+		// until it is gone, so the sendq keeps pushing back on the burst.
+		if (!session->pending.empty())
+		{
+			int rv = Write(sock, session, session->pending);
+			if (rv <= 0)
+				return rv;
+		}
+		if (buffer.empty())
+			return 1;
+
+		// The core writes everything queued in one pass of the main loop, so a
+		// sync flush on its last piece sends every line without further delay.
+		int flush = (sock->getSendQSize() <= buffer.length()) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+		if (session->plain)
+		{
+			size_t len = std::min(session->plain, buffer.length());
+			session->pending.append(buffer, 0, len);
+			session->plain -= len;
+			buffer.erase(0, len);
+		}
+		if (!buffer.empty() && !session->Deflate(buffer, flush))
+		{
+			sock->SetError("Compression error");
+			return -1;
+		}
+		buffer.clear();
+
+		return Write(sock, session, session->pending);
+	}
+
+	~ModuleZipLink()
+	{
+		for (ZipSessionMap::iterator i = zlib.sessions.begin(); i != zlib.sessions.end(); ++i)
+			delete i->second;
+	}
+
+	Version GetVersion()
+	{
+		return Version("Provides zlib stream compression for server to server links", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZipLink)
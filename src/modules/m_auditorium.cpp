@@ -52,9 +52,9 @@ class ModuleAuditorium : public Module
 
 		Implementation eventlist[] = {
 			I_OnUserJoin, I_OnUserPart, I_OnUserKick,
-			I_OnBuildNeighborList, I_OnNamesListItem, I_OnSendWhoLine,
+			I_OnNeighborChannel, I_OnNeighborMember, I_OnNamesListItem, I_OnNamesListStyle, I_OnSendWhoLine,
 			I_OnRehash };
-		ServerInstance->Modules->Attach(eventlist, this, 7);
+		ServerInstance->Modules->Attach(eventlist, this, 9);
 	}
 
 	~ModuleAuditorium()
@@ -118,6 +118,21 @@ class ModuleAuditorium : public Module
 		nick.clear();
 	}
 
+	ModResult OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style)
+	{
+		if (!chan->IsModeSet(&aum))
+			return MOD_RES_PASSTHRU;
+
+		// Members who can see the whole list get the usual one
+		if (OperCanSee && issuer->HasPrivPermission("channels/auspex"))
+			return MOD_RES_PASSTHRU;
+		ModResult res = ServerInstance->OnCheckExemption(issuer,chan,"auditorium-see");
+		if (res.check(OpsCanSee && chan->GetPrefixValue(issuer) >= OP_VALUE))
+			return MOD_RES_PASSTHRU;
+
+		return MOD_RES_DENY;
+	}
+
 	/** Build CUList for showing this join/part/kick */
 	void BuildExcept(Membership* memb, CUList& excepts)
 	{
@@ -147,25 +162,18 @@ class ModuleAuditorium : public Module
 		BuildExcept(memb, excepts);
 	}
 
-	void OnBuildNeighborList(User* source, UserChanList &include, std::map<User*,bool> &exception)
+	ModResult OnNeighborChannel(Membership* memb)
 	{
-		UCListIter i = include.begin();
-		while (i != include.end())
-		{
-			Channel* c = *i++;
-			Membership* memb = c->GetUser(source);
-			if (!memb || IsVisible(memb))
-				continue;
-			// this channel should not be considered when listing my neighbors
-			include.erase(c);
-			// however, that might hide me from ops that can see me...
-			const UserMembList* users = c->GetUsers();
-			for(UserMembCIter j = users->begin(); j != users->end(); j++)
-			{
-				if (IS_LOCAL(j->first) && CanSee(j->first, memb))
-					exception[j->first] = true;
-			}
-		}
+		// this channel should not be considered when listing my neighbors
+		return IsVisible(memb) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
+	}
+
+	ModResult OnNeighborMember(Membership* memb, User* member)
+	{
+		// however, that might hide me from ops that can see me...
+		if (IsVisible(memb) || !CanSee(member, memb))
+			return MOD_RES_PASSTHRU;
+		return MOD_RES_ALLOW;
 	}
 
 	void OnSendWhoLine(User* source, const std::vector<std::string>& params, User* user, std::string& line)
@@ -0,0 +1,533 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+#include "store.h"
+
+/* $ModDesc: Provides channel history for a given number of lines */
+
+struct HistoryItem
+{
+	time_t ts;
+	std::string line;
+	HistoryItem() : ts(0) {}
+};
+
+/** A channel's history, kept in a ring of maxlen slots. Once the ring is
+ * full each new line is written over the oldest one, reusing the memory
+ * the old line's string already has.
+ */
+struct HistoryList
+{
+	std::vector<HistoryItem> lines;
+	unsigned int start, count;
+	unsigned int maxlen, maxtime;
+	/** The TS of the channel this was kept from, once the channel has gone */
+	time_t chants;
+	HistoryList(unsigned int len, unsigned int time) : lines(len), start(0), count(0), maxlen(len), maxtime(time), chants(0) {}
+
+	/** Get the slot for a new line */
+	HistoryItem& Push()
+	{
+		unsigned int pos = (start + count) % maxlen;
+		if (count < maxlen)
+			count++;
+		else
+			start = (start + 1) % maxlen;
+		return lines[pos];
+	}
+
+	/** Get a line, counting from the oldest */
+	HistoryItem& Get(unsigned int n)
+	{
+		return lines[(start + n) % maxlen];
+	}
+};
+
+/** History kept after its channel went, or read back from the save file,
+ * until its channel is set +H again. It is only given back to a channel
+ * with the same TS, and not to one which was recreated under the name.
+ */
+typedef std::map<std::string, HistoryList*> SavedHistory;
+
+class HistoryMode : public ModeHandler
+{
+ public:
+	SimpleExtItem<HistoryList> ext;
+	int maxlines;
+	SavedHistory saved;
+	HistoryMode(Module* Creator) : ModeHandler(Creator, "history", 'H', PARAM_SETONLY, MODETYPE_CHANNEL),
+		ext("history", Creator) { }
+
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string &parameter, bool adding)
+	{
+		if (adding)
+		{
+			std::string::size_type colon = parameter.find(':');
+			if (colon == std::string::npos)
+				return MODEACTION_DENY;
+			int len = atoi(parameter.substr(0, colon).c_str());
+			int time = ServerInstance->Duration(parameter.substr(colon+1));
+			if (len <= 0 || time < 0)
+				return MODEACTION_DENY;
+			if (len > maxlines && IS_LOCAL(source))
+				return MODEACTION_DENY;
+			if (len > maxlines)
+				len = maxlines;
+			if (len <= 0)
+				return MODEACTION_DENY;
+			if (parameter == channel->GetModeParameter(this))
+				return MODEACTION_DENY;
+
+			/* Keep what the channel has already, as far as the new length allows */
+			HistoryList* hist = new HistoryList(len, time);
+			HistoryList* old = ext.get(channel);
+			SavedHistory::iterator s = saved.find(channel->name);
+			if (!old && s != saved.end() && s->second->chants == channel->age)
+				old = s->second;
+			if (old)
+			{
+				for (unsigned int n = old->count > hist->maxlen ? old->count - hist->maxlen : 0; n < old->count; n++)
+				{
+					HistoryItem& item = hist->Push();
+					item.ts = old->Get(n).ts;
+					item.line.swap(old->Get(n).line);
+				}
+			}
+			if (s != saved.end())
+			{
+				delete s->second;
+				saved.erase(s);
+			}
+			ext.set(channel, hist);
+			channel->SetModeParam('H', parameter);
+		}
+		else
+		{
+			if (!channel->IsModeSet('H'))
+				return MODEACTION_DENY;
+			ext.unset(channel);
+			channel->SetModeParam('H', "");
+		}
+		return MODEACTION_ALLOW;
+	}
+};
+
+/** A page of /HISTORY which did not fit in its user's sendq */
+struct HistoryCursor
+{
+	std::string chan;
+	std::vector<StoredLine> lines;
+	size_t pos;
+	/** What to ask for to get the page before this one, if there is one */
+	std::string next;
+	HistoryCursor() : pos(0) {}
+};
+
+/** Handle /HISTORY, which pages back through the history store */
+class CommandHistory : public Command
+{
+	std::vector<std::string> paused;
+
+	/** Send lines from the cursor until the user's sendq reaches its watermark.
+	 * @return True if the page was finished
+	 */
+	bool Continue(User* user, HistoryCursor* cursor)
+	{
+		LocalUser* lu = IS_LOCAL(user);
+		/* Stop filling once half of the hard sendq is taken, leaving room for everything else */
+		size_t watermark = lu ? lu->MyClass->GetSendqHardMax() / 2 : 0;
+		while (cursor->pos < cursor->lines.size())
+		{
+			if (lu && lu->eh.getSendQSize() >= watermark)
+				return false;
+			user->Write(cursor->lines[cursor->pos++].line);
+		}
+
+		if (!cursor->next.empty())
+			user->WriteServ("NOTICE %s :End of history page; use /HISTORY %s %s for older lines", cursor->chan.c_str(),
+				cursor->chan.c_str(), cursor->next.c_str());
+		else
+			user->WriteServ("NOTICE %s :End of history", cursor->chan.c_str());
+		return true;
+	}
+
+ public:
+	HistoryStore* store;
+	unsigned int pagesize;
+	SimpleExtItem<HistoryCursor> ext;
+
+	CommandHistory(Module* parent) : Command(parent, "HISTORY", 1, 3), store(NULL), pagesize(100), ext("history_cursor", parent)
+	{
+		syntax = "<channel> [<timestamp>] [<lines>]";
+		Penalty = 2;
+	}
+
+	CmdResult Handle(const std::vector<std::string>& parameters, User* user)
+	{
+		Channel* chan = ServerInstance->FindChan(parameters[0]);
+		if ((!chan || !chan->HasUser(user)) && !user->HasPrivPermission("channels/auspex"))
+		{
+			user->WriteNumeric(ERR_NOTONCHANNEL, "%s %s :You're not on that channel!", user->nick.c_str(), parameters[0].c_str());
+			return CMD_FAILURE;
+		}
+
+		/* Without auspex, what was said before the channel was last created is not shown */
+		time_t since = 0;
+		if (!user->HasPrivPermission("channels/auspex"))
+			since = chan->age;
+
+		/* A page is of the lines from before a time or, given "<time>:<n>", of
+		 * those up to and including it less the newest n, which a page had already
+		 */
+		time_t until = parameters.size() > 1 ? atol(parameters[1].c_str()) : 0;
+		unsigned int skip = 0;
+		std::string::size_type colon = parameters.size() > 1 ? parameters[1].find(':') : std::string::npos;
+		if (until <= 0)
+			until = ServerInstance->Time();
+		else if (colon == std::string::npos)
+			until--;
+		else
+			skip = atoi(parameters[1].c_str() + colon + 1);
+		unsigned int count = parameters.size() > 2 ? atoi(parameters[2].c_str()) : 0;
+		if (!count || count > pagesize)
+			count = pagesize;
+
+		/* A new page replaces any that is still being sent, keeping its place in the queue */
+		bool queued = (ext.get(user) != NULL);
+		HistoryCursor* cursor = new HistoryCursor;
+		ext.set(user, cursor);
+		cursor->chan = chan ? chan->name : parameters[0];
+		store->Get(cursor->chan, since, until, skip, count, cursor->lines);
+		if (cursor->lines.size() == count)
+		{
+			/* The next page carries on from the oldest second on this one, after the lines from it already sent */
+			time_t oldest = cursor->lines.back().ts;
+			unsigned int sent = (oldest == until ? skip : 0);
+			for (std::vector<StoredLine>::reverse_iterator i = cursor->lines.rbegin(); i != cursor->lines.rend() && i->ts == oldest; ++i)
+				sent++;
+			cursor->next = ConvToStr(oldest) + ":" + ConvToStr(sent);
+		}
+		std::reverse(cursor->lines.begin(), cursor->lines.end());
+
+		user->WriteServ("NOTICE %s :Replaying %lu lines of history from up to %lu", cursor->chan.c_str(),
+			(unsigned long)cursor->lines.size(), (unsigned long)until);
+		if (Continue(user, cursor))
+			ext.unset(user);
+		else if (!queued)
+			paused.push_back(user->uuid);
+		return CMD_SUCCESS;
+	}
+
+	/** Continue every paused page whose owner has room in their sendq */
+	void ResumeAll()
+	{
+		std::vector<std::string>::iterator i = paused.begin();
+		while (i != paused.end())
+		{
+			User* user = ServerInstance->FindUUID(*i);
+			HistoryCursor* cursor = user ? ext.get(user) : NULL;
+
+			if (!cursor)
+			{
+				i = paused.erase(i);
+			}
+			else if (Continue(user, cursor))
+			{
+				ext.unset(user);
+				i = paused.erase(i);
+			}
+			else
+				++i;
+		}
+	}
+};
+
+/** Flushes the history store every few seconds, removes what has expired
+ * from it once a minute, and continues paused pages of /HISTORY.
+ */
+class HistoryTimer : public Timer
+{
+	CommandHistory& cmd;
+	unsigned int ticks;
+ public:
+	unsigned int syncdelay;
+
+	HistoryTimer(CommandHistory& Cmd) : Timer(1, ServerInstance->Time(), true), cmd(Cmd), ticks(0), syncdelay(2)
+	{
+	}
+
+	void Tick(time_t)
+	{
+		ticks++;
+		if (syncdelay && !(ticks % syncdelay))
+			cmd.store->Flush(true);
+		if (!(ticks % 60))
+			cmd.store->Expire();
+		cmd.ResumeAll();
+	}
+};
+
+class ModuleChanHistory : public Module
+{
+	HistoryMode m;
+	std::string savefile;
+	CommandHistory cmd;
+	HistoryTimer* timer;
+
+	/** Read history saved by a previous run. Each record is a 32-bit length
+	 * followed by "<ts> <maxtime> <channel ts> <channel> <line>"; a record cut
+	 * short ends the file.
+	 */
+	void Load()
+	{
+		if (m.maxlines <= 0)
+			return;
+		int fd = open(savefile.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat sb;
+		if (fstat(fd, &sb) < 0 || !sb.st_size)
+		{
+			close(fd);
+			return;
+		}
+		size_t size = sb.st_size;
+#ifndef WINDOWS
+		char* data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+			return;
+#else
+		std::vector<char> buffer(size);
+		size = read(fd, &buffer[0], size);
+		close(fd);
+		char* data = &buffer[0];
+#endif
+
+		size_t pos = 0;
+		unsigned int records = 0;
+		while (pos + sizeof(uint32_t) <= size)
+		{
+			uint32_t len;
+			memcpy(&len, data + pos, sizeof(len));
+			pos += sizeof(len);
+			if (len > size - pos)
+				break;
+			std::string record(data + pos, len);
+			pos += len;
+
+			irc::spacesepstream fields(record);
+			std::string ts, maxtime, chants, name;
+			if (!fields.GetToken(ts) || !fields.GetToken(maxtime) || !fields.GetToken(chants) || !fields.GetToken(name))
+				break;
+			/* Records from before channel TSes were saved can't be matched to a channel */
+			if (chants.find_first_not_of("0123456789") != std::string::npos)
+				continue;
+			HistoryList*& list = m.saved[name];
+			if (!list)
+			{
+				list = new HistoryList(m.maxlines, atoi(maxtime.c_str()));
+				list->chants = atol(chants.c_str());
+			}
+			HistoryItem& item = list->Push();
+			item.ts = atol(ts.c_str());
+			item.line = fields.GetRemaining();
+			records++;
+		}
+
+#ifndef WINDOWS
+		munmap(data, size);
+#endif
+		ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Read %u lines of history for %u channels from %s",
+			records, (unsigned int)m.saved.size(), savefile.c_str());
+	}
+
+	void Save(FILE* f, const std::string& name, HistoryList* list)
+	{
+		time_t mintime = 0;
+		if (list->maxtime)
+			mintime = ServerInstance->Time() - list->maxtime;
+		for (unsigned int n = 0; n < list->count; n++)
+		{
+			HistoryItem& item = list->Get(n);
+			if (item.ts < mintime)
+				continue;
+			std::string record = ConvToStr(item.ts) + " " + ConvToStr(list->maxtime) + " " + ConvToStr(list->chants) + " " + name + " " + item.line;
+			uint32_t len = record.length();
+			fwrite(&len, sizeof(len), 1, f);
+			fwrite(record.data(), 1, len, f);
+		}
+	}
+
+	/** Hold on to a channel's history after the channel or this module goes,
+	 * so that it can be saved
+	 */
+	void Keep(Channel* chan)
+	{
+		HistoryList* hist = m.ext.get(chan);
+		if (!hist || savefile.empty())
+			return;
+		HistoryList*& saved = m.saved[chan->name];
+		delete saved;
+		saved = new HistoryList(*hist);
+		saved->chants = chan->age;
+	}
+
+	/** Write out the history kept in saved, leaving out lines which are too old to replay */
+	void Save()
+	{
+		std::string tmp = savefile + ".tmp";
+		FILE* f = fopen(tmp.c_str(), "wb");
+		if (!f)
+		{
+			ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot write channel history to %s: %s", tmp.c_str(), strerror(errno));
+			return;
+		}
+		for (SavedHistory::iterator s = m.saved.begin(); s != m.saved.end(); ++s)
+			Save(f, s->first, s->second);
+		bool ok = !ferror(f);
+		if (fclose(f) || !ok || rename(tmp.c_str(), savefile.c_str()) < 0)
+		{
+			ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot write channel history to %s: %s", savefile.c_str(), strerror(errno));
+			unlink(tmp.c_str());
+		}
+	}
+
+ public:
+	ModuleChanHistory() : m(this), cmd(this), timer(NULL)
+	{
+	}
+
+	void init()
+	{
+		ServerInstance->Modules->AddService(m);
+
+		Implementation eventlist[] = { I_OnPostJoin, I_OnUserMessage, I_OnRehash, I_OnChannelDelete };
+		ServerInstance->Modules->Attach(eventlist, this, 4);
+		OnRehash(NULL);
+		if (!savefile.empty())
+			Load();
+
+		/* The store's directory can only be set when the module is loaded */
+		ConfigTag* tag = ServerInstance->Config->ConfValue("chanhistory");
+		std::string dir = tag->getString("store");
+		if (!dir.empty())
+		{
+			cmd.store = new HistoryStore(dir, tag->getInt("storegroups", 16));
+			cmd.store->Open();
+			ServerInstance->Modules->AddService(cmd);
+			ServerInstance->Modules->AddService(cmd.ext);
+			timer = new HistoryTimer(cmd);
+			ServerInstance->Timers->AddTimer(timer);
+			OnRehash(NULL);
+		}
+	}
+
+	void OnRehash(User*)
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("chanhistory");
+		m.maxlines = tag->getInt("maxlines", 50);
+		if (savefile.empty())
+			savefile = tag->getString("savefile");
+		if (cmd.store)
+		{
+			cmd.store->maxage = ServerInstance->Duration(tag->getString("storemaxage"));
+			cmd.store->maxsize = tag->getInt("storemaxsize", 0);
+			cmd.pagesize = std::max(1L, tag->getInt("pagesize", 100));
+		}
+		if (timer)
+			timer->syncdelay = tag->getInt("storesyncdelay", 2);
+	}
+
+	~ModuleChanHistory()
+	{
+		if (!savefile.empty())
+			Save();
+		for (SavedHistory::iterator s = m.saved.begin(); s != m.saved.end(); ++s)
+			delete s->second;
+		ServerInstance->Modes->DelMode(&m);
+		if (timer)
+			ServerInstance->Timers->DelTimer(timer);
+		delete cmd.store;
+	}
+
+	void OnCleanup(int target_type, void* item)
+	{
+		/* Being unloaded: keep each channel's history to be saved */
+		if (target_type == TYPE_CHANNEL)
+			Keep((Channel*)item);
+	}
+
+	void OnChannelDelete(Channel* chan)
+	{
+		Keep(chan);
+	}
+
+	void OnUserMessage(User* user,void* dest,int target_type, const std::string &text, char status, const CUList&)
+	{
+		if (target_type == TYPE_CHANNEL && status == 0)
+		{
+			Channel* c = (Channel*)dest;
+			HistoryList* list = m.ext.get(c);
+			if (list)
+			{
+				HistoryItem& item = list->Push();
+				item.ts = ServerInstance->Time();
+				item.line.assign(":").append(user->GetFullHost()).append(" PRIVMSG ").append(c->name).append(" :").append(text);
+				if (item.line.length() > MAXBUF - 1)
+					item.line.resize(MAXBUF - 1);
+				if (cmd.store)
+					cmd.store->Add(c->name, item.ts, item.line);
+			}
+		}
+	}
+
+	void OnPostJoin(Membership* memb)
+	{
+		LocalUser* user = IS_LOCAL(memb->user);
+		HistoryList* list = m.ext.get(memb->chan);
+		if (!list || !user)
+			return;
+		time_t mintime = 0;
+		if (list->maxtime)
+			mintime = ServerInstance->Time() - list->maxtime;
+		user->WriteServ("NOTICE %s :Replaying up to %d lines of pre-join history spanning up to %d seconds",
+			memb->chan->name.c_str(), list->maxlen, list->maxtime);
+
+		/* Queue the whole replay as one write */
+		std::string block;
+		unsigned int lines = 0;
+		for (unsigned int n = 0; n < list->count; n++)
+		{
+			HistoryItem& item = list->Get(n);
+			if (item.ts >= mintime)
+			{
+				block.append(item.line).append("\r\n");
+				lines++;
+			}
+		}
+		if (lines)
+			user->WriteLines(block, lines);
+	}
+
+	Version GetVersion()
+	{
+		return Version("Provides channel history replayed on join", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleChanHistory)
@@ -0,0 +1,549 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include <dirent.h>
+#include <sys/mman.h>
+#include "threadengine.h"
+#include "store.h"
+
+/** A channel's index keeps the position of one in this many of its records */
+static const unsigned int INDEX_INTERVAL = 64;
+
+/** Lines are written to a group's segment once this much is waiting */
+static const size_t FLUSH_SIZE = 65536;
+
+struct RecordHeader
+{
+	uint32_t len;
+	uint32_t sum;
+	uint64_t prev;
+	int64_t ts;
+};
+
+/** FNV-1a over everything in a record after its length and checksum */
+static uint32_t Checksum(const RecordHeader& hdr, const char* data)
+{
+	uint32_t sum = 2166136261U;
+	const unsigned char* p = (const unsigned char*)&hdr.prev;
+	for (size_t i = 0; i < sizeof(hdr.prev) + sizeof(hdr.ts); i++)
+		sum = (sum ^ p[i]) * 16777619U;
+	p = (const unsigned char*)data;
+	for (uint32_t i = 0; i < hdr.len; i++)
+		sum = (sum ^ p[i]) * 16777619U;
+	return sum;
+}
+
+/** Syncs history segments to disk, so that waiting on a slow disk holds up
+ * only this thread. The store hands it duplicates of its descriptors, which
+ * it closes once they are synced.
+ */
+class HistorySyncThread : public QueuedThread
+{
+	void Sync(std::vector<int>& batch)
+	{
+		for (std::vector<int>::iterator i = batch.begin(); i != batch.end(); ++i)
+		{
+			fdatasync(*i);
+			close(*i);
+		}
+
+		this->LockQueue();
+		outstanding -= batch.size();
+		this->UnlockQueue();
+		batch.clear();
+	}
+
+ public:
+	/** Descriptors waiting to be synced, guarded by the queue lock */
+	std::vector<int> fds;
+
+	/** Descriptors queued and not yet synced, guarded by the queue lock */
+	size_t outstanding;
+
+	HistorySyncThread() : outstanding(0) { }
+
+	/** Queue a descriptor to be synced and closed, called on the main thread */
+	void Queue(int fd)
+	{
+		this->LockQueue();
+		fds.push_back(fd);
+		outstanding++;
+		this->UnlockQueueWakeup();
+	}
+
+	/** Check whether syncs queued earlier have not finished yet */
+	bool Busy()
+	{
+		this->LockQueue();
+		bool busy = outstanding != 0;
+		this->UnlockQueue();
+		return busy;
+	}
+
+	void Run()
+	{
+		std::vector<int> batch;
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (fds.empty())
+				this->WaitForQueue();
+			batch.swap(fds);
+			this->UnlockQueue();
+
+			Sync(batch);
+
+			this->LockQueue();
+		}
+		/* Anything queued before the exit flag was set still gets synced */
+		batch.swap(fds);
+		this->UnlockQueue();
+		Sync(batch);
+	}
+};
+
+HistorySegment::HistorySegment(uint32_t Seq, const std::string& Path)
+	: map(NULL), mapped(0), seq(Seq), path(Path), size(0), oldest(0), newest(0)
+{
+}
+
+HistorySegment::~HistorySegment()
+{
+	if (map)
+		munmap(map, mapped);
+}
+
+const char* HistorySegment::Map(size_t want)
+{
+	if (want <= mapped)
+		return map;
+	if (map)
+		munmap(map, mapped);
+	map = NULL;
+	mapped = 0;
+
+	/* Never map past the end of the file: touching those pages is SIGBUS */
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat sb;
+	size_t len = fstat(fd, &sb) < 0 ? 0 : std::min(size, (size_t)sb.st_size);
+	if (want > len)
+	{
+		close(fd);
+		return NULL;
+	}
+	void* m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return NULL;
+	map = (char*)m;
+	mapped = len;
+	return map;
+}
+
+HistoryStore::HistoryStore(const std::string& Dir, unsigned int numgroups)
+	: dir(Dir), total(0), syncer(new HistorySyncThread), maxage(0), maxsize(0), segsize(16 * 1024 * 1024)
+{
+	ServerInstance->Threads->Start(syncer);
+
+	/* The number of groups decides which group a channel's lines are in, so
+	 * once there is a store the number it was made with is kept.
+	 */
+	std::string groupfile = dir + "/groups";
+	FILE* f = fopen(groupfile.c_str(), "r");
+	if (f)
+	{
+		unsigned int n;
+		if (fscanf(f, "%u", &n) == 1 && n)
+			numgroups = n;
+		fclose(f);
+	}
+	else
+	{
+		mkdir(dir.c_str(), 0700);
+		f = fopen(groupfile.c_str(), "w");
+		if (f)
+		{
+			fprintf(f, "%u\n", numgroups);
+			fclose(f);
+		}
+	}
+	for (unsigned int i = 0; i < numgroups; i++)
+		groups.push_back(new HistoryGroup(i));
+}
+
+HistoryStore::~HistoryStore()
+{
+	/* join() finishes the syncs already queued; what is left is synced here */
+	syncer->join();
+	delete syncer;
+	for (std::vector<HistoryGroup*>::iterator g = groups.begin(); g != groups.end(); ++g)
+	{
+		FlushGroup(*g);
+		if ((*g)->fd >= 0)
+		{
+			if ((*g)->dirty)
+				fdatasync((*g)->fd);
+			close((*g)->fd);
+		}
+		for (std::deque<HistorySegment*>::iterator s = (*g)->segments.begin(); s != (*g)->segments.end(); ++s)
+			delete *s;
+		delete *g;
+	}
+}
+
+HistoryGroup* HistoryStore::GetGroup(const std::string& chan)
+{
+	uint32_t hash = 2166136261U;
+	for (std::string::const_iterator i = chan.begin(); i != chan.end(); ++i)
+		hash = (hash ^ national_case_insensitive_map[(unsigned char)*i]) * 16777619U;
+	return groups[hash % groups.size()];
+}
+
+HistorySegment* HistoryStore::FindSegment(HistoryGroup* group, uint32_t seq)
+{
+	/* Sequence numbers in a group run on from each other */
+	if (group->segments.empty() || seq < group->segments.front()->seq)
+		return NULL;
+	size_t n = seq - group->segments.front()->seq;
+	if (n >= group->segments.size() || group->segments[n]->seq != seq)
+		return NULL;
+	return group->segments[n];
+}
+
+void HistoryStore::Open()
+{
+	DIR* d = opendir(dir.c_str());
+	if (!d)
+	{
+		ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot open history store %s: %s", dir.c_str(), strerror(errno));
+		return;
+	}
+	std::vector<std::pair<unsigned int, uint32_t> > found;
+	while (dirent* entry = readdir(d))
+	{
+		unsigned int group;
+		uint32_t seq;
+		char end;
+		if (sscanf(entry->d_name, "%u-%u.his%c", &group, &seq, &end) == 3 && end == 't' && group < groups.size())
+			found.push_back(std::make_pair(group, seq));
+	}
+	closedir(d);
+
+	/* Oldest first, so each channel's index is built in the order it was written */
+	std::sort(found.begin(), found.end());
+	for (std::vector<std::pair<unsigned int, uint32_t> >::iterator i = found.begin(); i != found.end(); ++i)
+	{
+		HistoryGroup* group = groups[i->first];
+		HistorySegment* seg = new HistorySegment(i->second, dir + "/" + ConvToStr(i->first) + "-" + ConvToStr(i->second) + ".hist");
+		group->segments.push_back(seg);
+		Scan(group, seg);
+	}
+
+	/* Keep appending to the newest segment of each group */
+	for (std::vector<HistoryGroup*>::iterator g = groups.begin(); g != groups.end(); ++g)
+	{
+		if (!(*g)->segments.empty())
+			(*g)->fd = open((*g)->segments.back()->path.c_str(), O_WRONLY | O_APPEND);
+	}
+
+	ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Opened history store %s: %lu segments holding %lu KB for %lu channels",
+		dir.c_str(), (unsigned long)found.size(), (unsigned long)(total / 1024), (unsigned long)channels.size());
+}
+
+void HistoryStore::Scan(HistoryGroup* group, HistorySegment* seg)
+{
+	struct stat sb;
+	if (stat(seg->path.c_str(), &sb) < 0)
+		return;
+	seg->size = sb.st_size;
+	const char* data = seg->size ? seg->Map(seg->size) : NULL;
+
+	size_t pos = 0;
+	while (data && pos + sizeof(RecordHeader) <= seg->size)
+	{
+		RecordHeader hdr;
+		memcpy(&hdr, data + pos, sizeof(hdr));
+		const char* payload = data + pos + sizeof(hdr);
+		if (hdr.len > seg->size - pos - sizeof(hdr) || hdr.sum != Checksum(hdr, payload))
+			break;
+
+		const char* space = (const char*)memchr(payload, ' ', hdr.len);
+		if (space)
+			Index(irc::string(payload, space - payload), hdr.ts, ((HistoryPos)seg->seq << 32) | pos);
+		if (!seg->oldest)
+			seg->oldest = hdr.ts;
+		seg->newest = hdr.ts;
+		pos += sizeof(hdr) + hdr.len;
+	}
+
+	if (pos < seg->size)
+	{
+		/* Whatever follows the last good record was cut short by a crash */
+		ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Dropping %lu bytes of incomplete history from the end of %s",
+			(unsigned long)(seg->size - pos), seg->path.c_str());
+		if (truncate(seg->path.c_str(), pos) < 0)
+			ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot truncate %s: %s", seg->path.c_str(), strerror(errno));
+		seg->size = pos;
+	}
+	total += seg->size;
+}
+
+void HistoryStore::Index(const irc::string& chan, time_t ts, HistoryPos pos)
+{
+	HistoryIndex& index = channels[chan];
+	index.head = pos;
+	index.headts = ts;
+	if (++index.sincemark >= INDEX_INTERVAL)
+	{
+		index.marks.push_back(std::make_pair(ts, pos));
+		index.sincemark = 0;
+	}
+}
+
+void HistoryStore::OpenSegment(HistoryGroup* group, uint32_t seq)
+{
+	if (group->fd >= 0)
+	{
+		/* The finished segment is handed to the sync thread to close */
+		FlushGroup(group);
+		if (group->dirty)
+			syncer->Queue(group->fd);
+		else
+			close(group->fd);
+	}
+	group->dirty = false;
+	HistorySegment* seg = new HistorySegment(seq, dir + "/" + ConvToStr(group->id) + "-" + ConvToStr(seq) + ".hist");
+	group->segments.push_back(seg);
+	group->fd = open(seg->path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0600);
+	if (group->fd < 0)
+		ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot create %s: %s", seg->path.c_str(), strerror(errno));
+}
+
+void HistoryStore::Add(const std::string& chan, time_t ts, const std::string& line)
+{
+	HistoryGroup* group = GetGroup(chan);
+	HistorySegment* seg = group->segments.empty() ? NULL : group->segments.back();
+
+	/* Start a new segment when this one is full, or holds enough of the time
+	 * lines are kept for that expiring it whole is precise enough.
+	 */
+	if (!seg || seg->size >= segsize || (maxage && seg->size && seg->oldest + maxage / 4 < ts))
+	{
+		OpenSegment(group, seg ? seg->seq + 1 : 0);
+		seg = group->segments.back();
+	}
+
+	irc::string name(chan.c_str());
+	std::map<irc::string, HistoryIndex>::iterator index = channels.find(name);
+
+	RecordHeader hdr;
+	hdr.len = chan.length() + 1 + line.length();
+	hdr.prev = index == channels.end() ? NO_HISTORY : index->second.head;
+	hdr.ts = ts;
+	std::string payload;
+	payload.reserve(hdr.len);
+	payload.append(chan).append(1, ' ').append(line);
+	hdr.sum = Checksum(hdr, payload.data());
+
+	HistoryPos pos = ((HistoryPos)seg->seq << 32) | seg->size;
+	group->pending.append((const char*)&hdr, sizeof(hdr)).append(payload);
+	seg->size += sizeof(hdr) + hdr.len;
+	total += sizeof(hdr) + hdr.len;
+	if (!seg->oldest)
+		seg->oldest = ts;
+	seg->newest = ts;
+	Index(name, ts, pos);
+
+	if (group->pending.length() >= FLUSH_SIZE)
+		FlushGroup(group);
+}
+
+void HistoryStore::FlushGroup(HistoryGroup* group)
+{
+	if (group->pending.empty())
+		return;
+	/* Everything pending belongs at the end of the newest segment */
+	HistorySegment* seg = group->segments.back();
+	size_t start = seg->size - group->pending.length();
+	const char* data = group->pending.data();
+	size_t left = group->pending.length();
+	while (left)
+	{
+		ssize_t n = group->fd < 0 ? -1 : write(group->fd, data, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			/* Drop the whole batch, so the next records go where the segment
+			 * says they are. The index may still point at the lost records;
+			 * reads stop at the end of the file, and at any record which
+			 * fails its checksum or belongs to another channel.
+			 */
+			ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot write channel history to %s: %s",
+				seg->path.c_str(), group->fd < 0 ? "not open" : strerror(errno));
+			if (group->fd >= 0 && ftruncate(group->fd, start) < 0)
+				ServerInstance->Logs->Log("m_chanhistory", DEFAULT, "Cannot truncate %s: %s", seg->path.c_str(), strerror(errno));
+			total -= seg->size - start;
+			seg->size = start;
+			break;
+		}
+		data += n;
+		left -= n;
+	}
+	group->pending.clear();
+	group->dirty = true;
+}
+
+void HistoryStore::Flush(bool sync)
+{
+	/* Rather than queue up behind a slow disk, leave the groups dirty for next time */
+	if (sync && syncer->Busy())
+		sync = false;
+
+	for (std::vector<HistoryGroup*>::iterator g = groups.begin(); g != groups.end(); ++g)
+	{
+		FlushGroup(*g);
+		if (sync && (*g)->dirty && (*g)->fd >= 0)
+		{
+			int copy = dup((*g)->fd);
+			if (copy >= 0)
+			{
+				syncer->Queue(copy);
+				(*g)->dirty = false;
+			}
+		}
+	}
+}
+
+void HistoryStore::DropSegment(HistoryGroup* group)
+{
+	HistorySegment* seg = group->segments.front();
+	total -= seg->size;
+	unlink(seg->path.c_str());
+	delete seg;
+	group->segments.pop_front();
+}
+
+void HistoryStore::Expire()
+{
+	bool dropped = false;
+	time_t cutoff = ServerInstance->Time() - maxage;
+
+	/* The segment being written to is never removed */
+	for (std::vector<HistoryGroup*>::iterator g = groups.begin(); g != groups.end(); ++g)
+	{
+		while (maxage && (*g)->segments.size() > 1 && (*g)->segments.front()->newest < cutoff)
+		{
+			DropSegment(*g);
+			dropped = true;
+		}
+	}
+
+	while (maxsize && total > maxsize)
+	{
+		HistoryGroup* oldest = NULL;
+		for (std::vector<HistoryGroup*>::iterator g = groups.begin(); g != groups.end(); ++g)
+		{
+			if ((*g)->segments.size() > 1 && (!oldest || (*g)->segments.front()->newest < oldest->segments.front()->newest))
+				oldest = *g;
+		}
+		if (!oldest)
+			break;
+		DropSegment(oldest);
+		dropped = true;
+	}
+
+	if (!dropped)
+		return;
+
+	/* Forget positions in the segments which have gone */
+	std::map<irc::string, HistoryIndex>::iterator i = channels.begin();
+	while (i != channels.end())
+	{
+		HistoryGroup* group = GetGroup(i->first.c_str());
+		HistoryIndex& index = i->second;
+		if (!FindSegment(group, index.head >> 32))
+		{
+			channels.erase(i++);
+			continue;
+		}
+		std::vector<std::pair<time_t, HistoryPos> >::iterator keep = index.marks.begin();
+		while (keep != index.marks.end() && !FindSegment(group, keep->second >> 32))
+			++keep;
+		index.marks.erase(index.marks.begin(), keep);
+		++i;
+	}
+}
+
+void HistoryStore::Get(const std::string& chan, time_t since, time_t until, unsigned int skip, unsigned int count, std::vector<StoredLine>& out)
+{
+	std::map<irc::string, HistoryIndex>::iterator index = channels.find(chan.c_str());
+	if (index == channels.end())
+		return;
+	HistoryGroup* group = GetGroup(chan);
+	FlushGroup(group);
+
+	/* Start from the first marked record after the time, so that only
+	 * the records since the mark before it have to be skipped.
+	 */
+	HistoryPos pos = index->second.head;
+	if (until < index->second.headts)
+	{
+		std::vector<std::pair<time_t, HistoryPos> >& marks = index->second.marks;
+		std::vector<std::pair<time_t, HistoryPos> >::iterator mark = std::lower_bound(marks.begin(), marks.end(), std::make_pair(until + 1, (HistoryPos)0));
+		if (mark != marks.end())
+			pos = mark->second;
+	}
+
+	while (pos != NO_HISTORY && out.size() < count)
+	{
+		HistorySegment* seg = FindSegment(group, pos >> 32);
+		if (!seg)
+			break;
+		size_t offset = pos & 0xFFFFFFFF;
+		const char* data = seg->Map(offset + sizeof(RecordHeader));
+		if (!data)
+			break;
+		RecordHeader hdr;
+		memcpy(&hdr, data + offset, sizeof(hdr));
+		data = seg->Map(offset + sizeof(hdr) + hdr.len);
+		if (!data)
+			break;
+		const char* payload = data + offset + sizeof(hdr);
+		if (hdr.sum != Checksum(hdr, payload))
+			break;
+
+		/* A record written after a failed write may sit where a lost one was */
+		const char* space = (const char*)memchr(payload, ' ', hdr.len);
+		if (!space || irc::string(payload, space - payload) != index->first)
+			break;
+
+		if (hdr.ts < since)
+			break;
+		if (hdr.ts <= until)
+		{
+			if (skip)
+				skip--;
+			else
+			{
+				out.push_back(StoredLine());
+				out.back().ts = hdr.ts;
+				out.back().line.assign(space + 1, payload + hdr.len);
+			}
+		}
+		pos = hdr.prev;
+	}
+}
@@ -0,0 +1,146 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __CHANHISTORY_STORE_H__
+#define __CHANHISTORY_STORE_H__
+
+/** Where a record is: the sequence number of its segment in the high 32 bits,
+ * and its offset within the segment in the low 32 bits.
+ */
+typedef uint64_t HistoryPos;
+
+/** The end of a channel's chain of records */
+static const HistoryPos NO_HISTORY = ~(HistoryPos)0;
+
+/** A line read back from the store */
+struct StoredLine
+{
+	time_t ts;
+	std::string line;
+};
+
+/** Where to find a channel's lines. Each record points back to the one before
+ * it for the same channel; one in every INDEX_INTERVAL records is also kept
+ * here with its time, so a search by time only has to follow a short chain.
+ */
+struct HistoryIndex
+{
+	HistoryPos head;
+	time_t headts;
+	unsigned int sincemark;
+	std::vector<std::pair<time_t, HistoryPos> > marks;
+	HistoryIndex() : head(NO_HISTORY), headts(0), sincemark(0) {}
+};
+
+/** One append-only file of records, read through a memory map */
+class HistorySegment
+{
+	char* map;
+	size_t mapped;
+ public:
+	const uint32_t seq;
+	const std::string path;
+	/** Bytes in the file, including records not yet flushed to it */
+	size_t size;
+	time_t oldest, newest;
+
+	HistorySegment(uint32_t Seq, const std::string& Path);
+	~HistorySegment();
+
+	/** Map the file as far as it has been written, returning NULL if that
+	 * fails or the file is shorter than want bytes
+	 */
+	const char* Map(size_t want);
+};
+
+class HistorySyncThread;
+
+/** The segments holding the records of a share of the channels. Only the
+ * newest segment of each group is written to, so the store needs one open
+ * file per group however many channels it holds.
+ */
+struct HistoryGroup
+{
+	unsigned int id;
+	std::deque<HistorySegment*> segments;
+	int fd;
+	std::string pending;
+	bool dirty;
+	HistoryGroup(unsigned int Id) : id(Id), fd(-1), dirty(false) {}
+};
+
+/** Keeps the lines of channels on disk, in append-only segment files spread
+ * over a fixed number of groups. A record is a 32-bit length, a checksum,
+ * the position of the channel's previous record, the time, and the channel
+ * and line; a record which is cut short or fails its checksum marks the end
+ * of a segment, so what a crash leaves half written is dropped on startup.
+ */
+class HistoryStore
+{
+	std::string dir;
+	std::vector<HistoryGroup*> groups;
+	std::map<irc::string, HistoryIndex> channels;
+	/** Bytes in all segments */
+	uint64_t total;
+	/** Syncs written segments to disk off the main thread */
+	HistorySyncThread* syncer;
+
+	HistoryGroup* GetGroup(const std::string& chan);
+	HistorySegment* FindSegment(HistoryGroup* group, uint32_t seq);
+	void OpenSegment(HistoryGroup* group, uint32_t seq);
+	void Scan(HistoryGroup* group, HistorySegment* seg);
+	void Index(const irc::string& chan, time_t ts, HistoryPos pos);
+	void FlushGroup(HistoryGroup* group);
+	void DropSegment(HistoryGroup* group);
+
+ public:
+	/** Lines older than this many seconds are removed, if not zero */
+	time_t maxage;
+	/** Segments are removed, oldest first, to keep the store under this size, if not zero */
+	uint64_t maxsize;
+	/** A new segment is started once one reaches this size */
+	size_t segsize;
+
+	HistoryStore(const std::string& Dir, unsigned int numgroups);
+	~HistoryStore();
+
+	/** Read the segments already in the store's directory */
+	void Open();
+
+	/** Store a line. It is written out by the next Flush. */
+	void Add(const std::string& chan, time_t ts, const std::string& line);
+
+	/** Write out stored lines, and if sync is set have them synced to disk
+	 * in the background, unless the last sync is still going
+	 */
+	void Flush(bool sync);
+
+	/** Remove segments which are too old, or which take the store over its size */
+	void Expire();
+
+	/** Get the lines of a channel from up to a time, newest first
+	 * @param chan The channel
+	 * @param since Only lines from this time or later are returned
+	 * @param until Only lines from this time or earlier are returned
+	 * @param skip How many of the newest of those lines to leave out
+	 * @param count The most lines to return
+	 * @param out Where to put the lines
+	 */
+	void Get(const std::string& chan, time_t since, time_t until, unsigned int skip, unsigned int count, std::vector<StoredLine>& out);
+
+	/** Get the number of channels and bytes in the store */
+	size_t ChannelCount() { return channels.size(); }
+	uint64_t Size() { return total; }
+};
+
+#endif
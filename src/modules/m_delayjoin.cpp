@@ -36,17 +36,18 @@ class ModuleDelayJoin : public Module
 	{
 		if (!ServerInstance->Modes->AddMode(&djm))
 			throw ModuleException("Could not add new modes!");
-		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnBuildNeighborList, I_OnNamesListItem, I_OnText, I_OnRawMode };
-		ServerInstance->Modules->Attach(eventlist, this, 7);
+		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnNeighborChannel, I_OnNamesListItem, I_OnNamesListStyle, I_OnText, I_OnRawMode };
+		ServerInstance->Modules->Attach(eventlist, this, 8);
 	}
 	~ModuleDelayJoin();
 	Version GetVersion();
 	void OnNamesListItem(User* issuer, Membership*, std::string &prefixes, std::string &nick);
+	ModResult OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style);
 	void OnUserJoin(Membership*, bool, bool, CUList&);
 	void CleanUser(User* user);
 	void OnUserPart(Membership*, std::string &partmessage, CUList&);
 	void OnUserKick(User* source, Membership*, const std::string &reason, CUList&);
-	void OnBuildNeighborList(User* source, UserChanList &include, std::map<User*,bool> &exception);
+	ModResult OnNeighborChannel(Membership* memb);
 	void OnText(User* user, void* dest, int target_type, const std::string &text, char status, CUList &exempt_list);
 	ModResult OnRawMode(User* user, Channel* channel, const char mode, const std::string &param, bool adding, int pcnt);
 };
@@ -93,6 +94,12 @@ void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::strin
 		nick.clear();
 }
 
+ModResult ModuleDelayJoin::OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style)
+{
+	/* Hidden users can only be left out one at a time, but -D shows them all */
+	return chan->IsModeSet('D') ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+}
+
 static void populate(CUList& except, Membership* memb)
 {
 	const UserMembList* users = memb->chan->GetUsers();
@@ -125,16 +132,9 @@ void ModuleDelayJoin::OnUserKick(User* source, Membership* memb, const std::stri
 		populate(except, memb);
 }
 
-void ModuleDelayJoin::OnBuildNeighborList(User* source, UserChanList &include, std::map<User*,bool> &exception)
+ModResult ModuleDelayJoin::OnNeighborChannel(Membership* memb)
 {
-	UCListIter i = include.begin();
-	while (i != include.end())
-	{
-		Channel* c = *i++;
-		Membership* memb = c->GetUser(source);
-		if (memb && unjoined.get(memb))
-			include.erase(c);
-	}
+	return unjoined.get(memb) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 }
 
 void ModuleDelayJoin::OnText(User* user, void* dest, int target_type, const std::string &text, char status, CUList &exempt_list)
@@ -57,6 +57,17 @@ class ModuleHttpStats : public Module
 		return ret;
 	}
 
+	/** Write out a profiler histogram, with times in microseconds */
+	void DumpTimes(std::stringstream& data, const Profiler::Histogram& hist, double scale)
+	{
+		data << "<calls>" << hist.count << "</calls><totalusecs>" << (uint64_t)(hist.total / scale) << "</totalusecs>"
+			<< "<maxusecs>" << (uint64_t)(hist.max / scale) << "</maxusecs><histogram>";
+		for (unsigned int i = 0; i < Profiler::Histogram::BUCKETS; i++)
+			if (hist.buckets[i])
+				data << "<bucket below=\"" << (((uint64_t)1 << i) / scale) << "\">" << hist.buckets[i] << "</bucket>";
+		data << "</histogram>";
+	}
+
 	void DumpMeta(std::stringstream& data, Extensible* ext)
 	{
 		data << "<metadata>";
@@ -202,7 +213,32 @@ class ModuleHttpStats : public Module
 					data << "</server>";
 				}
 
-				data << "</serverlist></inspircdstats>";
+				data << "</serverlist>";
+
+				if (Profiler::enabled)
+				{
+					double scale = ServerInstance->Profile.TicksPerMicrosecond();
+					data << "<profile><commands>";
+					const Profiler::CommandMap& commands = ServerInstance->Profile.GetCommands();
+					for (Profiler::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+					{
+						data << "<command><name>" << Sanitize(i->first) << "</name>";
+						DumpTimes(data, i->second, scale);
+						data << "</command>";
+					}
+					data << "</commands><hooks>";
+					const Profiler::HookMap& hooks = ServerInstance->Profile.GetHooks();
+					for (Profiler::HookMap::const_iterator i = hooks.begin(); i != hooks.end(); ++i)
+					{
+						data << "<hook><module>" << i->first.first->ModuleSourceFile << "</module><name>"
+							<< Profiler::HookName(i->first.second) << "</name>";
+						DumpTimes(data, i->second, scale);
+						data << "</hook>";
+					}
+					data << "</hooks></profile>";
+				}
+
+				data << "</inspircdstats>";
 
 				/* Send the document back to m_httpd */
 				HTTPDocumentResponse response(this, *http, &data, 200);
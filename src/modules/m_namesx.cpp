@@ -22,8 +22,8 @@ class ModuleNamesX : public Module
 	GenericCap cap;
 	ModuleNamesX() : cap(this, "multi-prefix")
 	{
-		Implementation eventlist[] = { I_OnPreCommand, I_OnNamesListItem, I_On005Numeric, I_OnEvent };
-		ServerInstance->Modules->Attach(eventlist, this, 4);
+		Implementation eventlist[] = { I_OnPreCommand, I_OnNamesListItem, I_OnNamesListStyle, I_On005Numeric, I_OnEvent };
+		ServerInstance->Modules->Attach(eventlist, this, 5);
 	}
 
 
@@ -72,6 +72,13 @@ class ModuleNamesX : public Module
 		prefixes = memb->chan->GetAllPrefixChars(memb->user);
 	}
 
+	ModResult OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style)
+	{
+		if (cap.ext.get(issuer))
+			style |= NamesCache::ALLPREFIXES;
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnEvent(Event& ev)
 	{
 		cap.HandleEvent(ev);
@@ -0,0 +1,170 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+
+#include "main.h"
+#include "utils.h"
+#include "treeserver.h"
+#include "treesocket.h"
+#include "burstparser.h"
+
+/* Runs on the parser thread, so this must not touch anything but the job */
+void ParseJob::Parse()
+{
+	std::string::size_type start = 0;
+	std::string::size_type eol;
+	while ((eol = data.find('\n', start)) != std::string::npos)
+	{
+		/* As in TreeSocket::OnDataReady, anything from a '\r' on is dropped */
+		std::string::iterator end = std::find(data.begin() + start, data.begin() + eol, '\r');
+		std::string line(data.begin() + start, end);
+		start = eol + 1;
+
+		lines.push_back(ParsedLine());
+		ParsedLine& parsed = lines.back();
+		if (rawlog)
+			parsed.raw = line;
+
+		if (line.find('\0') != std::string::npos)
+		{
+			parsed.error = "Read null character from socket";
+			break;
+		}
+
+		parsed.error = TreeSocket::Split(line, parsed.prefix, parsed.command, parsed.params);
+		if (!parsed.error.empty() || parsed.command == "COMPRESS")
+			break;
+	}
+	data.erase(0, start);
+}
+
+BurstParser::~BurstParser()
+{
+	for (std::deque<ParseJob*>::iterator i = pending.begin(); i != pending.end(); ++i)
+		delete *i;
+	for (std::deque<ParseJob*>::iterator i = done.begin(); i != done.end(); ++i)
+		delete *i;
+}
+
+void BurstParser::Submit(ParseJob* job)
+{
+	this->LockQueue();
+	pending.push_back(job);
+	this->UnlockQueueWakeup();
+}
+
+void BurstParser::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (pending.empty())
+		{
+			this->WaitForQueue();
+			continue;
+		}
+		ParseJob* job = pending.front();
+		pending.pop_front();
+		this->UnlockQueue();
+
+		job->Parse();
+
+		this->LockQueue();
+		/* Only the first result of a batch needs to wake the main thread */
+		bool wake = done.empty();
+		done.push_back(job);
+		if (wake)
+			NotifyParent();
+	}
+	this->UnlockQueue();
+}
+
+void BurstParser::OnNotify()
+{
+	std::deque<ParseJob*> batch;
+	this->LockQueue();
+	batch.swap(done);
+	this->UnlockQueue();
+
+	for (std::deque<ParseJob*>::iterator i = batch.begin(); i != batch.end(); ++i)
+	{
+		ParseJob* job = *i;
+		if (job->sock)
+			job->sock->OnParsed(job);
+		delete job;
+	}
+}
+
+bool TreeSocket::UseBurstParser()
+{
+	return Utils->ParseBursts && LinkState == CONNECTED && MyRoot && MyRoot->bursting;
+}
+
+void TreeSocket::SubmitParse()
+{
+	if (!Utils->Parser)
+	{
+		Utils->Parser = new BurstParser;
+		ServerInstance->Threads->Start(Utils->Parser);
+	}
+	parsing = new ParseJob(this, ServerInstance->Config->RawLog);
+	parsing->data.swap(recvq);
+	Utils->Parser->Submit(parsing);
+}
+
+void TreeSocket::OnParsed(ParseJob* job)
+{
+	parsing = NULL;
+	/* What the parser left goes back in front of anything read since */
+	recvq.insert(0, job->data);
+	if (!getError().empty())
+		return;
+
+	/* Let the parser get on with the next run of data while this one is
+	 * processed, unless the stream changes at a COMPRESS line.
+	 */
+	bool compress = !job->lines.empty() && job->lines.back().command == "COMPRESS";
+	if (!compress && UseBurstParser() && recvq.find('\n') != std::string::npos)
+		SubmitParse();
+
+	Utils->Creator->loopCall = true;
+	try
+	{
+		for (std::deque<ParsedLine>::iterator i = job->lines.begin(); i != job->lines.end(); ++i)
+		{
+			if (job->rawlog)
+				ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] I %s", this->GetFd(), i->raw.c_str());
+			if (!i->error.empty())
+			{
+				SendError(i->error);
+				break;
+			}
+			if (!i->command.empty())
+				ProcessLine(i->prefix, i->command, i->params);
+			if (!getError().empty())
+				break;
+		}
+	}
+	catch (CoreException& ex)
+	{
+		SetError(ex.GetReason());
+	}
+	Utils->Creator->loopCall = false;
+
+	/* This is not called from the socket engine, so fail the link the way it would */
+	if (!getError().empty())
+		OnError(I_ERR_OTHER);
+	else if (!parsing)
+		OnDataReady();
+}
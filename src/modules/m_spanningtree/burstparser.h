@@ -0,0 +1,73 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __ST_BURSTPARSER_H__
+#define __ST_BURSTPARSER_H__
+
+#include "threadengine.h"
+
+class TreeSocket;
+
+/** A line from a server, split up by the BurstParser */
+struct ParsedLine
+{
+	std::string prefix;
+	std::string command;
+	parameterlist params;
+	/** The line as it was received, kept only when raw I/O is being logged */
+	std::string raw;
+	/** If not empty, the link is closed with this error instead of running the line */
+	std::string error;
+};
+
+/** Data read from one server, handed to the BurstParser to be split into lines */
+class ParseJob
+{
+ public:
+	/** The socket the data came from, or NULL once it has closed (main thread only) */
+	TreeSocket* sock;
+	/** Data to split. What the parser does not use is left here: a partial
+	 * line at the end, or everything after a COMPRESS line, as the stream
+	 * changes there and has to go through the socket's hook first.
+	 */
+	std::string data;
+	/** The complete lines found in data, in the order they were received */
+	std::deque<ParsedLine> lines;
+	/** Keep each line as it was received, for the RAWIO log */
+	const bool rawlog;
+
+	ParseJob(TreeSocket* Sock, bool RawLog) : sock(Sock), rawlog(RawLog) {}
+
+	/** Split data into lines, stopping at the first one which is invalid */
+	void Parse();
+};
+
+/** Splits and tokenises the lines of incoming bursts on its own thread, so
+ * that the main thread only has to act on them. A socket only ever has one
+ * job in flight, and jobs are returned in the order they were submitted.
+ */
+class BurstParser : public SocketThread
+{
+ public:
+	/** Jobs waiting to be parsed (hold the queue lock) */
+	std::deque<ParseJob*> pending;
+	/** Jobs which have been parsed and are waiting to be delivered (hold the queue lock) */
+	std::deque<ParseJob*> done;
+
+	~BurstParser();
+	void Submit(ParseJob* job);
+	void Run();
+	void OnNotify();
+};
+
+#endif
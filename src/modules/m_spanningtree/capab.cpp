@@ -19,6 +19,7 @@
 #include "utils.h"
 #include "link.h"
 #include "main.h"
+#include "../compress.h"
 
 std::string TreeSocket::MyModules(int filter)
 {
@@ -133,6 +134,9 @@ void TreeSocket::SendCapabilities(int phase)
 	}
 	if (proto_version < 1202)
 		extra += ServerInstance->Modes->FindMode('h', MODETYPE_CHANNEL) ? " HALFOP=1" : " HALFOP=0";
+	/* Stream formats we can decompress, if the other side wants to compress the link */
+	if (ServerInstance->Modules->FindDataService<CompressProvider>("compress/zlib"))
+		extra += " COMPRESS=zlib";
 
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
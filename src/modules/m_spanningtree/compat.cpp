@@ -107,6 +107,12 @@ void TreeSocket::CompatAddModules(std::vector<std::string>& modlist)
 
 void TreeSocket::WriteLine(std::string line)
 {
+	if (burst && !burst->writing)
+	{
+		/* Wait for the netburst to catch up with this */
+		burst->deferred.push_back(line);
+		return;
+	}
 	if (LinkState == CONNECTED)
 	{
 		if (line[0] != ':')
@@ -0,0 +1,68 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "../compress.h"
+
+#include "main.h"
+#include "utils.h"
+#include "treeserver.h"
+#include "link.h"
+#include "treesocket.h"
+
+/** Each side compresses what it sends if its link block asks for a format the
+ * other side advertised in CAPAB. The sender writes COMPRESS just after its
+ * BURST, and every byte after that line is part of the compressed stream.
+ */
+CompressProvider* TreeSocket::GetCompressor()
+{
+	if (!capab->link || capab->link->Compress.empty())
+		return NULL;
+
+	std::map<std::string,std::string>::iterator n = capab->CapKeys.find("COMPRESS");
+	if (n == capab->CapKeys.end())
+		return NULL;
+
+	irc::commasepstream formats(n->second);
+	std::string format;
+	while (formats.GetToken(format))
+	{
+		if (format == capab->link->Compress)
+			return ServerInstance->Modules->FindDataService<CompressProvider>("compress/" + format);
+	}
+	return NULL;
+}
+
+void TreeSocket::StartCompress(CompressProvider* zip)
+{
+	this->WriteLine(":" + ServerInstance->Config->GetSID() + " COMPRESS " + zip->format);
+	if (!zip->StartCompress(this, linkID))
+		SendError("Unable to start " + zip->format + " compression");
+}
+
+bool TreeSocket::Compress(const std::string &prefix, parameterlist &params)
+{
+	if (params.empty() || prefix != MyRoot->GetID())
+	{
+		SendError("Protocol violation: COMPRESS must come from the server at the other end of the link");
+		return false;
+	}
+
+	CompressProvider* zip = ServerInstance->Modules->FindDataService<CompressProvider>("compress/" + params[0]);
+	if (!zip || !zip->StartDecompress(this, recvq, linkID))
+	{
+		SendError("Unable to decompress link using " + params[0]);
+		return false;
+	}
+	return true;
+}
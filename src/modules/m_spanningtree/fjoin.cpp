@@ -16,6 +16,54 @@
 #include "treeserver.h"
 #include "treesocket.h"
 
+/** Sends the joins of a netmerge to local members together. Clients with
+ * the batch capability get them as an IRCv3 netjoin batch, so they can
+ * show them as one netjoin rather than a line for each user.
+ */
+class NetJoinBatch : public JoinBatch
+{
+	GenericCap& cap;
+	TreeServer* const origin;
+	std::string ref;
+	/** The last block wrapped in the batch, and the wrapped version */
+	std::string lastblock;
+	std::string wrapped;
+
+	void Send(LocalUser* user, const std::string& block, unsigned int count)
+	{
+		if (!cap.ext.get(user))
+		{
+			JoinBatch::Send(user, block, count);
+			return;
+		}
+
+		if (ref.empty())
+		{
+			static unsigned long serial = 0;
+			ref = "netjoin" + ConvToStr(++serial);
+		}
+
+		if (block != lastblock || wrapped.empty())
+		{
+			const std::string& ServerName = ServerInstance->Config->ServerName;
+			lastblock = block;
+			wrapped = ":" + ServerName + " BATCH +" + ref + " netjoin " + origin->GetParent()->GetName() + " " + origin->GetName() + "\r\n";
+			std::string::size_type start = 0;
+			std::string::size_type eol;
+			while ((eol = block.find('\n', start)) != std::string::npos)
+			{
+				wrapped.append("@batch=").append(ref).append(" ").append(block, start, eol + 1 - start);
+				start = eol + 1;
+			}
+			wrapped.append(":").append(ServerName).append(" BATCH -").append(ref).append("\r\n");
+		}
+		user->WriteLines(wrapped, count + 2);
+	}
+
+ public:
+	NetJoinBatch(Channel* Chan, GenericCap& Cap, TreeServer* Origin) : JoinBatch(Chan), cap(Cap), origin(Origin) {}
+};
+
 /** FJOIN, almost identical to TS6 SJOIN, except for nicklist handling. */
 CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *srcuser)
 {
@@ -59,7 +107,8 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 	bool created = !chan;						/* True if the channel doesnt exist here yet */
 	std::string item;						/* One item in the list of nicks */
 
-	TreeSocket* src_socket = Utils->FindServer(srcuser->server)->GetRoute()->GetSocket();
+	TreeServer* origin = Utils->FindServer(srcuser->server);
+	TreeSocket* src_socket = origin->GetRoute()->GetSocket();
 
 	if (!TS)
 	{
@@ -121,6 +170,10 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 		ServerInstance->SendMode(modelist, srcuser);
 	}
 
+	/* During a netmerge, local members are sent all of the joins at once */
+	NetJoinBatch batch(chan, ((ModuleSpanningTree*)(Module*)creator)->batchcap, origin);
+	JoinBatch* joins = origin->bursting ? &batch : NULL;
+
 	/* Now, process every 'modes,nick' pair */
 	while (users.GetToken(item))
 	{
@@ -138,7 +191,10 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 				if (mh)
 					modes += *unparsedmodes;
 				else
+				{
+					batch.Flush();
 					return CMD_INVALID;
+				}
 
 				usr++;
 				unparsedmodes++;
@@ -160,7 +216,7 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 				for (std::string::iterator x = modes.begin(); x != modes.end(); ++x)
 					modestack.Push(*x, who->nick);
 
-				Channel::JoinUser(who, channel.c_str(), true, "", route_back_again->bursting, TS);
+				Channel::JoinUser(who, channel.c_str(), true, "", route_back_again->bursting, TS, joins);
 			}
 			else
 			{
@@ -170,6 +226,9 @@ CmdResult CommandFJoin::Handle(const std::vector<std::string>& params, User *src
 		}
 	}
 
+	/* The joins have to be seen before any modes are given to the users */
+	batch.Flush();
+
 	/* Flush mode stacker if we lost the FJOIN or had equal TS */
 	if (apply_other_sides_modes)
 	{
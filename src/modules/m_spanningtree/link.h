@@ -27,6 +27,7 @@ class Link : public refcountbase
 	std::string AllowMask;
 	bool HiddenFromStats;
 	std::string Hook;
+	std::string Compress;
 	int Timeout;
 	std::string Bind;
 	bool Hidden;
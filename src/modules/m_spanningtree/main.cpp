@@ -27,7 +27,7 @@
 #include "commands.h"
 #include "protocolinterface.h"
 
-ModuleSpanningTree::ModuleSpanningTree()
+ModuleSpanningTree::ModuleSpanningTree() : batchcap(this, "batch")
 {
 	Utils = new SpanningTreeUtilities(this);
 	commands = new SpanningTreeCommands(this);
@@ -68,7 +68,7 @@ void ModuleSpanningTree::init()
 		I_OnChangeHost, I_OnChangeName, I_OnChangeIdent, I_OnUserPart, I_OnUnloadModule,
 		I_OnUserQuit, I_OnUserPostNick, I_OnUserKick, I_OnRemoteKill, I_OnRehash, I_OnPreRehash,
 		I_OnOper, I_OnAddLine, I_OnDelLine, I_OnMode, I_OnLoadModule, I_OnStats,
-		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection
+		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection, I_OnEvent
 	};
 	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 
@@ -789,6 +789,11 @@ void ModuleSpanningTree::OnUnloadModule(Module* mod)
 	}
 }
 
+void ModuleSpanningTree::OnEvent(Event& ev)
+{
+	batchcap.HandleEvent(ev);
+}
+
 void ModuleSpanningTree::RedoConfig(Module* mod)
 {
 }
@@ -16,6 +16,7 @@
 
 #include "inspircd.h"
 #include <stdarg.h>
+#include "../m_cap.h"
 
 /** If you make a change which breaks the protocol, increment this.
  * If you  completely change the protocol, completely change the number.
@@ -54,6 +55,10 @@ class ModuleSpanningTree : public Module
 	 */
 	bool loopCall;
 
+	/** Clients which take IRCv3 batches, and are sent netmerge joins as netjoin batches
+	 */
+	GenericCap batchcap;
+
 	/** Constructor
 	 */
 	ModuleSpanningTree();
@@ -163,6 +168,7 @@ class ModuleSpanningTree : public Module
 	void ProtoSendMetaData(void* opaque, Extensible* target, const std::string &extname, const std::string &extdata);
 	void OnLoadModule(Module* mod);
 	void OnUnloadModule(Module* mod);
+	void OnEvent(Event& ev);
 	ModResult OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	CullResult cull();
 	~ModuleSpanningTree();
@@ -19,6 +19,12 @@
 #include "utils.h"
 #include "main.h"
 
+/** Bytes a netburst may have waiting in the sendq before it stops for
+ * the next slice. Keeping this small lets the rest of the server run
+ * between slices of a large burst.
+ */
+#define BURST_SENDQ 262144
+
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
@@ -27,26 +33,82 @@
 void TreeSocket::DoBurst(TreeServer* s)
 {
 	std::string name = s->GetName();
-	std::string burst = ":" + ServerInstance->Config->GetSID() + " BURST " +ConvToStr(ServerInstance->Time());
-	std::string endburst = ":" + ServerInstance->Config->GetSID() + " ENDBURST";
 	ServerInstance->SNO->WriteToSnoMask('l',"Bursting to \2%s\2 (Authentication: %s%s).",
 		name.c_str(),
 		capab->auth_fingerprint ? "SSL Fingerprint and " : "",
 		capab->auth_challenge ? "challenge-response" : "plaintext password");
+	CompressProvider* zip = GetCompressor();
 	this->CleanNegotiationInfo();
-	this->WriteLine(burst);
+	this->WriteLine(":" + ServerInstance->Config->GetSID() + " BURST " + ConvToStr(ServerInstance->Time()));
+	if (zip)
+		this->StartCompress(zip);
+	if (!getError().empty())
+		return;
 	/* send our version string */
 	this->WriteLine(std::string(":")+ServerInstance->Config->GetSID()+" VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot,s,1);
-	/* Send users and their oper status */
-	this->SendUsers(s);
-	/* Send everything else (channel modes, xlines etc) */
-	this->SendChannelModes(s);
-	this->SendXLines(s);
-	FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
-	this->WriteLine(endburst);
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+name+"\2.");
+
+	/* Users, then channels, are sent from ContinueBurst as the sendq drains */
+	this->burst = new BurstState;
+	this->burst->users.reserve(ServerInstance->Users->clientlist->size());
+	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	{
+		if (u->second->registered == REG_ALL)
+			this->burst->users.push_back(BurstUser(u->second));
+	}
+	this->burst->chans.reserve(ServerInstance->chanlist->size());
+	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+		this->burst->chans.push_back(c->second->name);
+	this->ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	burst->writing = true;
+	while (getSendQSize() < BURST_SENDQ && getError().empty())
+	{
+		size_t pos = burst->pos++;
+		if (pos < burst->users.size())
+		{
+			BurstUser& bu = burst->users[pos];
+			User* u = ServerInstance->FindUUID(bu.uuid);
+			if (u)
+				this->SendUser(u, bu.nick, bu.age);
+		}
+		else if (pos - burst->users.size() < burst->chans.size())
+		{
+			Channel* c = ServerInstance->FindChan(burst->chans[pos - burst->users.size()]);
+			if (c)
+				this->SendChannel(c);
+		}
+		else
+		{
+			/* Send everything else (xlines etc) */
+			this->SendXLines(MyRoot);
+			FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
+			this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
+
+			/* Then what happened while the burst was being sent */
+			std::deque<std::string> deferred;
+			deferred.swap(burst->deferred);
+			delete burst;
+			burst = NULL;
+			for (std::deque<std::string>::iterator i = deferred.begin(); i != deferred.end(); ++i)
+				this->WriteLine(*i);
+
+			ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+MyRoot->GetName()+"\2.");
+			return;
+		}
+	}
+	burst->writing = false;
+}
+
+void TreeSocket::DoWrite()
+{
+	this->BufferedSocket::DoWrite();
+	if (burst && !burst->writing && getError().empty() && getSendQSize() < BURST_SENDQ)
+		this->ContinueBurst();
 }
 
 /** Recursively send the server tree with distances as hops.
@@ -201,81 +263,67 @@ void TreeSocket::SendXLines(TreeServer* Current)
 	}
 }
 
-/** Send channel modes and topics */
-void TreeSocket::SendChannelModes(TreeServer* Current)
+/** Send a channel's members, modes, topic and metadata */
+void TreeSocket::SendChannel(Channel* c)
 {
 	char data[MAXBUF];
-	std::deque<std::string> list;
-	std::string n = ServerInstance->Config->GetSID();
-	const char* sn = n.c_str();
-	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+	SendFJoins(MyRoot, c);
+	if (!c->topic.empty())
 	{
-		SendFJoins(Current, c->second);
-		if (!c->second->topic.empty())
-		{
-			snprintf(data,MAXBUF,":%s FTOPIC %s %lu %s :%s", sn, c->second->name.c_str(), (unsigned long)c->second->topicset, c->second->setby.c_str(), c->second->topic.c_str());
-			this->WriteLine(data);
-		}
-
-		for(Extensible::ExtensibleStore::const_iterator i = c->second->GetExtList().begin(); i != c->second->GetExtList().end(); i++)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_NETWORK, c->second, i->second);
-			if (!value.empty())
-				Utils->Creator->ProtoSendMetaData(this, c->second, item->name, value);
-		}
+		snprintf(data,MAXBUF,":%s FTOPIC %s %lu %s :%s", ServerInstance->Config->GetSID().c_str(), c->name.c_str(), (unsigned long)c->topicset, c->setby.c_str(), c->topic.c_str());
+		this->WriteLine(data);
+	}
 
-		FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(c->second,Utils->Creator,this));
+	for(Extensible::ExtensibleStore::const_iterator i = c->GetExtList().begin(); i != c->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, c, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, c, item->name, value);
 	}
+
+	FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(c,Utils->Creator,this));
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers(TreeServer* Current)
+/** Send a user and their oper state/modes */
+void TreeSocket::SendUser(User* u, const std::string& nick, time_t nickts)
 {
 	char data[MAXBUF];
-	std::string dataline;
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	TreeServer* theirserver = Utils->FindServer(u->server);
+	if (theirserver)
 	{
-		if (u->second->registered == REG_ALL)
+		snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
+				theirserver->GetID().c_str(),	/* Prefix: SID */
+				u->uuid.c_str(),		/* 0: UUID */
+				(unsigned long)nickts,		/* 1: TS */
+				nick.c_str(),			/* 2: Nick */
+				u->host.c_str(),		/* 3: Displayed Host */
+				u->dhost.c_str(),		/* 4: Real host */
+				u->ident.c_str(),		/* 5: Ident */
+				u->GetIPString(),		/* 6: IP string */
+				(unsigned long)u->signon,	/* 7: Signon time for WHOWAS */
+				u->FormatModes(true),		/* 8...n: Modes and params */
+				u->fullname.c_str());		/* size-1: GECOS */
+		this->WriteLine(data);
+		if (IS_OPER(u))
 		{
-			TreeServer* theirserver = Utils->FindServer(u->second->server);
-			if (theirserver)
-			{
-				snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
-						theirserver->GetID().c_str(),	/* Prefix: SID */
-						u->second->uuid.c_str(),	/* 0: UUID */
-						(unsigned long)u->second->age,	/* 1: TS */
-						u->second->nick.c_str(),	/* 2: Nick */
-						u->second->host.c_str(),	/* 3: Displayed Host */
-						u->second->dhost.c_str(),	/* 4: Real host */
-						u->second->ident.c_str(),	/* 5: Ident */
-						u->second->GetIPString(),	/* 6: IP string */
-						(unsigned long)u->second->signon, /* 7: Signon time for WHOWAS */
-						u->second->FormatModes(true),	/* 8...n: Modes and params */
-						u->second->fullname.c_str());	/* size-1: GECOS */
-				this->WriteLine(data);
-				if (IS_OPER(u->second))
-				{
-					snprintf(data,MAXBUF,":%s OPERTYPE %s", u->second->uuid.c_str(), u->second->oper->name.c_str());
-					this->WriteLine(data);
-				}
-				if (IS_AWAY(u->second))
-				{
-					snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->second->uuid.c_str(), (long)u->second->awaytime, u->second->awaymsg.c_str());
-					this->WriteLine(data);
-				}
-			}
-
-			for(Extensible::ExtensibleStore::const_iterator i = u->second->GetExtList().begin(); i != u->second->GetExtList().end(); i++)
-			{
-				ExtensionItem* item = i->first;
-				std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-				if (!value.empty())
-					Utils->Creator->ProtoSendMetaData(this, u->second, item->name, value);
-			}
-
-			FOREACH_MOD(I_OnSyncUser,OnSyncUser(u->second,Utils->Creator,this));
+			snprintf(data,MAXBUF,":%s OPERTYPE %s", u->uuid.c_str(), u->oper->name.c_str());
+			this->WriteLine(data);
+		}
+		if (IS_AWAY(u))
+		{
+			snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->uuid.c_str(), (long)u->awaytime, u->awaymsg.c_str());
+			this->WriteLine(data);
 		}
 	}
-}
 
+	for(Extensible::ExtensibleStore::const_iterator i = u->GetExtList().begin(); i != u->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, u, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, u, item->name, value);
+	}
+
+	FOREACH_MOD(I_OnSyncUser,OnSyncUser(u,Utils->Creator,this));
+}
@@ -157,10 +157,12 @@ void TreeServer::SetID(const std::string &id)
 int TreeServer::QuitUsers(const std::string &reason)
 {
 	const char* reason_s = reason.c_str();
+	/* Server names are pooled, so users on this server share its FakeUser's copy */
+	const std::string* server = &ServerUser->server;
 	std::vector<User*> time_to_die;
 	for (user_hash::iterator n = ServerInstance->Users->clientlist->begin(); n != ServerInstance->Users->clientlist->end(); n++)
 	{
-		if (n->second->server == ServerName)
+		if (&n->second->server == server)
 		{
 			time_to_die.push_back(n->second);
 		}
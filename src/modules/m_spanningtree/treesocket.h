@@ -55,6 +55,9 @@
  */
 enum ServerState { CONNECTING, WAIT_AUTH_1, WAIT_AUTH_2, CONNECTED, DYING };
 
+class CompressProvider;
+class ParseJob;
+
 struct CapabData
 {
 	reference<Link> link;			/* Link block used for this connection */
@@ -71,6 +74,35 @@ struct CapabData
 	bool auth_challenge;			/* Did we auth using challenge/response */
 };
 
+/** A user to be sent in a netburst, with the nick they had when it began */
+struct BurstUser
+{
+	std::string uuid;
+	std::string nick;
+	time_t age;
+	BurstUser(User* u) : uuid(u->uuid), nick(u->nick), age(u->age) {}
+};
+
+/** A netburst which is being sent a slice at a time. The users and channels
+ * to send are fixed when the burst begins; each is sent as it is when its
+ * turn comes, and is skipped if it has gone by then. Anything else written
+ * to the link in the meantime is held back until the burst is complete, so
+ * the other side sees every change after the state it applies to. Users
+ * go out under the nicks they had when the burst began, as the nick
+ * changes since then are among what is held back; a user sent under their
+ * current nick could take it from one sent earlier who has not yet been
+ * seen to give it up.
+ */
+struct BurstState
+{
+	std::vector<BurstUser> users;		/* The users to send */
+	std::vector<std::string> chans;		/* Names of the channels to send */
+	size_t pos;				/* Next user (then channel) to send */
+	bool writing;				/* Set while a slice is being written */
+	std::deque<std::string> deferred;	/* Lines written while the burst was in progress */
+	BurstState() : pos(0), writing(false) {}
+};
+
 /** Every SERVER connection inbound or outbound is represented by an object of
  * type TreeSocket. During setup, the object can be found in Utils->timeoutlist;
  * after setup, MyRoot will have been created as a child of Utils->TreeRoot
@@ -85,6 +117,8 @@ class TreeSocket : public BufferedSocket
 	time_t NextPing;			/* Time when we are due to ping this server */
 	bool LastPingWasGood;			/* Responded to last ping we sent? */
 	int proto_version;			/* Remote protocol version */
+	ParseJob* parsing;			/* Data being split by the burst parser, if any */
+	BurstState* burst;			/* Netburst being sent, if any */
  public:
 	time_t age;
 
@@ -211,11 +245,23 @@ class TreeSocket : public BufferedSocket
 	/** Send G, Q, Z and E lines */
 	void SendXLines(TreeServer* Current);
 
-	/** Send channel modes and topics */
-	void SendChannelModes(TreeServer* Current);
+	/** Send a user and their oper state/modes
+	 * @param u The user
+	 * @param nick The nick to introduce them with
+	 * @param nickts The timestamp of that nick
+	 */
+	void SendUser(User* u, const std::string& nick, time_t nickts);
+
+	/** Send a channel's members, modes, topic and metadata */
+	void SendChannel(Channel* c);
+
+	/** Send the next slice of a netburst which is in progress, and finish it off
+	 * once everything has been sent
+	 */
+	void ContinueBurst();
 
-	/** send all users and their oper state/modes */
-	void SendUsers(TreeServer* Current);
+	/** Send the next slice of the netburst, if any, once the sendq has drained */
+	void DoWrite();
 
 	/** This function is called when we want to send a netburst to a local
 	 * server. There is a set order we must do this, because for example
@@ -224,6 +270,15 @@ class TreeSocket : public BufferedSocket
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Get the compression format agreed for what we send, if any */
+	CompressProvider* GetCompressor();
+
+	/** Tell the other side that what follows is compressed, and start compressing */
+	void StartCompress(CompressProvider* zip);
+
+	/** Handle COMPRESS, which starts decompressing what we read */
+	bool Compress(const std::string &prefix, parameterlist &params);
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -290,14 +345,32 @@ class TreeSocket : public BufferedSocket
 	 */
 	bool Inbound_Server(parameterlist &params);
 
-	/** Handle IRC line split
+	/** Handle IRC line split. This is safe to call from the burst parser thread.
+	 * @return An error to close the link with, or an empty string if the line is valid
 	 */
-	void Split(const std::string &line, std::string& prefix, std::string& command, parameterlist &params);
+	static std::string Split(const std::string &line, std::string& prefix, std::string& command, parameterlist &params);
 
 	/** Process complete line from buffer
 	 */
 	void ProcessLine(std::string &line);
 
+	/** Process a line which has already been split
+	 */
+	void ProcessLine(std::string& prefix, std::string& command, parameterlist& params);
+
+	/** True if received data should be handed to the burst parser rather
+	 * than split here, which is while the other side is bursting to us
+	 */
+	bool UseBurstParser();
+
+	/** Hand everything in the recvq to the burst parser
+	 */
+	void SubmitParse();
+
+	/** Process the lines the burst parser split out of our data
+	 */
+	void OnParsed(ParseJob* job);
+
 	void ProcessConnectedLine(std::string& prefix, std::string& command, parameterlist& params);
 
 	/** Handle socket timeout from connect()
@@ -40,6 +40,8 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
 	capab->capab_phase = 0;
 	MyRoot = NULL;
 	proto_version = 0;
+	parsing = NULL;
+	burst = NULL;
 	LinkState = CONNECTING;
 	if (!link->Hook.empty())
 	{
@@ -69,6 +71,8 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via
 	age = ServerInstance->Time();
 	LinkState = WAIT_AUTH_1;
 	proto_version = 0;
+	parsing = NULL;
+	burst = NULL;
 	linkID = "inbound from " + client->addr();
 
 	FOREACH_MOD(I_OnHookIO, OnHookIO(this, via));
@@ -105,6 +109,7 @@ TreeSocket::~TreeSocket()
 {
 	if (capab)
 		delete capab;
+	delete burst;
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -132,6 +137,9 @@ void TreeSocket::OnError(BufferedSocketError e)
 
 void TreeSocket::SendError(const std::string &errormessage)
 {
+	/* The rest of a netburst will never be sent, so this cannot wait for it */
+	if (burst)
+		burst->writing = true;
 	WriteLine("ERROR :"+errormessage);
 	DoWrite();
 	LinkState = DYING;
@@ -212,10 +220,22 @@ void TreeSocket::Squit(TreeServer* Current, const std::string &reason)
  */
 void TreeSocket::OnDataReady()
 {
+	/* New data waits behind the data the parser already has */
+	if (parsing)
+		return;
+
 	Utils->Creator->loopCall = true;
 	std::string line;
-	while (GetNextLine(line))
+	while (true)
 	{
+		if (UseBurstParser())
+		{
+			if (recvq.find('\n') != std::string::npos)
+				SubmitParse();
+			break;
+		}
+		if (!GetNextLine(line))
+			break;
 		std::string::size_type rline = line.find('\r');
 		if (rline != std::string::npos)
 			line = line.substr(0,rline);
@@ -22,6 +22,7 @@
 #include "link.h"
 #include "treesocket.h"
 #include "resolvers.h"
+#include "burstparser.h"
 
 /* Handle ERROR command */
 void TreeSocket::Error(parameterlist &params)
@@ -30,27 +31,21 @@ void TreeSocket::Error(parameterlist &params)
 	SetError("received ERROR " + msg);
 }
 
-void TreeSocket::Split(const std::string& line, std::string& prefix, std::string& command, parameterlist& params)
+std::string TreeSocket::Split(const std::string& line, std::string& prefix, std::string& command, parameterlist& params)
 {
 	irc::tokenstream tokens(line);
 
 	if (!tokens.GetToken(prefix))
-		return;
+		return "";
 	
 	if (prefix[0] == ':')
 	{
 		prefix = prefix.substr(1);
 
 		if (prefix.empty())
-		{
-			this->SendError("BUG (?) Empty prefix received: " + line);
-			return;
-		}
+			return "BUG (?) Empty prefix received: " + line;
 		if (!tokens.GetToken(command))
-		{
-			this->SendError("BUG (?) Empty command received: " + line);
-			return;
-		}
+			return "BUG (?) Empty command received: " + line;
 	}
 	else
 	{
@@ -58,13 +53,14 @@ void TreeSocket::Split(const std::string& line, std::string& prefix, std::string
 		prefix.clear();
 	}
 	if (command.empty())
-		this->SendError("BUG (?) Empty command received: " + line);
+		return "BUG (?) Empty command received: " + line;
 
 	std::string param;
 	while (tokens.GetToken(param))
 	{
 		params.push_back(param);
 	}
+	return "";
 }
 
 void TreeSocket::ProcessLine(std::string &line)
@@ -75,11 +71,21 @@ void TreeSocket::ProcessLine(std::string &line)
 
 	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] I %s", this->GetFd(), line.c_str());
 
-	Split(line, prefix, command, params);
+	std::string reason = Split(line, prefix, command, params);
+	if (!reason.empty())
+	{
+		this->SendError(reason);
+		return;
+	}
 
 	if (command.empty())
 		return;
 
+	ProcessLine(prefix, command, params);
+}
+
+void TreeSocket::ProcessLine(std::string& prefix, std::string& command, parameterlist& params)
+{
 	switch (this->LinkState)
 	{
 		case WAIT_AUTH_1:
@@ -372,6 +378,10 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 	{
 		this->Encap(who, params);
 	}
+	else if (command == "COMPRESS")
+	{
+		this->Compress(prefix, params);
+	}
 	else if (command == "NICK")
 	{
 		if (params.size() != 2)
@@ -440,6 +450,11 @@ void TreeSocket::OnTimeout()
 
 void TreeSocket::Close()
 {
+	if (parsing)
+	{
+		parsing->sock = NULL;
+		parsing = NULL;
+	}
 	if (fd != -1)
 		ServerInstance->GlobalCulls.AddItem(this);
 	this->BufferedSocket::Close();
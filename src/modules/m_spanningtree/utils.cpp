@@ -22,6 +22,7 @@
 #include "link.h"
 #include "treesocket.h"
 #include "resolvers.h"
+#include "burstparser.h"
 
 /* Create server sockets off a listener. */
 ModResult ModuleSpanningTree::OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
@@ -127,7 +128,7 @@ bool SpanningTreeUtilities::IsServer(const std::string &ServerName)
 	return (FindServer(ServerName) != NULL);
 }
 
-SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C)
+SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C), Parser(NULL)
 {
 	ServerInstance->Logs->Log("m_spanningtree",DEBUG,"***** Using SID for hash: %s *****", ServerInstance->Config->GetSID().c_str());
 
@@ -159,6 +160,11 @@ CullResult SpanningTreeUtilities::cull()
 
 SpanningTreeUtilities::~SpanningTreeUtilities()
 {
+	if (Parser)
+	{
+		Parser->join();
+		delete Parser;
+	}
 	delete TreeRoot;
 }
 
@@ -357,6 +363,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 	AllowOptCommon = Conf.ReadFlag("options", "allowmismatch", 0);
 	ChallengeResponse = !Conf.ReadFlag("security", "disablehmac", 0);
 	quiet_bursts = Conf.ReadFlag("performance", "quietbursts", 0);
+	ParseBursts = Conf.ReadFlag("performance", "burstparser", 0);
 	PingWarnTime = Conf.ReadInteger("options", "pingwarning", 0, true);
 	PingFreq = Conf.ReadInteger("options", "serverpingfreq", 0, true);
 
@@ -384,6 +391,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->HiddenFromStats = tag->getBool("statshidden");
 		L->Timeout = tag->getInt("timeout", 30);
 		L->Hook = tag->getString("ssl");
+		L->Compress = tag->getString("compress");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
 
@@ -23,6 +23,7 @@ class Link;
 class Autoconnect;
 class ModuleSpanningTree;
 class SpanningTreeUtilities;
+class BurstParser;
 
 /* This hash_map holds the hash equivalent of the server
  * tree, used for rapid linear lookups.
@@ -67,6 +68,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool quiet_bursts;
 
+	/** Split the lines of incoming bursts on the burst parser thread
+	 */
+	bool ParseBursts;
+
+	/** The burst parser thread, started when it is first needed
+	 */
+	BurstParser* Parser;
+
 	/* Number of seconds that a server can go without ping
 	 * before opers are warned of high latency.
 	 */
@@ -158,7 +158,8 @@ static void checkall(Module* noimpl)
 	CHK(OnPostCommand);
 	CHK(OnPostJoin);
 	CHK(OnWhoisLine);
-	CHK(OnBuildNeighborList);
+	CHK(OnNeighborChannel);
+	CHK(OnNeighborMember);
 	CHK(OnGarbageCollect);
 	CHK(OnText);
 	CHK(OnPassCompare);
@@ -170,13 +171,450 @@ static void checkall(Module* noimpl)
 	CHK(OnModuleRehash);
 	CHK(OnSendWhoLine);
 	CHK(OnChangeIdent);
+	CHK(OnNamesListStyle);
+}
+
+/** Microseconds on a clock which only goes forward */
+static uint64_t Microseconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Memory resident in this process, in kilobytes */
+static unsigned long ResidentKB()
+{
+	unsigned long pages, resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu %lu", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/** Describe a histogram of latencies in microseconds */
+static std::string FormatLatency(const Profiler::Histogram& hist)
+{
+	if (!hist.count)
+		return "count=0";
+	return "count=" + ConvToStr(hist.count) + " avg=" + ConvToStr(hist.total / hist.count) + "us p50<" + ConvToStr(hist.Percentile(50))
+		+ "us p90<" + ConvToStr(hist.Percentile(90)) + "us p99<" + ConvToStr(hist.Percentile(99)) + "us max=" + ConvToStr(hist.max) + "us";
+}
+
+class LoadGenerator;
+
+/** A synthetic client connected over loopback by TEST load */
+class LoadClient : public BufferedSocket
+{
+	LoadGenerator* gen;
+	uint64_t connectstart, nickstart;
+	std::map<std::string, uint64_t> joinstart;
+
+ public:
+	const unsigned int id;
+	std::string nick;
+	std::vector<std::string> chans;
+	bool ready, gone;
+
+	LoadClient(LoadGenerator* Gen, unsigned int Id, const std::string& ip, int port);
+	void Send(const std::string& line) { WriteData(line + "\r\n"); }
+	void Join(const std::string& chan);
+	void ChangeNick();
+	void OnConnected();
+	void OnDataReady();
+	void OnError(BufferedSocketError);
+};
+
+/** A run of TEST load: connects the clients, drives its scenario once a
+ * second, and records how long the server takes to answer each operation
+ * and how much memory this process holds.
+ */
+class LoadGenerator : public Timer
+{
+	LoadGenerator*& owner;
+	std::vector<LoadClient*> clients;
+	std::vector<std::pair<std::string, int> > targets;
+	std::map<std::string, Profiler::Histogram> latency;
+	std::vector<unsigned long> rss;
+	/** The cumulative Zipf distribution of members over the channels */
+	std::vector<double> zipf;
+	uint32_t rng;
+	unsigned long ticks, lost;
+	bool split;
+
+	uint32_t Random(uint32_t max)
+	{
+		/* xorshift, so that a run with the same seed makes the same choices */
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		return rng % max;
+	}
+
+	std::string PickChannel()
+	{
+		double r = Random(1000000) / 1000000.0;
+		unsigned int i = std::lower_bound(zipf.begin(), zipf.end(), r) - zipf.begin();
+		return "#load" + ConvToStr(std::min(i, (unsigned int)zipf.size() - 1));
+	}
+
+	LoadClient* PickClient()
+	{
+		if (clients.empty())
+			return NULL;
+		LoadClient* client = clients[Random(clients.size())];
+		return client && client->ready ? client : NULL;
+	}
+
+	void Act(LoadClient* client)
+	{
+		if (scenario == "joins")
+		{
+			std::string chan = client->chans[Random(client->chans.size())];
+			client->Send("PART " + chan);
+			client->Join(chan);
+		}
+		else if (scenario == "nicks")
+			client->ChangeNick();
+		else
+		{
+			std::string chan = client->chans[Random(client->chans.size())];
+			client->Send("PRIVMSG " + chan + " :load " + ConvToStr(Microseconds()));
+		}
+	}
+
+	void Split()
+	{
+		/* Go through the parser as the oper would, so m_spanningtree sees the command */
+		LocalUser* lu = IS_LOCAL(ServerInstance->FindUUID(oper));
+		if (!lu)
+			return;
+		std::string line = split ? "CONNECT " + splitserver : "SQUIT " + splitserver + " :Load test split";
+		split = !split;
+		Notice("Load test: " + line);
+		ServerInstance->Parser->ProcessBuffer(line, lu);
+	}
+
+ public:
+	std::string oper, scenario, report, splitserver;
+	unsigned int count, perclient, rate, ramp, duration, splitevery;
+
+	LoadGenerator(LoadGenerator*& Owner, User* user, const std::string& Scenario, const std::vector<std::string>& options)
+		: Timer(1, ServerInstance->Time(), true), owner(Owner), rng(1), ticks(0), lost(0), split(false)
+		, oper(user->uuid), scenario(Scenario), count(100), perclient(2), rate(0), ramp(500), duration(60), splitevery(30)
+	{
+		unsigned int channels = 10;
+		double exponent = 1.0;
+		/* By default, load this server through its first plain client port */
+		std::string target;
+		for (std::vector<ListenSocket*>::iterator i = ServerInstance->ports.begin(); i != ServerInstance->ports.end(); ++i)
+		{
+			ListenSocket* ls = *i;
+			if (ls->bind_tag->getString("type", "clients") == "clients" && ls->bind_tag->getString("ssl").empty())
+			{
+				bool any = ls->bind_addr.empty() || ls->bind_addr == "0.0.0.0" || ls->bind_addr == "::";
+				target = (any ? "127.0.0.1" : ls->bind_addr) + ":" + ConvToStr(ls->bind_port);
+				break;
+			}
+		}
+		for (std::vector<std::string>::const_iterator i = options.begin(); i != options.end(); ++i)
+		{
+			std::string::size_type eq = i->find('=');
+			std::string key = i->substr(0, eq);
+			std::string value = eq == std::string::npos ? "" : i->substr(eq + 1);
+			if (key == "clients")
+				count = atoi(value.c_str());
+			else if (key == "channels")
+				channels = atoi(value.c_str());
+			else if (key == "perclient")
+				perclient = atoi(value.c_str());
+			else if (key == "zipf")
+				exponent = atof(value.c_str());
+			else if (key == "rate")
+				rate = atoi(value.c_str());
+			else if (key == "ramp")
+				ramp = atoi(value.c_str());
+			else if (key == "time")
+				duration = ServerInstance->Duration(value);
+			else if (key == "seed")
+				rng = atoi(value.c_str());
+			else if (key == "target")
+				target = value;
+			else if (key == "split")
+				splitserver = value;
+			else if (key == "splitevery")
+				splitevery = ServerInstance->Duration(value);
+			else if (key == "report")
+			{
+				/* Only a file name: reports go in data/, never anywhere the ircd can write */
+				if (value.empty() || value[0] == '.' || value.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-") != std::string::npos)
+					throw CoreException("report= must be a plain file name, which is written to data/");
+				report = "data/" + value;
+			}
+			else
+				throw CoreException("Unknown option " + key);
+		}
+
+		if (scenario != "joins" && scenario != "chatter" && scenario != "nicks" && scenario != "split")
+			throw CoreException("Unknown scenario " + scenario + "; use joins, chatter, nicks or split");
+		if (scenario == "split" && splitserver.empty())
+			throw CoreException("The split scenario needs split=<server>");
+		if (!count || !channels || !perclient || !ramp || !duration)
+			throw CoreException("clients, channels, perclient, ramp and time must not be zero");
+		if (!rate)
+			rate = std::max(1U, count / 10);
+		if (!rng)
+			rng = 1;
+		splitevery = std::max(2U, splitevery);
+		perclient = std::min(perclient, channels);
+
+		irc::commasepstream addresses(target);
+		std::string address;
+		while (addresses.GetToken(address))
+		{
+			std::string::size_type colon = address.rfind(':');
+			if (colon == std::string::npos)
+				throw CoreException("Targets must be given as <ip>:<port>");
+			targets.push_back(std::make_pair(address.substr(0, colon), atoi(address.substr(colon + 1).c_str())));
+		}
+		if (targets.empty())
+			throw CoreException("No target given");
+
+		double sum = 0;
+		for (unsigned int i = 1; i <= channels; i++)
+			zipf.push_back(sum += 1 / pow(i, exponent));
+		for (std::vector<double>::iterator i = zipf.begin(); i != zipf.end(); ++i)
+			*i /= sum;
+		rss.push_back(ResidentKB());
+	}
+
+	~LoadGenerator()
+	{
+		for (std::vector<LoadClient*>::iterator i = clients.begin(); i != clients.end(); ++i)
+		{
+			if (*i)
+			{
+				(*i)->cull();
+				delete *i;
+			}
+		}
+	}
+
+	void Notice(const std::string& text)
+	{
+		User* user = ServerInstance->FindUUID(oper);
+		if (user)
+			user->WriteServ("NOTICE %s :%s", user->nick.c_str(), text.c_str());
+	}
+
+	void Record(const std::string& op, uint64_t start)
+	{
+		latency[op].Add(Microseconds() - start);
+	}
+
+	/** Choose the channels a new client joins */
+	void PickChannels(LoadClient* client)
+	{
+		while (client->chans.size() < perclient)
+		{
+			std::string chan = PickChannel();
+			if (std::find(client->chans.begin(), client->chans.end(), chan) == client->chans.end())
+				client->chans.push_back(chan);
+		}
+	}
+
+	void Lost(LoadClient* client)
+	{
+		if (client->gone)
+			return;
+		client->gone = true;
+		client->ready = false;
+		lost++;
+		if (client->id < clients.size() && clients[client->id] == client)
+			clients[client->id] = NULL;
+		ServerInstance->GlobalCulls.AddItem(client);
+	}
+
+	void Tick(time_t)
+	{
+		ticks++;
+		rss.push_back(ResidentKB());
+
+		for (unsigned int i = 0; i < ramp && clients.size() < count; i++)
+		{
+			const std::pair<std::string, int>& target = targets[clients.size() % targets.size()];
+			clients.push_back(NULL);
+			LoadClient* client = new LoadClient(this, clients.size() - 1, target.first, target.second);
+			/* A connect which failed at once has already been culled */
+			if (!client->gone)
+				clients.back() = client;
+		}
+
+		for (unsigned int i = 0; i < rate; i++)
+		{
+			LoadClient* client = PickClient();
+			if (client)
+				Act(client);
+		}
+
+		if (scenario == "split" && !(ticks % splitevery))
+			Split();
+
+		if (ticks >= duration)
+		{
+			Report();
+			CancelRepeat();
+			owner = NULL;
+		}
+	}
+
+	void Report()
+	{
+		unsigned long connected = 0, peak = 0;
+		for (std::vector<LoadClient*>::iterator i = clients.begin(); i != clients.end(); ++i)
+			if (*i && (*i)->ready)
+				connected++;
+		for (std::vector<unsigned long>::iterator i = rss.begin(); i != rss.end(); ++i)
+			peak = std::max(peak, *i);
+
+		Notice("Load test " + scenario + " after " + ConvToStr(ticks) + "s: " + ConvToStr(connected) + " of "
+			+ ConvToStr(count) + " clients connected, " + ConvToStr(lost) + " lost");
+		for (std::map<std::string, Profiler::Histogram>::iterator i = latency.begin(); i != latency.end(); ++i)
+			Notice(i->first + ": " + FormatLatency(i->second));
+		Notice("RSS: start=" + ConvToStr(rss.front()) + "KB peak=" + ConvToStr(peak) + "KB now=" + ConvToStr(rss.back()) + "KB");
+
+		if (report.empty())
+			return;
+		/* The whole of each histogram and the memory used every second, for comparing runs */
+		FILE* f = fopen(report.c_str(), "w");
+		if (!f)
+		{
+			Notice("Can't write " + report + ": " + strerror(errno));
+			return;
+		}
+		fprintf(f, "# scenario=%s clients=%u connected=%lu lost=%lu seconds=%lu\n", scenario.c_str(), count, connected, lost, ticks);
+		for (std::map<std::string, Profiler::Histogram>::iterator i = latency.begin(); i != latency.end(); ++i)
+		{
+			fprintf(f, "# %s %s\n", i->first.c_str(), FormatLatency(i->second).c_str());
+			for (unsigned int b = 0; b < Profiler::Histogram::BUCKETS; b++)
+				if (i->second.buckets[b])
+					fprintf(f, "latency %s %s %lu\n", i->first.c_str(), ConvToStr((uint64_t)1 << b).c_str(), i->second.buckets[b]);
+		}
+		for (unsigned int i = 0; i < rss.size(); i++)
+			fprintf(f, "rss %u %lu\n", i, rss[i]);
+		fclose(f);
+		Notice("Load test report written to " + report);
+	}
+};
+
+LoadClient::LoadClient(LoadGenerator* Gen, unsigned int Id, const std::string& ip, int port)
+	: gen(Gen), connectstart(Microseconds()), nickstart(0), id(Id), nick("load" + ConvToStr(Id)), ready(false), gone(false)
+{
+	gen->PickChannels(this);
+	/* Give each client its own loopback address, so per-IP limits don't refuse them */
+	std::string bind;
+	if (ip.compare(0, 4, "127.") == 0)
+		bind = "127." + ConvToStr(100 + (id >> 16)) + "." + ConvToStr((id >> 8) & 0xFF) + "." + ConvToStr(id & 0xFF);
+	DoConnect(ip, port, 30, bind);
+}
+
+void LoadClient::Join(const std::string& chan)
+{
+	joinstart[chan] = Microseconds();
+	Send("JOIN " + chan);
+}
+
+void LoadClient::ChangeNick()
+{
+	nickstart = Microseconds();
+	Send("NICK " + (nick[nick.length() - 1] == '_' ? "load" + ConvToStr(id) : nick + "_"));
+}
+
+void LoadClient::OnConnected()
+{
+	Send("NICK " + nick);
+	Send("USER load 0 * :Load test client");
+}
+
+void LoadClient::OnDataReady()
+{
+	std::string line;
+	while (GetNextLine(line))
+	{
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+
+		std::string source;
+		if (line[0] == ':')
+		{
+			std::string::size_type space = line.find(' ');
+			source = line.substr(1, line.find('!') < space ? line.find('!') - 1 : space - 1);
+			line.erase(0, space == std::string::npos ? line.length() : space + 1);
+		}
+		irc::tokenstream tokens(line);
+		std::string command, target, text;
+		tokens.GetToken(command);
+		tokens.GetToken(target);
+		tokens.GetToken(text);
+
+		if (command == "PING")
+			Send("PONG :" + target);
+		else if (command == "001")
+		{
+			ready = true;
+			gen->Record("connect", connectstart);
+			for (std::vector<std::string>::iterator i = chans.begin(); i != chans.end(); ++i)
+				Join(*i);
+		}
+		else if (command == "433" && !ready)
+		{
+			nick = "load" + ConvToStr(id) + "_" + ConvToStr(ServerInstance->GenRandomInt(1000));
+			Send("NICK " + nick);
+		}
+		else if (command == "JOIN" && source == nick)
+		{
+			std::map<std::string, uint64_t>::iterator i = joinstart.find(target);
+			if (i != joinstart.end())
+			{
+				gen->Record("join", i->second);
+				joinstart.erase(i);
+			}
+		}
+		else if (command == "NICK" && source == nick)
+		{
+			nick = target;
+			if (nickstart)
+				gen->Record("nick", nickstart);
+			nickstart = 0;
+		}
+		else if (command == "PRIVMSG" && text.compare(0, 5, "load ") == 0)
+			gen->Record("privmsg", atol(text.c_str() + 5));
+		else if (command == "ERROR")
+			SetError(target);
+	}
+	if (!getError().empty())
+	{
+		Close();
+		gen->Lost(this);
+	}
+}
+
+void LoadClient::OnError(BufferedSocketError)
+{
+	gen->Lost(this);
 }
 
 class CommandTest : public Command
 {
  public:
-	CommandTest(Module* parent) : Command(parent, "TEST", 1)
+	LoadGenerator* load;
+
+	CommandTest(Module* parent) : Command(parent, "TEST", 1), load(NULL)
 	{
+		flags_needed = 'o';
 		syntax = "<action> <parameters>";
 	}
 
@@ -198,6 +636,44 @@ class CommandTest : public Command
 			checkall(creator);
 			ServerInstance->SNO->WriteToSnoMask('a', "Module check complete");
 		}
+		else if (parameters[0] == "load" && parameters.size() > 1)
+		{
+			if (parameters[1] == "stop" || parameters[1] == "report")
+			{
+				if (!load)
+				{
+					user->WriteServ("NOTICE %s :No load test is running", user->nick.c_str());
+					return CMD_FAILURE;
+				}
+				load->Report();
+				if (parameters[1] == "stop")
+				{
+					ServerInstance->Timers->DelTimer(load);
+					load = NULL;
+				}
+			}
+			else if (load)
+			{
+				user->WriteServ("NOTICE %s :A load test is already running", user->nick.c_str());
+				return CMD_FAILURE;
+			}
+			else
+			{
+				try
+				{
+					std::vector<std::string> options(parameters.begin() + 2, parameters.end());
+					load = new LoadGenerator(load, user, parameters[1], options);
+				}
+				catch (CoreException& e)
+				{
+					user->WriteServ("NOTICE %s :%s", user->nick.c_str(), e.GetReason());
+					return CMD_FAILURE;
+				}
+				ServerInstance->Timers->AddTimer(load);
+				user->WriteServ("NOTICE %s :Load test %s started: %u clients for %us", user->nick.c_str(),
+					load->scenario.c_str(), load->count, load->duration);
+			}
+		}
 		return CMD_SUCCESS;
 	}
 };
@@ -213,6 +689,12 @@ class ModuleTest : public Module
 		ServerInstance->AddCommand(&cmd);
 	}
 
+	~ModuleTest()
+	{
+		if (cmd.load)
+			ServerInstance->Timers->DelTimer(cmd.load);
+	}
+
 	Version GetVersion()
 	{
 		return Version("Provides a module for testing the server while linked in a network", VF_VENDOR|VF_OPTCOMMON);
@@ -23,8 +23,8 @@ class ModuleUHNames : public Module
 
 	ModuleUHNames() : cap(this, "userhost-in-names")
 	{
-		Implementation eventlist[] = { I_OnEvent, I_OnPreCommand, I_OnNamesListItem, I_On005Numeric };
-		ServerInstance->Modules->Attach(eventlist, this, 4);
+		Implementation eventlist[] = { I_OnEvent, I_OnPreCommand, I_OnNamesListItem, I_OnNamesListStyle, I_On005Numeric };
+		ServerInstance->Modules->Attach(eventlist, this, 5);
 	}
 
 	~ModuleUHNames()
@@ -71,6 +71,13 @@ class ModuleUHNames : public Module
 		nick = memb->user->GetFullHost();
 	}
 
+	ModResult OnNamesListStyle(User* issuer, Channel* chan, unsigned int &style)
+	{
+		if (cap.ext.get(issuer))
+			style |= NamesCache::FULLHOST;
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnEvent(Event& ev)
 	{
 		cap.HandleEvent(ev);
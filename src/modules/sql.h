@@ -178,4 +178,269 @@ class SQLProvider : public DataProvider
 	}
 };
 
+/**
+ * A query handed to an SQLExecutor. Providers derive from this to carry
+ * whatever they need to run the query: Run() is called on the worker thread
+ * which owns the connection, then Deliver() on the main thread.
+ */
+class SQLJob
+{
+ public:
+	/** The query to report to, or NULL once it has been cancelled (main thread only) */
+	SQLQuery* query;
+	/** The connection the query runs on */
+	SQLProvider* const conn;
+
+	SQLJob(SQLQuery* Query, SQLProvider* Conn) : query(Query), conn(Conn) {}
+	virtual ~SQLJob() { delete query; }
+
+	/** Run the query. This must not touch the SQLQuery, which the main thread may delete meanwhile */
+	virtual void Run() = 0;
+	/** Report the result to the query */
+	virtual void Deliver() = 0;
+
+	/** Report an error to the query and stop it from being delivered */
+	void Cancel(SQLerrorNum id)
+	{
+		if (!query)
+			return;
+		Fail(query, id);
+		query = NULL;
+	}
+
+	/** Report an error to a query taken from a job, and delete it */
+	static void Fail(SQLQuery* query, SQLerrorNum id)
+	{
+		SQLerror err(id);
+		query->OnError(err);
+		delete query;
+	}
+};
+
+/** Jobs and queries taken out of an SQLWorker by CancelJobs, to be failed
+ * once its queue is unlocked, as their error handlers may submit more
+ */
+struct SQLCancelled
+{
+	std::vector<SQLJob*> jobs;
+	std::vector<SQLQuery*> queries;
+
+	void Fail(SQLerrorNum id)
+	{
+		for (std::vector<SQLJob*>::iterator i = jobs.begin(); i != jobs.end(); ++i)
+		{
+			(*i)->Cancel(id);
+			delete *i;
+		}
+		for (std::vector<SQLQuery*>::iterator i = queries.begin(); i != queries.end(); ++i)
+			SQLJob::Fail(*i, id);
+		jobs.clear();
+		queries.clear();
+	}
+};
+
+/**
+ * One worker of an SQLExecutor. Jobs for each connection all go to the
+ * same worker, so they run in order and a connection is never used by
+ * two threads at once.
+ */
+class SQLWorker : public SocketThread
+{
+ public:
+	/** Jobs waiting to run (hold the queue lock) */
+	std::deque<SQLJob*> pending;
+	/** Jobs which have run and are waiting to be delivered (hold the queue lock) */
+	std::deque<SQLJob*> done;
+	/** The job being run (hold the queue lock) */
+	SQLJob* current;
+	/** Held for as long as a job is being run */
+	Mutex running;
+	/** Number of connections using this worker (main thread only) */
+	unsigned int conns;
+
+	SQLWorker() : current(NULL), conns(0) {}
+
+	void Run()
+	{
+		this->LockQueue();
+		while (!this->GetExitFlag())
+		{
+			if (pending.empty())
+			{
+				this->WaitForQueue();
+				continue;
+			}
+			current = pending.front();
+			pending.pop_front();
+			running.Lock();
+			this->UnlockQueue();
+
+			current->Run();
+
+			running.Unlock();
+			this->LockQueue();
+			/* Only the first result of a batch needs to wake the main thread */
+			bool wake = done.empty();
+			done.push_back(current);
+			current = NULL;
+			if (wake)
+				NotifyParent();
+		}
+		this->UnlockQueue();
+	}
+
+	void OnNotify()
+	{
+		std::deque<SQLJob*> batch;
+		this->LockQueue();
+		batch.swap(done);
+		this->UnlockQueue();
+
+		for (std::deque<SQLJob*>::iterator i = batch.begin(); i != batch.end(); ++i)
+		{
+			if ((*i)->query)
+				(*i)->Deliver();
+			delete *i;
+		}
+	}
+
+	/** Take out the jobs matching a connection or a module. Call with the queue
+	 * locked, and fail what was taken once it is unlocked.
+	 */
+	void CancelJobs(SQLProvider* conn, Module* mod, SQLCancelled& cancelled)
+	{
+		for (std::deque<SQLJob*>::iterator i = pending.begin(); i != pending.end(); )
+		{
+			SQLJob* job = *i;
+			if (job->conn == conn || (mod && job->query && job->query->creator == mod))
+			{
+				cancelled.jobs.push_back(job);
+				i = pending.erase(i);
+			}
+			else
+				++i;
+		}
+		/* A job which is running or has run only loses its query; the worker still owns it */
+		if (mod && current && current->query && current->query->creator == mod)
+		{
+			cancelled.queries.push_back(current->query);
+			current->query = NULL;
+		}
+		for (std::deque<SQLJob*>::iterator i = done.begin(); i != done.end(); ++i)
+		{
+			if (mod && (*i)->query && (*i)->query->creator == mod)
+			{
+				cancelled.queries.push_back((*i)->query);
+				(*i)->query = NULL;
+			}
+		}
+	}
+};
+
+/**
+ * A pool of worker threads for SQL providers whose client library only
+ * offers blocking calls. Each connection is attached to one worker; results
+ * come back to the main thread in batches through SocketThread::NotifyParent.
+ */
+class SQLExecutor
+{
+	std::vector<SQLWorker*> workers;
+	std::map<SQLProvider*, SQLWorker*> affinity;
+
+ public:
+	SQLExecutor(unsigned int threads)
+	{
+		if (!threads)
+			threads = 1;
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			SQLWorker* worker = new SQLWorker;
+			ServerInstance->Threads->Start(worker);
+			workers.push_back(worker);
+		}
+	}
+
+	~SQLExecutor()
+	{
+		for (std::vector<SQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			SQLWorker* worker = *i;
+			worker->join();
+			/* Deliver whatever finished, and fail whatever never got to run */
+			worker->OnNotify();
+			for (std::deque<SQLJob*>::iterator j = worker->pending.begin(); j != worker->pending.end(); ++j)
+			{
+				(*j)->Cancel(SQL_BAD_CONN);
+				delete *j;
+			}
+			delete worker;
+		}
+	}
+
+	/** Give a connection to the least busy worker */
+	void Attach(SQLProvider* conn)
+	{
+		SQLWorker* best = workers[0];
+		for (std::vector<SQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+			if ((*i)->conns < best->conns)
+				best = *i;
+		best->conns++;
+		affinity[conn] = best;
+	}
+
+	/** Fail the jobs waiting on a connection and wait for the one running on it,
+	 * after which the connection may be deleted
+	 */
+	void Detach(SQLProvider* conn)
+	{
+		std::map<SQLProvider*, SQLWorker*>::iterator i = affinity.find(conn);
+		if (i == affinity.end())
+			return;
+		SQLWorker* worker = i->second;
+		worker->conns--;
+		affinity.erase(i);
+
+		SQLCancelled cancelled;
+		worker->LockQueue();
+		worker->CancelJobs(conn, NULL, cancelled);
+		bool busy = worker->current && worker->current->conn == conn;
+		worker->UnlockQueue();
+		cancelled.Fail(SQL_BAD_DBID);
+		if (busy)
+		{
+			worker->running.Lock();
+			worker->running.Unlock();
+		}
+	}
+
+	/** Queue a job on the worker which owns its connection */
+	void Submit(SQLJob* job)
+	{
+		std::map<SQLProvider*, SQLWorker*>::iterator i = affinity.find(job->conn);
+		if (i == affinity.end())
+		{
+			job->Cancel(SQL_BAD_DBID);
+			delete job;
+			return;
+		}
+		SQLWorker* worker = i->second;
+		worker->LockQueue();
+		worker->pending.push_back(job);
+		worker->UnlockQueueWakeup();
+	}
+
+	/** Cancel every query made by a module which is unloading */
+	void Cancel(Module* mod)
+	{
+		for (std::vector<SQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			SQLCancelled cancelled;
+			(*i)->LockQueue();
+			(*i)->CancelJobs(NULL, mod, cancelled);
+			(*i)->UnlockQueue();
+			cancelled.Fail(SQL_BAD_DBID);
+		}
+	}
+};
+
 #endif
@@ -0,0 +1,134 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+
+bool Profiler::enabled = false;
+
+/* In the order of enum Implementation */
+static const char* const HookNames[] = {
+	"BEGIN", "OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart",
+	"OnRehash", "OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper",
+	"OnInfo", "OnWhois", "OnUserPreInvite", "OnUserInvite", "OnUserPreMessage", "OnUserPreNotice",
+	"OnUserPreNick", "OnUserMessage", "OnUserNotice", "OnMode", "OnGetServerDescription",
+	"OnSyncUser", "OnSyncChannel", "OnDecodeMetaData", "OnWallops", "OnAcceptConnection",
+	"OnUserInit", "OnChangeHost", "OnChangeName", "OnAddLine", "OnDelLine", "OnExpireLine",
+	"OnUserPostNick", "OnPreMode", "On005Numeric", "OnKill", "OnRemoteKill", "OnLoadModule",
+	"OnUnloadModule", "OnBackgroundTimer", "OnPreCommand", "OnCheckReady", "OnCheckInvite",
+	"OnRawMode", "OnCheckKey", "OnCheckLimit", "OnCheckBan", "OnCheckChannelBan", "OnExtBanCheck",
+	"OnStats", "OnChangeLocalUserHost", "OnPreTopicChange", "OnPostTopicChange", "OnEvent",
+	"OnGlobalOper", "OnPostConnect", "OnAddBan", "OnDelBan", "OnChangeLocalUserGECOS",
+	"OnUserRegister", "OnChannelPreDelete", "OnChannelDelete", "OnPostOper", "OnSyncNetwork",
+	"OnSetAway", "OnPostCommand", "OnPostJoin", "OnWhoisLine", "OnNeighborChannel",
+	"OnNeighborMember", "OnGarbageCollect", "OnSetConnectClass", "OnText", "OnPassCompare",
+	"OnRunTestSuite", "OnNamesListItem", "OnNumeric", "OnHookIO", "OnPreRehash", "OnModuleRehash",
+	"OnSendWhoLine", "OnChangeIdent", "OnNamesListStyle"
+};
+
+/* Fails to compile if a hook is added without being named above */
+typedef char HookNamesMatchImplementation[sizeof(HookNames) / sizeof(*HookNames) == I_END ? 1 : -1];
+
+Profiler::Histogram::Histogram() : count(0), total(0), max(0)
+{
+	memset(buckets, 0, sizeof(buckets));
+}
+
+void Profiler::Histogram::Add(uint64_t time)
+{
+	unsigned int i = 0;
+	while (i < BUCKETS - 1 && (time >> i))
+		i++;
+	buckets[i]++;
+	count++;
+	total += time;
+	if (time > max)
+		max = time;
+}
+
+uint64_t Profiler::Histogram::Percentile(unsigned int pct) const
+{
+	unsigned long want = (count * pct + 99) / 100;
+	unsigned long seen = 0;
+	for (unsigned int i = 0; i < BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= want)
+			return std::min((uint64_t)1 << i, max);
+	}
+	return max;
+}
+
+Profiler::Profiler() : startticks(0), startsecs(0), startnsecs(0)
+{
+}
+
+void Profiler::SetEnabled(bool on)
+{
+	if (on == enabled)
+		return;
+
+	enabled = on;
+	if (on)
+	{
+		commands.clear();
+		hooks.clear();
+		startticks = Ticks();
+		startsecs = ServerInstance->Time();
+		startnsecs = ServerInstance->Time_ns();
+	}
+}
+
+void Profiler::AddCommand(const std::string& name, uint64_t start)
+{
+	commands[name].Add(Ticks() - start);
+}
+
+void Profiler::AddHook(Module* mod, int hook, uint64_t start)
+{
+	uint64_t ticks = Ticks() - start;
+	/* Profiling may have been turned off by the hook being timed */
+	if (enabled)
+		ServerInstance->Profile.hooks[std::make_pair(mod, hook)].Add(ticks);
+}
+
+void Profiler::Forget(Module* mod)
+{
+	HookMap::iterator i = hooks.lower_bound(std::make_pair(mod, 0));
+	while (i != hooks.end() && i->first.first == mod)
+		hooks.erase(i++);
+}
+
+double Profiler::TicksPerMicrosecond()
+{
+	double usecs = (ServerInstance->Time() - startsecs) * 1000000.0 + (ServerInstance->Time_ns() - startnsecs) / 1000.0;
+	if (usecs < 1)
+		return 1;
+	return (Ticks() - startticks) / usecs;
+}
+
+std::string Profiler::Format(const Histogram& hist)
+{
+	double scale = TicksPerMicrosecond();
+	char buffer[MAXBUF];
+	snprintf(buffer, MAXBUF, "calls %lu total %.0fus avg %.1fus p50<%.1fus p99<%.1fus max %.1fus", hist.count,
+		hist.total / scale, hist.total / scale / std::max(hist.count, 1UL), hist.Percentile(50) / scale,
+		hist.Percentile(99) / scale, hist.max / scale);
+	return buffer;
+}
+
+const char* Profiler::HookName(int hook)
+{
+	if (hook < 0 || hook >= I_END)
+		return "unknown";
+	return HookNames[hook];
+}
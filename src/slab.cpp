@@ -0,0 +1,75 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+
+/* Pools are created during static initialisation, so the registry must be
+ * constructed on first use rather than being a plain static.
+ */
+static std::vector<SlabPool*>& PoolList()
+{
+	static std::vector<SlabPool*> pools;
+	return pools;
+}
+
+/* Blocks are aligned as strictly as the allocator aligns anything */
+static const size_t SLAB_ALIGN = 2 * sizeof(void*);
+
+SlabPool::SlabPool(const char* Name, size_t Size, size_t PerSlab)
+	: name(Name), size((std::max(Size, sizeof(FreeBlock)) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1)),
+	perslab(PerSlab), freelist(NULL), inuse(0)
+{
+	PoolList().push_back(this);
+}
+
+SlabPool::~SlabPool()
+{
+	std::vector<SlabPool*>& pools = PoolList();
+	pools.erase(std::remove(pools.begin(), pools.end(), this), pools.end());
+
+	/* Anything still allocated at shutdown keeps its slab */
+	if (inuse)
+		return;
+	for (std::vector<char*>::iterator i = slabs.begin(); i != slabs.end(); ++i)
+		::operator delete(*i);
+}
+
+void SlabPool::Grow()
+{
+	char* slab = static_cast<char*>(::operator new(size * perslab));
+	slabs.push_back(slab);
+
+	/* Thread the new blocks onto the free list in address order */
+	for (size_t i = perslab; i-- > 0; )
+	{
+		FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + i * size);
+		block->next = freelist;
+		freelist = block;
+	}
+}
+
+const std::vector<SlabPool*>& SlabPool::GetPools()
+{
+	return PoolList();
+}
+
+SlabPool* SlabPool::ForSize(size_t size)
+{
+	static std::map<size_t, SlabPool*> bysize;
+
+	size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	std::map<size_t, SlabPool*>::iterator i = bysize.find(size);
+	if (i == bysize.end())
+		i = bysize.insert(std::make_pair(size, new SlabPool("node", size))).first;
+	return i->second;
+}
@@ -184,7 +184,7 @@ int EPollEngine::DispatchEvents()
 {
 	socklen_t codesize = sizeof(int);
 	int errcode;
-	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, 1000);
+	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, trials.empty() ? 1000 : 0);
 	ServerInstance->UpdateTime();
 
 	TotalEvents += i;
@@ -200,7 +200,7 @@ void KQueueEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 int KQueueEngine::DispatchEvents()
 {
 	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_sec = trials.empty() ? 1 : 0;
 
 	int i = kevent(EngineHandle, NULL, 0, &ke_list[0], GetMaxFds(), &ts);
 	ServerInstance->UpdateTime();
@@ -217,7 +217,7 @@ void PollEngine::DelFd(EventHandler* eh)
 
 int PollEngine::DispatchEvents()
 {
-	int i = poll(events, CurrentSetSize, 1000);
+	int i = poll(events, CurrentSetSize, trials.empty() ? 1000 : 0);
 	int index;
 	socklen_t codesize = sizeof(int);
 	int errcode;
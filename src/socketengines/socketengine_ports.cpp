@@ -149,7 +149,7 @@ int PortsEngine::DispatchEvents()
 {
 	struct timespec poll_time;
 
-	poll_time.tv_sec = 1;
+	poll_time.tv_sec = trials.empty() ? 1 : 0;
 	poll_time.tv_nsec = 0;
 
 	unsigned int nget = 1; // used to denote a retrieve request.
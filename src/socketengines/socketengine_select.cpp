@@ -113,8 +113,8 @@ int SelectEngine::DispatchEvents()
 		FD_SET (i, &errfdset);
 	}
 
-	/* One second wait */
-	tval.tv_sec = 1;
+	/* One second wait, unless there are trial reads or writes to do */
+	tval.tv_sec = trials.empty() ? 1 : 0;
 	tval.tv_usec = 0;
 
 	sresult = select(FD_SETSIZE, &rfdset, &wfdset, &errfdset, &tval);
@@ -171,6 +171,17 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Channels: "+ConvToStr(this->chanlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Commands: "+ConvToStr(this->Parser->cmdlist.size()));
 
+			unsigned long logqueued, logdropped;
+			this->Logs->GetQueueStats(logqueued, logdropped);
+			results.push_back(sn+" 249 "+user->nick+" :Log lines queued: "+ConvToStr(logqueued)+" dropped: "+ConvToStr(logdropped));
+			results.push_back(sn+" 249 "+user->nick+" :Pooled strings: "+ConvToStr(this->Strings.size()));
+
+			const std::vector<SlabPool*>& pools = SlabPool::GetPools();
+			for (std::vector<SlabPool*>::const_iterator i = pools.begin(); i != pools.end(); ++i)
+				if ((*i)->GetCapacity())
+					results.push_back(sn+" 249 "+user->nick+" :Slab "+(*i)->GetName()+" ("+ConvToStr((*i)->GetSize())+" bytes): "+
+						ConvToStr((*i)->GetInUse())+" of "+ConvToStr((*i)->GetCapacity())+" in use");
+
 			if (!this->Config->WhoWasGroupSize == 0 && !this->Config->WhoWasMaxGroups == 0)
 			{
 				Module* whowas = Modules->Find("cmd_whowas.so");
@@ -246,7 +257,7 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :accepts "+ConvToStr(this->stats->statsAccept)+" refused "+ConvToStr(this->stats->statsRefused));
 			results.push_back(sn+" 249 "+user->nick+" :unknown commands "+ConvToStr(this->stats->statsUnknown));
 			results.push_back(sn+" 249 "+user->nick+" :nick collisions "+ConvToStr(this->stats->statsCollisions));
-			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(this->stats->statsDnsGood+this->stats->statsDnsBad)+" succeeded "+ConvToStr(this->stats->statsDnsGood)+" failed "+ConvToStr(this->stats->statsDnsBad));
+			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(this->stats->statsDnsGood+this->stats->statsDnsBad)+" succeeded "+ConvToStr(this->stats->statsDnsGood)+" failed "+ConvToStr(this->stats->statsDnsBad)+" coalesced "+ConvToStr(this->stats->statsDnsCoalesced));
 			results.push_back(sn+" 249 "+user->nick+" :connection count "+ConvToStr(this->stats->statsConnects));
 			snprintf(buffer,MAXBUF," 249 %s :bytes sent %5.2fK recv %5.2fK",
 				user->nick.c_str(),this->stats->statsSent / 1024.0,this->stats->statsRecv / 1024.0);
@@ -254,6 +265,30 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 		}
 		break;
 
+		/* stats F (time taken by commands and module hooks, busiest first) */
+		case 'F':
+		{
+			if (!Profiler::enabled)
+			{
+				results.push_back(sn+" 249 "+user->nick+" :Profiling is off; set <performance:profile> and rehash to turn it on");
+				break;
+			}
+
+			std::vector<std::pair<uint64_t, std::string> > lines;
+			const Profiler::CommandMap& commands = Profile.GetCommands();
+			for (Profiler::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+				lines.push_back(std::make_pair(i->second.total, "Command " + i->first + ": " + Profile.Format(i->second)));
+			const Profiler::HookMap& hooks = Profile.GetHooks();
+			for (Profiler::HookMap::const_iterator i = hooks.begin(); i != hooks.end(); ++i)
+				lines.push_back(std::make_pair(i->second.total, "Hook " + i->first.first->ModuleSourceFile + " " +
+					Profiler::HookName(i->first.second) + ": " + Profile.Format(i->second)));
+
+			std::sort(lines.begin(), lines.end());
+			for (std::vector<std::pair<uint64_t, std::string> >::reverse_iterator i = lines.rbegin(); i != lines.rend(); ++i)
+				results.push_back(sn+" 249 "+user->nick+" :"+i->second);
+		}
+		break;
+
 		/* stats o */
 		case 'o':
 		{
@@ -57,6 +57,8 @@ TestSuite::TestSuite()
 		cout << "(5) Wildcard and CIDR tests\n";
 		cout << "(6) Comma sepstream tests\n";
 		cout << "(7) Space sepstream tests\n";
+		cout << "(8) DNS resolver tests\n";
+		cout << "(9) Nick and channel hash tests\n";
 
 		cout << endl << "(X) Exit test suite\n";
 
@@ -97,6 +99,12 @@ TestSuite::TestSuite()
 			case '7':
 				cout << (DoSpaceSepStreamTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '8':
+				cout << (DoDNSTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case '9':
+				cout << (DoHashTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -319,6 +327,380 @@ bool TestSuite::DoThreadTests()
 	return true;
 }
 
+/** A stand-in DNS server on a local UDP port. It answers A lookups for
+ * names starting with "nx" with NXDOMAIN, ignores names starting with
+ * "slow" so that they time out, answers other A lookups with 10.0.0.1
+ * and answers every PTR lookup with "reverse.example". Answers to names
+ * starting with "short" have a TTL of 5 seconds, the rest 60 seconds.
+ */
+class TestDNSServer : public EventHandler
+{
+ public:
+	int queries;
+	irc::sockets::sockaddrs addr;
+
+	TestDNSServer() : queries(0)
+	{
+		irc::sockets::aptosa("127.0.0.1", 0, addr);
+		SetFd(socket(AF_INET, SOCK_DGRAM, 0));
+		ServerInstance->SE->NonBlocking(fd);
+		ServerInstance->SE->Bind(fd, addr);
+		socklen_t len = sizeof(addr);
+		getsockname(fd, &addr.sa, &len);
+		ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+	}
+
+	~TestDNSServer()
+	{
+		ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(this);
+	}
+
+	void HandleEvent(EventType, int)
+	{
+		unsigned char buf[512];
+		irc::sockets::sockaddrs from;
+		socklen_t fromlen = sizeof(from);
+		int len = recvfrom(fd, (char*)buf, sizeof(buf), 0, &from.sa, &fromlen);
+		if (len < 17)
+			return;
+		queries++;
+
+		/* Find the end of the question and read the name out of it */
+		std::string name;
+		int pos = 12;
+		while (pos < len && buf[pos])
+		{
+			if (!name.empty())
+				name.push_back('.');
+			name.append((const char*)&buf[pos + 1], buf[pos]);
+			pos += buf[pos] + 1;
+		}
+		pos += 5;
+		if (pos > len)
+			return;
+		int qtype = (buf[pos - 4] << 8) | buf[pos - 3];
+
+		if (name.compare(0, 4, "slow") == 0)
+			return;
+
+		unsigned char reply[512];
+		memcpy(reply, buf, pos);
+		reply[2] = 0x81;
+		reply[3] = 0x80;
+		reply[6] = reply[8] = reply[9] = reply[10] = reply[11] = 0;
+		reply[7] = 1;
+		int rlen = pos;
+		if (name.compare(0, 2, "nx") == 0)
+		{
+			reply[3] |= 3;
+			reply[7] = 0;
+		}
+		else
+		{
+			static const unsigned char rr[] = { 0xC0, 0x0C, 0, 0, 0, 1, 0, 0, 0, 60 };
+			memcpy(&reply[rlen], rr, sizeof(rr));
+			reply[rlen + 3] = qtype;
+			if (name.compare(0, 5, "short") == 0)
+				reply[rlen + 9] = 5;
+			rlen += sizeof(rr);
+			if (qtype == DNS_QUERY_A)
+			{
+				static const unsigned char rdata[] = { 0, 4, 10, 0, 0, 1 };
+				memcpy(&reply[rlen], rdata, sizeof(rdata));
+				rlen += sizeof(rdata);
+			}
+			else
+			{
+				static const unsigned char rdata[] = { 0, 17, 7, 'r', 'e', 'v', 'e', 'r', 's', 'e', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0 };
+				memcpy(&reply[rlen], rdata, sizeof(rdata));
+				rlen += sizeof(rdata);
+			}
+		}
+		sendto(fd, (const char*)reply, rlen, 0, &from.sa, fromlen);
+	}
+};
+
+/** Counts the results of the lookups made by DoDNSTests */
+class TestResolver : public Resolver
+{
+ public:
+	static int results, errors, timeouts;
+	static std::string last;
+
+	TestResolver(const std::string& source, QueryType qt, bool& cached, Module* creator = NULL) : Resolver(source, qt, cached, creator) { }
+
+	void OnLookupComplete(const std::string& result, unsigned int, bool)
+	{
+		results++;
+		last = result;
+	}
+
+	void OnError(ResolverError e, const std::string&)
+	{
+		if (e == RESOLVER_TIMEOUT)
+			timeouts++;
+		else
+			errors++;
+	}
+};
+
+int TestResolver::results = 0;
+int TestResolver::errors = 0;
+int TestResolver::timeouts = 0;
+std::string TestResolver::last;
+
+/* Run the event loop until the given number of lookups have finished */
+static void PumpLookups(int count, int seconds)
+{
+	time_t end = ServerInstance->Time() + seconds;
+	while (ServerInstance->Time() <= end && TestResolver::results + TestResolver::errors + TestResolver::timeouts < count)
+	{
+		ServerInstance->SE->DispatchEvents();
+		ServerInstance->UpdateTime();
+		ServerInstance->Timers->TickTimers(ServerInstance->Time());
+	}
+}
+
+/* Start a lookup against the stand-in server and run the event loop until it is answered */
+static void TestLookup(const std::string& source, QueryType qt, int seconds = 1)
+{
+	bool cached;
+	TestResolver::results = TestResolver::errors = TestResolver::timeouts = 0;
+	try
+	{
+		TestResolver* r = new TestResolver(source, qt, cached);
+		ServerInstance->AddResolver(r, cached);
+	}
+	catch (ModuleException& e)
+	{
+		cout << "Lookup of " << source << " failed: " << e.GetReason() << endl;
+		return;
+	}
+	time_t end = ServerInstance->Time() + seconds;
+	while (ServerInstance->Time() <= end)
+	{
+		ServerInstance->SE->DispatchEvents();
+		ServerInstance->UpdateTime();
+		ServerInstance->Timers->TickTimers(ServerInstance->Time());
+		if (cached || TestResolver::results + TestResolver::errors + TestResolver::timeouts)
+			break;
+	}
+}
+
+#define DNSTEST(x, y) cout << x << ((passed = (y)) ? " SUCCESS!\n" : " FAILURE\n"); if (!passed) allpassed = false
+
+bool TestSuite::DoDNSTests()
+{
+	cout << "\n\nDNS resolver tests\n\n";
+	bool passed = false, allpassed = true;
+
+	if (ServerInstance->Res->myserver.sa.sa_family != AF_INET)
+	{
+		cout << "The resolver must be using an IPv4 <dns:server> for this test\n";
+		return false;
+	}
+
+	TestDNSServer* server = new TestDNSServer;
+	irc::sockets::sockaddrs oldserver = ServerInstance->Res->myserver;
+	unsigned int oldcachesize = ServerInstance->Config->dns_cachesize;
+	ServerInstance->Res->myserver = server->addr;
+	ServerInstance->Res->ClearCache();
+
+	TestLookup("one.example", DNS_QUERY_A);
+	DNSTEST("A lookup is answered", TestResolver::results == 1 && TestResolver::last == "10.0.0.1" && server->queries == 1);
+
+	TestLookup("one.example", DNS_QUERY_A);
+	DNSTEST("Repeated A lookup is answered from the cache", TestResolver::results == 1 && server->queries == 1);
+
+	TestLookup("one.example", DNS_QUERY_CNAME);
+	DNSTEST("CNAME lookup of a cached A name is not answered from the cache", server->queries == 2);
+
+	TestLookup("127.0.0.2", DNS_QUERY_PTR4);
+	DNSTEST("PTR lookup is answered", TestResolver::results == 1 && TestResolver::last == "reverse.example" && server->queries == 3);
+
+	TestLookup("nx.example", DNS_QUERY_A);
+	DNSTEST("NXDOMAIN is reported as an error", TestResolver::results == 0 && TestResolver::errors == 1);
+
+	ServerInstance->Config->dns_cachesize = 2;
+	TestLookup("two.example", DNS_QUERY_A);
+	TestLookup("three.example", DNS_QUERY_A);
+	int before = server->queries;
+	TestLookup("one.example", DNS_QUERY_A);
+	DNSTEST("Least recently used item is evicted from a full cache", TestResolver::results == 1 && server->queries == before + 1);
+
+	TestLookup("slow.example", DNS_QUERY_A, ServerInstance->Config->dns_timeout + 4);
+	DNSTEST("Unanswered lookup times out", TestResolver::results == 0 && TestResolver::timeouts == 1);
+
+	ServerInstance->Config->dns_cachesize = oldcachesize;
+	TestLookup("short.example", DNS_QUERY_A);
+	for (int i = 0; i < 3; i++)
+		TestLookup("short.example", DNS_QUERY_A);
+	before = server->queries;
+	while (ServerInstance->Res->GetCache("short.example", DNS_QUERY_A)->CalcTTLRemaining() > 1)
+	{
+		ServerInstance->SE->DispatchEvents();
+		ServerInstance->UpdateTime();
+	}
+	TestLookup("short.example", DNS_QUERY_A);
+	DNSTEST("Frequently used item is answered from the cache and refreshed before expiry", TestResolver::results == 1 && server->queries == before + 1);
+	TestLookup("short.example", DNS_QUERY_A, 2);
+	DNSTEST("Refreshed item has its TTL renewed", ServerInstance->Res->GetCache("short.example", DNS_QUERY_A)->CalcTTLRemaining() > 2);
+
+	before = server->queries;
+	TestResolver::results = TestResolver::errors = TestResolver::timeouts = 0;
+	for (int i = 0; i < 50; i++)
+	{
+		bool cached;
+		TestResolver* r = new TestResolver("many.example", DNS_QUERY_A, cached);
+		ServerInstance->AddResolver(r, cached);
+	}
+	PumpLookups(50, 2);
+	DNSTEST("Identical lookups in flight share one query", TestResolver::results == 50 && server->queries == before + 1);
+
+	Module* mod = ServerInstance->Modules->Find("cmd_who.so");
+	if (mod)
+	{
+		TestResolver::results = TestResolver::errors = TestResolver::timeouts = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			bool cached;
+			TestResolver* r = new TestResolver("slow.example", DNS_QUERY_A, cached, (i == 1 || i == 2) ? mod : NULL);
+			ServerInstance->AddResolver(r, cached);
+		}
+		ServerInstance->Res->CleanResolvers(mod);
+		DNSTEST("Unloading a module only cancels its share of a lookup", TestResolver::errors == 2 && TestResolver::timeouts == 0);
+		PumpLookups(4, ServerInstance->Config->dns_timeout + 4);
+		DNSTEST("Remaining sharers of a lookup are told it timed out", TestResolver::timeouts == 2);
+	}
+
+	int ids = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		bool cached;
+		TestResolver* r = new TestResolver("slow" + ConvToStr(i) + ".example", DNS_QUERY_A, cached);
+		if (ServerInstance->AddResolver(r, cached))
+			ids++;
+	}
+	DNSTEST("1000 lookups in flight get unique ids", ids == 1000);
+
+	ServerInstance->Res->myserver = oldserver;
+	ServerInstance->Config->dns_cachesize = oldcachesize;
+	ServerInstance->Res->ClearCache();
+	delete server;
+
+	return allpassed;
+}
+
+/** The user_hash of old, for comparison */
+#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
+typedef nspace::hash_compare<std::string, std::less<std::string> > legacy_hash;
+typedef nspace::hash_map<std::string, User*, legacy_hash> legacy_user_hash;
+#else
+	#ifdef HASHMAP_DEPRECATED
+		typedef nspace::insensitive legacy_hash;
+	#else
+		typedef nspace::hash<std::string> legacy_hash;
+	#endif
+typedef nspace::hash_map<std::string, User*, legacy_hash, irc::StrHashComp> legacy_user_hash;
+#endif
+
+/* Names which all have the same unseeded hash. With t = 5 * t + c, the
+ * two character blocks "aK" and "bF" hash alike (even casefolded), so
+ * every string of n such blocks does too.
+ */
+static void CollidingNames(std::vector<std::string>& names, unsigned int blocks)
+{
+	for (unsigned long i = 0; i < (1UL << blocks); i++)
+	{
+		std::string name;
+		for (unsigned int b = 0; b < blocks; b++)
+			name.append((i & (1UL << b)) ? "bF" : "aK");
+		names.push_back(name);
+	}
+}
+
+/* Time how long it takes to add then find every name, in nanoseconds per name */
+template<typename T> static double TimeLookups(const std::vector<std::string>& names)
+{
+	timespec start, end;
+	T table;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+		table[*i] = NULL;
+	for (int rounds = 0; rounds < 10; rounds++)
+		for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+			table.find(*i);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / names.size();
+}
+
+#define HASHTEST(x, y) cout << x << ((passed = (y)) ? " SUCCESS!\n" : " FAILURE\n"); if (!passed) allpassed = false
+
+bool TestSuite::DoHashTests()
+{
+	cout << "\n\nNick and channel hash tests\n\n";
+	bool passed = false, allpassed = true;
+
+	user_hash table;
+	User* u = reinterpret_cast<User*>(&table);
+	table["Nick[1]"] = u;
+	HASHTEST("Lookup ignores case and RFC1459 equivalents", table.find("nICK{1}") != table.end() && table.find("nick{1}")->second == u);
+	HASHTEST("Inserting an existing name keeps the first item", !table.insert(std::make_pair(std::string("NICK[1]"), (User*)NULL)).second && table.size() == 1);
+
+	for (int i = 0; i < 100000; i++)
+		table[ConvToStr(i)] = u;
+	int found = 0;
+	for (int i = 0; i < 100000; i++)
+		if (table.find(ConvToStr(i)) != table.end())
+			found++;
+	HASHTEST("100000 items can be found after the table grows", found == 100000 && table.size() == 100001);
+
+	for (user_hash::iterator i = table.begin(); i != table.end(); )
+	{
+		if (i->first.length() == 5)
+			table.erase(i++);
+		else
+			i++;
+	}
+	found = 0;
+	for (int i = 0; i < 100000; i++)
+		if (table.find(ConvToStr(i)) != table.end())
+			found++;
+	HASHTEST("Erasing while iterating removes only those items", found == 10000 && table.size() == 10001);
+
+	irc::insensitive_hash h1, h2;
+	irc::insensitive_hash same(h1.k0, h1.k1);
+	HASHTEST("Hashes are seeded differently and repeatably", h1("Nick") != h2("Nick") && h1("Nick") == same("NICK"));
+
+	std::vector<std::string> attack;
+	CollidingNames(attack, 13);
+	legacy_hash legacy;
+	std::set<size_t> legacyvalues, values, slots;
+	for (std::vector<std::string>::iterator i = attack.begin(); i != attack.end(); ++i)
+	{
+		legacyvalues.insert(legacy(*i));
+		values.insert(h1(*i));
+		slots.insert(h1(*i) & 16383);
+	}
+	cout << attack.size() << " crafted names have " << legacyvalues.size() << " unseeded hash value(s), "
+		<< values.size() << " seeded values in " << slots.size() << " of 16384 slots\n";
+	HASHTEST("Crafted names collide without a seed", legacyvalues.size() == 1);
+	HASHTEST("Crafted names do not collide with a seed", values.size() == attack.size() && slots.size() > attack.size() / 2);
+
+	std::vector<std::string> random;
+	for (unsigned int i = 0; i < attack.size(); i++)
+		random.push_back(ServerInstance->GenRandomStr(26));
+	double legacyattack = TimeLookups<legacy_user_hash>(attack);
+	double newattack = TimeLookups<user_hash>(attack);
+	double legacyrandom = TimeLookups<legacy_user_hash>(random);
+	double newrandom = TimeLookups<user_hash>(random);
+	/* Timings depend on the machine, so they are only shown; the slot spread above is what is checked */
+	cout << "ns per name, random/crafted: hash_map " << legacyrandom << "/" << legacyattack << ", user_hash " << newrandom << "/" << newattack << "\n";
+
+	return allpassed;
+}
+
 TestSuite::~TestSuite()
 {
 	cout << "\n\n*** END OF TEST SUITE ***\n";
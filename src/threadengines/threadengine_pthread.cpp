@@ -73,6 +73,9 @@ class ThreadSignalSocket : public EventHandler
 
 	~ThreadSignalSocket()
 	{
+		if (ServerInstance->SE->GetRef(fd) == this)
+			ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(this);
 	}
 
 	void Notify()
@@ -90,7 +93,8 @@ class ThreadSignalSocket : public EventHandler
 		}
 		else
 		{
-			ServerInstance->GlobalCulls.AddItem(this);
+			/* The owning SocketThread deletes us; just stop listening */
+			ServerInstance->SE->DelFd(this);
 		}
 	}
 };
@@ -119,6 +123,9 @@ class ThreadSignalSocket : public EventHandler
 
 	~ThreadSignalSocket()
 	{
+		if (ServerInstance->SE->GetRef(fd) == this)
+			ServerInstance->SE->DelFd(this);
+		ServerInstance->SE->Close(this);
 		close(send_fd);
 	}
 
@@ -138,7 +145,8 @@ class ThreadSignalSocket : public EventHandler
 		}
 		else
 		{
-			ServerInstance->GlobalCulls.AddItem(this);
+			/* The owning SocketThread deletes us; just stop listening */
+			ServerInstance->SE->DelFd(this);
 		}
 	}
 };
@@ -159,4 +167,6 @@ void SocketThread::NotifyParent()
 
 SocketThread::~SocketThread()
 {
+	/* A notification may still be waiting, and must not reach a deleted thread */
+	delete signal.sock;
 }
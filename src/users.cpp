@@ -186,8 +186,30 @@ const char* User::FormatModes(bool showparameters)
 	return data;
 }
 
+static SlabPool localuserpool("LocalUser", sizeof(LocalUser), 64);
+static SlabPool remoteuserpool("RemoteUser", sizeof(RemoteUser));
+
+void* User::operator new(size_t size)
+{
+	if (size == sizeof(LocalUser))
+		return localuserpool.Allocate();
+	if (size == sizeof(RemoteUser))
+		return remoteuserpool.Allocate();
+	return ::operator new(size);
+}
+
+void User::operator delete(void* ptr, size_t size)
+{
+	if (size == sizeof(LocalUser))
+		localuserpool.Deallocate(ptr);
+	else if (size == sizeof(RemoteUser))
+		remoteuserpool.Deallocate(ptr);
+	else
+		::operator delete(ptr);
+}
+
 User::User(const std::string &uid, const std::string& sid, int type)
-	: uuid(uid), server(sid), usertype(type)
+	: uuid(uid), server(ServerInstance->Strings.Add(sid)), usertype(type)
 {
 	age = ServerInstance->Time();
 	signon = idle_lastmsg = 0;
@@ -220,6 +242,7 @@ User::~User()
 {
 	if (ServerInstance->Users->uuidlist->find(uuid) != ServerInstance->Users->uuidlist->end())
 		ServerInstance->Logs->Log("USERS", DEFAULT, "User destructor for %s called without cull", uuid.c_str());
+	ServerInstance->Strings.Remove(server);
 }
 
 const std::string& User::MakeHost()
@@ -837,6 +860,23 @@ void LocalUser::FullConnect()
 	CommandFloodPenalty = 0;
 }
 
+/** Take a user out of the NAMES replies cached for their channels before
+ * their nick or host changes, and put them back in afterwards.
+ */
+static void UpdateNames(User* user, bool adding)
+{
+	for (UCListIter i = user->chans.begin(); i != user->chans.end(); i++)
+	{
+		Membership* memb = (*i)->GetUser(user);
+		if (!memb)
+			continue;
+		if (adding)
+			(*i)->names.Add(memb);
+		else
+			(*i)->names.Remove(memb);
+	}
+}
+
 void User::InvalidateCache()
 {
 	/* Invalidate cache */
@@ -943,9 +983,11 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 	if (this->registered == REG_ALL)
 		this->WriteCommon("NICK %s",newnick.c_str());
 	std::string oldnick = nick;
+	UpdateNames(this, false);
 	nick = newnick;
 
 	InvalidateCache();
+	UpdateNames(this, true);
 	ServerInstance->Users->clientlist->erase(oldnick);
 	(*(ServerInstance->Users->clientlist))[newnick] = this;
 
@@ -1035,6 +1077,20 @@ void LocalUser::Write(const std::string& text)
 	this->cmds_out++;
 }
 
+void LocalUser::WriteLines(const std::string& text, unsigned int count)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
+		return;
+
+	ServerInstance->Logs->Log("USEROUTPUT", RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+
+	eh.AddWriteBuf(text);
+
+	ServerInstance->stats->statsSent += text.length();
+	this->bytes_out += text.length();
+	this->cmds_out += count;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -1174,46 +1230,67 @@ void User::WriteCommonExcept(const char* text, ...)
 	this->WriteCommonRaw(std::string(textbuffer), false);
 }
 
-void User::WriteCommonRaw(const std::string &line, bool include_self)
+void User::ForEachNeighbor(NeighborVisitor& visitor, bool include_self)
 {
-	if (this->registered != REG_ALL || quitting)
-		return;
-
-	LocalUser::already_sent_id++;
-
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
-
-	exceptions[this] = include_self;
-
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
+	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	LocalUser* self = IS_LOCAL(this);
+	if (self)
 	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
-		{
-			u->already_sent = LocalUser::already_sent_id;
-			if (i->second)
-				u->Write(line);
-		}
+		self->already_sent = uniq_id;
+		if (include_self && !self->quitting)
+			visitor.Visit(self);
 	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+
+	for (UCListIter v = chans.begin(); v != chans.end(); ++v)
 	{
 		Channel* c = *v;
+		Membership* memb = c->GetUser(this);
+		ModResult hidden;
+		FIRST_MOD_RESULT(OnNeighborChannel, hidden, (memb));
+
 		const UserMembList* ulist = c->GetUsers();
 		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
+			if (!u || u->quitting || u->already_sent == uniq_id)
+				continue;
+			if (hidden == MOD_RES_DENY)
 			{
-				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				ModResult shown;
+				FIRST_MOD_RESULT(OnNeighborMember, shown, (memb, u));
+				if (shown != MOD_RES_ALLOW)
+					continue;
 			}
+			u->already_sent = uniq_id;
+			visitor.Visit(u);
 		}
 	}
 }
 
+/** Writes a line to each neighbor, or one of two lines depending on whether they are an oper */
+class NeighborWriter : public NeighborVisitor
+{
+	const std::string& line;
+	const std::string& operline;
+ public:
+	NeighborWriter(const std::string& Line, const std::string& OperLine) : line(Line), operline(OperLine) {}
+
+	void Visit(LocalUser* user)
+	{
+		user->Write(IS_OPER(user) ? operline : line);
+	}
+};
+
+void User::WriteCommonRaw(const std::string &line, bool include_self)
+{
+	if (this->registered != REG_ALL || quitting)
+		return;
+
+	NeighborWriter writer(line, line);
+	ForEachNeighbor(writer, include_self);
+}
+
 void User::WriteCommonQuit(const std::string &normal_text, const std::string &oper_text)
 {
 	char tb1[MAXBUF];
@@ -1222,41 +1299,13 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 	if (this->registered != REG_ALL)
 		return;
 
-	already_sent_t uniq_id = ++LocalUser::already_sent_id;
-
 	snprintf(tb1,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),normal_text.c_str());
 	snprintf(tb2,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),oper_text.c_str());
 	std::string out1 = tb1;
 	std::string out2 = tb2;
 
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
-
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
-
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
-	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
-		{
-			u->already_sent = uniq_id;
-			if (i->second)
-				u->Write(IS_OPER(u) ? out2 : out1);
-		}
-	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
-	{
-		const UserMembList* ulist = (*v)->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
-		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && (u->already_sent != uniq_id))
-			{
-				u->already_sent = uniq_id;
-				u->Write(IS_OPER(u) ? out2 : out1);
-			}
-		}
-	}
+	NeighborWriter writer(out1, out2);
+	ForEachNeighbor(writer);
 }
 
 void LocalUser::SendText(const std::string& line)
@@ -1363,36 +1412,37 @@ void User::DoHostCycle(const std::string &quitline)
 	if (!ServerInstance->Config->CycleHosts)
 		return;
 
-	already_sent_t silent_id = ++LocalUser::already_sent_id;
 	already_sent_t seen_id = ++LocalUser::already_sent_id;
 
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
-
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
-
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	for (UCListIter v = chans.begin(); v != chans.end(); ++v)
 	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
+		Channel* c = *v;
+		Membership* memb = c->GetUser(this);
+		ModResult hidden;
+		FIRST_MOD_RESULT(OnNeighborChannel, hidden, (memb));
+
+		const UserMembList *ulist = c->GetUsers();
+		if (hidden == MOD_RES_DENY)
 		{
-			if (i->second)
-			{
-				u->already_sent = seen_id;
-				u->Write(quitline);
-			}
-			else
+			/* Members who can see through the module hiding us only see the quit */
+			for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 			{
-				u->already_sent = silent_id;
+				LocalUser* u = IS_LOCAL(i->first);
+				if (u == NULL || u == this || u->quitting || u->already_sent == seen_id)
+					continue;
+				ModResult shown;
+				FIRST_MOD_RESULT(OnNeighborMember, shown, (memb, u));
+				if (shown == MOD_RES_ALLOW)
+				{
+					u->Write(quitline);
+					u->already_sent = seen_id;
+				}
 			}
+			continue;
 		}
-	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
-	{
-		Channel* c = *v;
+
 		snprintf(buffer, MAXBUF, ":%s JOIN %s", GetFullHost().c_str(), c->name.c_str());
 		std::string joinline(buffer);
-		Membership* memb = c->GetUser(this);
 		std::string modeline = memb->modes;
 		if (modeline.length() > 0)
 		{
@@ -1404,14 +1454,11 @@ void User::DoHostCycle(const std::string &quitline)
 			modeline = buffer;
 		}
 
-		const UserMembList *ulist = c->GetUsers();
 		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
 			if (u == NULL || u == this)
 				continue;
-			if (u->already_sent == silent_id)
-				continue;
 
 			if (u->already_sent != seen_id)
 			{
@@ -1443,9 +1490,11 @@ bool User::ChangeDisplayedHost(const char* shost)
 	std::string quitstr = ":" + GetFullHost() + " QUIT :Changing host";
 
 	/* Fix by Om: User::dhost is 65 long, this was truncating some long hosts */
+	UpdateNames(this, false);
 	this->dhost.assign(shost, 0, 64);
 
 	this->InvalidateCache();
+	UpdateNames(this, true);
 
 	this->DoHostCycle(quitstr);
 
@@ -1464,9 +1513,11 @@ bool User::ChangeIdent(const char* newident)
 
 	std::string quitstr = ":" + GetFullHost() + " QUIT :Changing ident";
 
+	UpdateNames(this, false);
 	this->ident.assign(newident, 0, ServerInstance->Config->Limits.IdentMax + 1);
 
 	this->InvalidateCache();
+	UpdateNames(this, true);
 
 	this->DoHostCycle(quitstr);
 
@@ -0,0 +1,60 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* Just enough of the OpenLDAP API for m_ldapauth to build against the
+ * stub library in ldapstub.cpp. See tools/test-ldapauth.pl.
+ */
+
+#ifndef LDAPSTUB_LDAP_H
+#define LDAPSTUB_LDAP_H
+
+#include <sys/time.h>
+
+typedef struct ldap LDAP;
+typedef struct ldapmsg LDAPMessage;
+typedef struct ldapcontrol LDAPControl;
+
+struct berval
+{
+	unsigned long bv_len;
+	char* bv_val;
+};
+
+#define LDAP_SUCCESS			0x00
+#define LDAP_INVALID_CREDENTIALS	0x31
+#define LDAP_SERVER_DOWN		0x51
+#define LDAP_VERSION3			3
+#define LDAP_OPT_PROTOCOL_VERSION	0x0011
+#define LDAP_OPT_TIMEOUT		0x5002
+#define LDAP_OPT_NETWORK_TIMEOUT	0x5005
+#define LDAP_SCOPE_BASE			0
+#define LDAP_SCOPE_ONELEVEL		1
+#define LDAP_SCOPE_SUBTREE		2
+#define LDAP_SASL_SIMPLE		((char*)0)
+
+extern "C"
+{
+	int ldap_initialize(LDAP** ld, const char* uri);
+	int ldap_set_option(LDAP* ld, int option, const void* value);
+	int ldap_unbind_ext(LDAP* ld, LDAPControl** sctrls, LDAPControl** cctrls);
+	const char* ldap_err2string(int err);
+	int ldap_sasl_bind_s(LDAP* ld, const char* dn, const char* mechanism, struct berval* cred, LDAPControl** sctrls, LDAPControl** cctrls, struct berval** servercred);
+	int ldap_search_ext_s(LDAP* ld, const char* base, int scope, const char* filter, char** attrs, int attrsonly, LDAPControl** sctrls, LDAPControl** cctrls, struct timeval* timeout, int sizelimit, LDAPMessage** res);
+	int ldap_count_entries(LDAP* ld, LDAPMessage* res);
+	LDAPMessage* ldap_first_entry(LDAP* ld, LDAPMessage* res);
+	char* ldap_get_dn(LDAP* ld, LDAPMessage* entry);
+	void ldap_memfree(void* p);
+	int ldap_msgfree(LDAPMessage* res);
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *	    the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* A stand-in for libldap which needs no LDAP server, so that
+ * m_ldapauth can be tested. Every search finds the one user "uid=test",
+ * whose password is "good". Binding as that user with the password
+ * "slow" sleeps for LDAPSTUB_DELAY seconds (default 10) before failing,
+ * like a server which has stopped answering. Any other bind DN is the
+ * service account, and always succeeds.
+ *
+ * Build with:
+ *   g++ -shared -fPIC -o libldap.so ldapstub.cpp
+ */
+
+#include "ldap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+struct ldap { int unused; };
+struct ldapmsg { int unused; };
+
+static LDAP conn;
+static LDAPMessage result;
+
+int ldap_initialize(LDAP** ld, const char*)
+{
+	*ld = &conn;
+	return LDAP_SUCCESS;
+}
+
+int ldap_set_option(LDAP*, int, const void*)
+{
+	return LDAP_SUCCESS;
+}
+
+int ldap_unbind_ext(LDAP*, LDAPControl**, LDAPControl**)
+{
+	return LDAP_SUCCESS;
+}
+
+const char* ldap_err2string(int err)
+{
+	switch (err)
+	{
+		case LDAP_SUCCESS:
+			return "Success";
+		case LDAP_INVALID_CREDENTIALS:
+			return "Invalid credentials";
+		case LDAP_SERVER_DOWN:
+			return "Can't contact LDAP server";
+	}
+	return "Unknown error";
+}
+
+int ldap_sasl_bind_s(LDAP*, const char* dn, const char*, struct berval* cred, LDAPControl**, LDAPControl**, struct berval**)
+{
+	if (strcmp(dn, "uid=test") != 0)
+		return LDAP_SUCCESS;
+
+	std::string password(cred->bv_val, cred->bv_len);
+	if (password == "slow")
+	{
+		const char* delay = getenv("LDAPSTUB_DELAY");
+		sleep(delay ? atoi(delay) : 10);
+	}
+	return password == "good" ? LDAP_SUCCESS : LDAP_INVALID_CREDENTIALS;
+}
+
+int ldap_search_ext_s(LDAP*, const char*, int, const char*, char**, int, LDAPControl**, LDAPControl**, struct timeval*, int, LDAPMessage** res)
+{
+	*res = &result;
+	return LDAP_SUCCESS;
+}
+
+int ldap_count_entries(LDAP*, LDAPMessage*)
+{
+	return 1;
+}
+
+LDAPMessage* ldap_first_entry(LDAP*, LDAPMessage* res)
+{
+	return res;
+}
+
+char* ldap_get_dn(LDAP*, LDAPMessage*)
+{
+	return strdup("uid=test");
+}
+
+void ldap_memfree(void* p)
+{
+	free(p);
+}
+
+int ldap_msgfree(LDAPMessage*)
+{
+	return LDAP_SUCCESS;
+}
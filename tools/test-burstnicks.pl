@@ -0,0 +1,202 @@
+#!/usr/bin/perl
+
+#       +------------------------------------+
+#       | Inspire Internet Relay Chat Daemon |
+#       +------------------------------------+
+#
+#  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+# See: http://wiki.inspircd.org/Credits
+#
+#  This program is free but copyrighted software; see
+#          the file COPYING for details.
+#
+# ---------------------------------------------------
+
+# Tests that nick changes made while a netburst is being sent can't make
+# it introduce two users with the same nick. It connects a number of
+# clients, then links to the server as a fake server which stops reading
+# the burst part way through, so that it stalls. While it is stalled, the
+# first user sent gives up their nick and each user not yet sent takes
+# the nick of the one before. The lines received are then replayed in
+# order, failing on any nick which is introduced or taken while another
+# user still holds it, and checking everyone ends up with the nick they
+# changed to.
+#
+# The burst has to be bigger than the server's sendq and socket buffers
+# together, so the users are given long realnames and away messages, and
+# there have to be a lot of them. The server needs m_spanningtree, a link
+# block for the fake server, and a connect class letting that many users
+# in from one IP:
+#   <link name="fake.test" ipaddr="127.0.0.1" port="1"
+#         sendpass="pw" recvpass="pw">
+#   <connect allow="127.0.0.1" localmax="20000" globalmax="20000" ...>
+# and run:
+#   tools/test-burstnicks.pl [host] [clientport] [serverport] [users]
+
+use strict;
+use warnings;
+use IO::Socket::INET;
+use IO::Select;
+use Socket qw(SOL_SOCKET SO_RCVBUF);
+
+my $host = shift || '127.0.0.1';
+my $port = shift || 6667;
+my $linkport = shift || 7000;
+my $count = shift || 12000;
+my $failed = 0;
+
+sub check
+{
+	my ($name, $ok) = @_;
+	print(($ok ? "PASS" : "FAIL") . ": $name\n");
+	$failed++ unless $ok;
+}
+
+# Read from a socket until a line matches, returning the lines read
+sub readuntil
+{
+	my ($sock, $bufref, $pattern, $timeout) = @_;
+	my $sel = IO::Select->new($sock);
+	my @lines;
+	while (1)
+	{
+		while ($$bufref =~ s/^(.*?)\r?\n//)
+		{
+			push @lines, $1;
+			return @lines if $1 =~ $pattern;
+		}
+		die "Timed out waiting for $pattern\n" unless $sel->can_read($timeout);
+		my $n = sysread($sock, $$bufref, 65536, length $$bufref);
+		die "Connection closed waiting for $pattern\n" unless $n;
+	}
+}
+
+# Read everything until nothing has arrived for a while, answering pings
+sub readall
+{
+	my ($sock, $bufref, $idle) = @_;
+	my $sel = IO::Select->new($sock);
+	my @lines;
+	while ($sel->can_read($idle))
+	{
+		last unless sysread($sock, $$bufref, 65536, length $$bufref);
+		while ($$bufref =~ s/^(.*?)\r?\n//)
+		{
+			my $line = $1;
+			print $sock ":$2 PONG $2 $1\r\n" if $line =~ /^:(\S+) PING \S+ (\S+)/;
+			push @lines, $line;
+		}
+	}
+	return @lines;
+}
+
+print "Connecting $count clients\n";
+my @clients;
+for my $i (0 .. $count - 1)
+{
+	my $sock = IO::Socket::INET->new(PeerAddr => $host, PeerPort => $port, Proto => 'tcp')
+		or die "Cannot connect to $host:$port: $!\n";
+	print $sock "NICK bn$i\r\nUSER bn$i * * :" . ('r' x 120) . "\r\n";
+	push @clients, { sock => $sock, nick => "bn$i", buf => '' };
+}
+readuntil($_->{sock}, \$_->{buf}, qr/^:\S+ (?:376|422) /, 30) for @clients;
+# Long away messages make the burst too big for the server to have written
+# out in full by the time we stop reading it
+for (@clients)
+{
+	print {$_->{sock}} "AWAY :" . ('a' x 190) . "\r\n";
+	readuntil($_->{sock}, \$_->{buf}, qr/^:\S+ 306 /, 30);
+}
+
+# A small receive buffer makes the burst back up in the server's sendq
+my $link = IO::Socket::INET->new(PeerAddr => $host, PeerPort => $linkport, Proto => 'tcp')
+	or die "Cannot connect to $host:$linkport: $!\n";
+setsockopt($link, SOL_SOCKET, SO_RCVBUF, 4096);
+my $linkbuf = '';
+print $link "CAPAB START 1202\r\n";
+for my $line (readuntil($link, \$linkbuf, qr/^CAPAB END/, 10))
+{
+	next if $line eq 'CAPAB START 1202';
+	$line =~ s/ CHALLENGE=\S+//;
+	print $link "$line\r\n";
+}
+print $link "SERVER fake.test pw 0 9FK :Burst test\r\n";
+readuntil($link, \$linkbuf, qr/^SERVER /, 10);
+# The server bursts to us once we start our own (empty) burst
+print $link "BURST " . time . "\r\n";
+
+# Stop reading at the first of our users, and change nicks while the burst waits
+my @received = readuntil($link, \$linkbuf, qr/^:\S+ UID \S+ \d+ bn\d+ /, 10);
+my %sent;
+for (@received)
+{
+	$sent{$1} = 1 if /^:\S+ UID \S+ \d+ (bn\d+) /;
+}
+my @waiting = grep { !$sent{$_->{nick}} } @clients;
+my ($first) = grep { $sent{$_->{nick}} } @clients;
+print scalar(@waiting) . " of our users not sent yet; renaming them\n";
+
+my %final;
+my @chain = ($first, @waiting);
+for my $i (0 .. $#chain)
+{
+	my $c = $chain[$i];
+	my $to = $i ? $chain[$i - 1]->{nick} : "bnmoved";
+	my $sock = $c->{sock};
+	print $sock "NICK $to\r\n";
+	readuntil($sock, \$c->{buf}, qr/^:\Q$c->{nick}\E!\S+ NICK :?\Q$to\E$/, 10);
+	$final{$c->{nick}} = $to;
+}
+for (@chain)
+{
+	$_->{nick} = $final{$_->{nick}};
+}
+
+push @received, readall($link, \$linkbuf, 15);
+check("the burst finished", grep { /^:\S+ ENDBURST/ } @received);
+
+# Replay the link, as the other side would see it
+my (%nicks, %uuids, %original, $collisions);
+for (@received)
+{
+	if (/^:\S+ UID (\S+) \d+ (\S+) /)
+	{
+		my ($uuid, $nick) = ($1, lc $2);
+		$original{$2} = $uuid;
+		if ($nicks{$nick})
+		{
+			print "  UID $uuid as $2 while $nicks{$nick} has it\n" unless $collisions++;
+		}
+		$nicks{$nick} = $uuid;
+		$uuids{$uuid} = $nick;
+	}
+	elsif (/^:(\S+) NICK (\S+)/)
+	{
+		my ($uuid, $nick) = ($1, lc $2);
+		if ($nicks{$nick} && $nicks{$nick} ne $uuid)
+		{
+			print "  $uuid NICK $2 while $nicks{$nick} has it\n" unless $collisions++;
+		}
+		delete $nicks{$uuids{$uuid}} if defined $uuids{$uuid};
+		$nicks{$nick} = $uuid;
+		$uuids{$uuid} = $nick;
+	}
+	elsif (/^:(\S+) QUIT/)
+	{
+		delete $nicks{$uuids{$1}} if defined $uuids{$1};
+		delete $uuids{$1};
+	}
+}
+check("no nick was held by two users at once (" . ($collisions || 0) . " collisions)", !$collisions);
+
+my $wrong = 0;
+for my $was (keys %final)
+{
+	my $uuid = $original{$was};
+	$wrong++ unless $uuid && $uuids{$uuid} && $uuids{$uuid} eq lc $final{$was};
+}
+check("every renamed user ends up with their new nick ($wrong wrong)", !$wrong);
+
+close $link;
+close $_->{sock} for @clients;
+exit($failed ? 1 : 0);
@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+
+#       +------------------------------------+
+#       | Inspire Internet Relay Chat Daemon |
+#       +------------------------------------+
+#
+#  InspIRCd: (C) 2002-2010 InspIRCd Development Team
+# See: http://wiki.inspircd.org/Credits
+#
+#  This program is free but copyrighted software; see
+#          the file COPYING for details.
+#
+# ---------------------------------------------------
+
+# Tests m_ldapauth against the stub libldap in tools/ldapstub, checking
+# that a stalled LDAP server refuses the user once <ldapauth:timeout>
+# runs out, and that the cache lets users back in meanwhile.
+#
+# Build the stub and the module against it:
+#   g++ -shared -fPIC -o tools/ldapstub/libldap.so tools/ldapstub/ldapstub.cpp
+#   g++ -shared -fPIC -Iinclude -Isrc/modules -Itools/ldapstub \
+#       -o run/modules/m_ldapauth.so src/modules/extra/m_ldapauth.cpp \
+#       -Ltools/ldapstub -lldap -Wl,-rpath,`pwd`/tools/ldapstub
+# then load it with
+#   <ldapauth server="ldap://stub" attribute="uid" timeout="2"
+#             cachettl="60" killreason="Access denied">
+# and run:
+#   tools/test-ldapauth.pl [host] [port] [timeout]
+
+use strict;
+use warnings;
+use IO::Socket::INET;
+use IO::Select;
+use Time::HiRes qw(time);
+
+my $host = shift || '127.0.0.1';
+my $port = shift || 6667;
+my $timeout = shift || 2;
+my $failed = 0;
+
+sub client
+{
+	my ($nick, $pass) = @_;
+	my $sock = IO::Socket::INET->new(PeerAddr => $host, PeerPort => $port, Proto => 'tcp')
+		or die "Cannot connect to $host:$port: $!\n";
+	print $sock "PASS $pass\r\nNICK $nick\r\nUSER $nick * * :$nick\r\n";
+	return { sock => $sock, nick => $nick, start => time, buf => '' };
+}
+
+# Wait for the client to be welcomed or refused; returns the outcome and how long it took
+sub outcome
+{
+	my ($c, $limit) = @_;
+	my $sel = IO::Select->new($c->{sock});
+	while (time - $c->{start} < $limit)
+	{
+		next unless $sel->can_read(0.1);
+		my $n = sysread($c->{sock}, $c->{buf}, 4096, length $c->{buf});
+		last unless $n;
+		return ('welcome', time - $c->{start}) if $c->{buf} =~ /^:\S+ 001 /m;
+		return ('refused', time - $c->{start}) if $c->{buf} =~ /^ERROR /m;
+	}
+	return ('closed', time - $c->{start}) if $c->{buf} =~ /^ERROR /m || !$c->{sock}->connected;
+	return ('nothing', time - $c->{start});
+}
+
+# Quit and wait for the server to let go of the nick
+sub quit
+{
+	my ($c) = @_;
+	my $sock = $c->{sock};
+	print $sock "QUIT\r\n";
+	my $sel = IO::Select->new($sock);
+	my $buf;
+	while ($sel->can_read(2))
+	{
+		last unless sysread($sock, $buf, 4096);
+	}
+	close $sock;
+}
+
+sub check
+{
+	my ($name, $ok) = @_;
+	print(($ok ? "PASS" : "FAIL") . ": $name\n");
+	$failed++ unless $ok;
+}
+
+my $good = client('ldapgood', 'good');
+my ($res, $took) = outcome($good, $timeout);
+check("a user with the right password is let in ($res)", $res eq 'welcome');
+# Free the nick for the reconnections below
+quit($good);
+
+my $slow = client('ldapslow', 'slow');
+$good = client('ldapgood', 'good');
+($res, $took) = outcome($good, $timeout);
+quit($good);
+check("a user who just authenticated is let in again while another waits on LDAP ($res after " . sprintf('%.1f', $took) . "s)",
+	$res eq 'welcome' && $took < $timeout);
+
+($res, $took) = outcome($slow, $timeout + 3);
+check("a user whose check stalls is refused once the timeout runs out ($res after " . sprintf('%.1f', $took) . "s)",
+	$res eq 'refused' && $took >= $timeout - 0.5 && $took < $timeout + 2);
+
+($res, $took) = outcome(client('ldapgood', 'bad'), $timeout + 3);
+check("a remembered user is refused with the wrong password ($res)", $res eq 'refused');
+
+exit($failed ? 1 : 0);